@@ -0,0 +1,142 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../lchan.h"
+#include "../lctx.h"
+
+/**
+ * ---------------------------------------------------------------
+ * Throughput of a channel between two threads, in messages per
+ * second, for a few capacities. Once through lchan_send and
+ * lchan_recv straight from C, once between two contexts running
+ * dotimes loops of send and recv on a channel they share.
+ *
+ *   cd lisp && gcc -std=gnu99 -O2 -o chan_bench bench/chan.c \
+ *     lval.c lvec.c lbig.c ldict.c lmemo.c lseq.c lcell.c lopt.c \
+ *     leff.c lspec.c lclo.c ljit.c laot.c lctx.c lpool.c lpar.c \
+ *     lchan.c lrcu.c mpc.c -lm -lpthread
+ *   ./chan_bench [messages]
+ * ---------------------------------------------------------------
+ */
+
+long bench_n;
+lchan *bench_chan;
+lisp_ctx *bench_prod;
+lisp_ctx *bench_cons;
+
+double bench_now(void) {
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+void *bench_send(void *arg) {
+  for (long i = 0; i < bench_n; i++)
+    lchan_send(bench_chan, lval_num(i));
+  return NULL;
+}
+
+// Messages per second of lchan_send and lchan_recv on two threads
+double bench_raw(long cap) {
+  bench_chan = lchan_new(cap, LCHAN_BLOCK);
+
+  // Sender runs on a thread of its own, so the channel is lent to it
+  lchan_lend(bench_chan);
+
+  double start = bench_now();
+  pthread_t t;
+  pthread_create(&t, NULL, bench_send, NULL);
+
+  long sum = 0;
+  for (long i = 0; i < bench_n; i++) {
+    lval *v = lchan_recv(bench_chan);
+    sum += v->num;
+    lval_del(v);
+  }
+  pthread_join(t, NULL);
+  double secs = bench_now() - start;
+
+  lchan_return(bench_chan);
+  lchan_release(bench_chan);
+
+  if (sum != bench_n * (bench_n - 1) / 2) {
+    fprintf(stderr, "chan: raw sum %ld is wrong\n", sum);
+    exit(EXIT_FAILURE);
+  }
+  return bench_n / secs;
+}
+
+void *bench_ctx_send(void *arg) {
+  char src[64];
+  snprintf(src, sizeof(src), "(dotimes {i} %ld {send c i})", bench_n);
+  lisp_ctx_eval(bench_prod, src);
+  return NULL;
+}
+
+void *bench_ctx_recv(void *arg) {
+  char src[128];
+  snprintf(src, sizeof(src),
+           "(def {s} 0) (dotimes {i} %ld {def {s} (+ s (recv c))}) s",
+           bench_n);
+  lisp_ctx_eval(bench_cons, src);
+  return NULL;
+}
+
+// Messages per second between two contexts sharing a channel
+double bench_ctx(long cap) {
+  bench_prod = lisp_ctx_new();
+  bench_cons = lisp_ctx_new();
+
+  char src[64];
+  snprintf(src, sizeof(src), "(def {c} (chan %ld))", cap);
+  lisp_ctx_eval(bench_prod, src);
+  lisp_ctx_share(bench_cons, bench_prod, "c");
+  lisp_ctx_clear(bench_prod);
+  lisp_ctx_clear(bench_cons);
+
+  double start = bench_now();
+  pthread_t p, c;
+  pthread_create(&p, NULL, bench_ctx_send, NULL);
+  pthread_create(&c, NULL, bench_ctx_recv, NULL);
+  pthread_join(p, NULL);
+  pthread_join(c, NULL);
+  double secs = bench_now() - start;
+
+  char want[32];
+  snprintf(want, sizeof(want), "%ld\n", bench_n * (bench_n - 1) / 2);
+  const char *got = lisp_ctx_out(bench_cons);
+  if (*lisp_ctx_err(bench_prod) || *lisp_ctx_err(bench_cons) ||
+      strcmp(got + strlen(got) - strlen(want), want) != 0) {
+    fprintf(stderr, "chan: contexts gave %s%s%s", got,
+            lisp_ctx_err(bench_prod), lisp_ctx_err(bench_cons));
+    exit(EXIT_FAILURE);
+  }
+
+  lisp_ctx_del(bench_prod);
+  lisp_ctx_del(bench_cons);
+  return bench_n / secs;
+}
+
+int main(int argc, char **argv) {
+  bench_n = argc > 1 ? atol(argv[1]) : 200000;
+  long caps[] = {1, 16, 1024};
+  int ncaps = sizeof(caps) / sizeof(caps[0]);
+
+  printf("%-22s", "capacity");
+  for (int i = 0; i < ncaps; i++)
+    printf(" %8ld", caps[i]);
+
+  printf("\n%-22s", "lchan_send/recv (C)");
+  for (int i = 0; i < ncaps; i++)
+    printf(" %7.2fM", bench_raw(caps[i]) / 1e6);
+
+  printf("\n%-22s", "two lisp_ctx");
+  for (int i = 0; i < ncaps; i++)
+    printf(" %7.2fM", bench_ctx(caps[i]) / 1e6);
+
+  printf("\n");
+  return 0;
+}
@@ -0,0 +1,50 @@
+#!/bin/sh
+# Time every script of this directory, or the ones named, run as files
+# by the lispy given, default ./lispy. Each runs $BENCH_RUNS times,
+# default 3, and the best wall time is printed. Files only print
+# errors, a script that gives any is reported as failed. Extra
+# arguments after -- go to lispy.
+#
+#   sh bench/run.sh ./lispy [script.lspy...] [-- --closure|--jit]
+
+dir=$(dirname "$0")
+lispy=${1:-./lispy}
+[ $# -gt 0 ] && shift
+runs=${BENCH_RUNS:-3}
+failed=0
+
+scripts=
+while [ $# -gt 0 ] && [ "$1" != "--" ]; do
+    scripts="$scripts $1"
+    shift
+done
+[ "$1" = "--" ] && shift
+[ -z "$scripts" ] && scripts=$(ls "$dir"/*.lspy)
+
+for b in $scripts; do
+    best=
+    i=0
+    while [ $i -lt "$runs" ]; do
+        start=$(date +%s%N)
+        err=$("$lispy" "$@" "$b" 2>&1)
+        end=$(date +%s%N)
+        if [ -n "$err" ]; then
+            best=
+            break
+        fi
+        t=$((end - start))
+        if [ -z "$best" ] || [ $t -lt "$best" ]; then
+            best=$t
+        fi
+        i=$((i + 1))
+    done
+    name=$(basename "$b" .lspy)
+    if [ -z "$best" ]; then
+        printf "%-24s FAIL\n%s\n" "$name" "$err"
+        failed=1
+        continue
+    fi
+    printf "%-24s %s\n" "$name" \
+        "$(awk "BEGIN { printf \"%.3fs\", $best / 1e9 }")"
+done
+exit $failed
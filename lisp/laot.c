@@ -0,0 +1,532 @@
+#include <limits.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "laot.h"
+#include "lclo.h"
+#include "ljit.h"
+#include "lopt.h"
+#include "lval.h"
+
+/**
+ * ---------------------------------------------------------------
+ * Ahead of time compiler. Each top level expression of a program
+ * becomes a C function building and evaluating it in place, so the
+ * binary neither reads nor walks the source. Calls of builtins are
+ * made directly once the arguments are evaluated, and global names
+ * remember the slot of the global environment they were found in.
+ * Lambda bodies are data until called and run on the engines of
+ * the runtime, the ones selected when compiling.
+ * ---------------------------------------------------------------
+ */
+
+// Modules of the runtime linked into compiled programs
+char *laot_runtime[] = {
+    "lval.c",  "lvec.c",  "lbig.c", "ldict.c", "lmemo.c",
+    "lseq.c",  "lcell.c", "lopt.c", "leff.c",  "lspec.c",
+    "lclo.c",  "ljit.c",  "laot.c", "lctx.c",  "lpool.c",
+    "lpar.c",  "lchan.c", "lrcu.c", "mpc.c",
+};
+
+/**
+ * ---------------------------------------------
+ * Runtime, called by compiled code
+ * ---------------------------------------------
+ */
+
+void laot_names(laot_name *n, int count) {
+  for (int i = 0; i < count; i++) {
+    n[i].sym = lval_sym(n[i].name);
+    n[i].epoch = -1;
+    n[i].fn = NULL;
+    n[i].slot = 0;
+  }
+}
+
+// Builtin the name is bound to, resolved again whenever the epoch
+// moved since replacing a function moves it. NULL when it is not a
+// builtin or one that takes its operands as read.
+lbuiltin laot_builtin(lenv *e, laot_name *n) {
+  if (n->epoch != lopt_epoch) {
+    lval *v = lenv_find(e, n->sym);
+    n->fn = v && v->type == LVAL_FUNC && v->builtin && !lfunc_lazy(v)
+                ? v->builtin
+                : NULL;
+    n->epoch = lopt_epoch;
+  }
+  return n->fn;
+}
+
+// Value of global name, from the slot it was last found in
+lval *laot_get(lenv *e, laot_name *n) {
+  int i = n->slot;
+  if (i >= e->count || strcmp(e->syms[i], n->name) != 0) {
+    for (i = 0; i < e->count; i++) {
+      if (strcmp(e->syms[i], n->name) == 0)
+        break;
+    }
+    if (i == e->count)
+      return lenv_get(e, n->sym);
+    n->slot = i;
+  }
+
+  if (e->vals[i]->type == LVAL_CELL)
+    return lenv_get(e, n->sym);
+  return lval_copy(e->vals[i]);
+}
+
+// Empty s-expression with room for count elements
+lval *laot_args(int count) {
+  lval *v = lval_sexpr();
+  v->cell = malloc(sizeof(lval *) * (count ? count : 1));
+  return v;
+}
+
+// Call of builtin with evaluated arguments, as lval_eval_call does
+lval *laot_call(lenv *e, lbuiltin fn, lval *a) {
+  for (int i = 0; i < a->count; i++) {
+    if (a->cell[i]->type == LVAL_ERR)
+      return lval_take(a, i);
+  }
+  return fn(e, a);
+}
+
+// If whose condition is not a number, left to the builtin to report
+lval *laot_if(lenv *e, lbuiltin fn, lval *x, lval *then, lval *other) {
+  if (x->type == LVAL_ERR)
+    return x;
+
+  lval *a = lval_sexpr();
+  a = lval_push(a, x);
+  a = lval_push(a, lval_copy(then));
+  a = lval_push(a, lval_copy(other));
+  return fn(e, a);
+}
+
+// Expression of type with the count values following
+lval *laot_list(int type, int count, ...) {
+  lval *v = type == LVAL_QEXPR ? lval_qexpr() : lval_sexpr();
+
+  va_list ap;
+  va_start(ap, count);
+  for (int i = 0; i < count; i++)
+    v = lval_push(v, va_arg(ap, lval *));
+  va_end(ap);
+
+  return v;
+}
+
+// Literal beyond the range of long, as lval_read_num makes it
+lval *laot_big(char *s) {
+  lval *v = malloc(sizeof(lval));
+  v->type = LVAL_BIG;
+  v->big = lbig_from_str(s);
+  return v;
+}
+
+// Evaluate expressions in order, only errors are printed
+int laot_run(lenv *e, laot_top *exprs, int count) {
+  for (int i = 0; i < count; i++) {
+    lval *v = exprs[i](e);
+    if (v->type == LVAL_ERR)
+      lval_println(v);
+    lval_del(v);
+  }
+  return 0;
+}
+
+/**
+ * ---------------------------------------------
+ * Compiling, the code of each expression leaves
+ * its value in the variable it is given.
+ * ---------------------------------------------
+ */
+
+typedef struct
+{
+    lenv *root;
+
+    // Functions of expressions, and the constants they copy
+    FILE *code;
+    FILE *init;
+    lval *consts;
+
+    // Global names, index in the table of the program
+    int count;
+    char **names;
+
+    // Temporaries used so far, and nesting of blocks
+    int tmp;
+    int depth;
+} laot;
+
+void laot_line(laot *c, char *fmt, ...) {
+  fprintf(c->code, "%*s", 2 * c->depth, "");
+
+  va_list ap;
+  va_start(ap, fmt);
+  vfprintf(c->code, fmt, ap);
+  va_end(ap);
+
+  fputc('\n', c->code);
+}
+
+// C string literal, escaping anything but plain characters
+void laot_str(FILE *f, char *s, size_t n) {
+  fputc('"', f);
+  for (size_t i = 0; i < n; i++) {
+    unsigned char ch = s[i];
+    if (ch >= ' ' && ch < 127 && ch != '"' && ch != '\\' && ch != '?')
+      fputc(ch, f);
+    else
+      fprintf(f, "\\%03o", ch);
+  }
+  fputc('"', f);
+}
+
+// Expression building value x
+void laot_data(FILE *f, lval *x) {
+  char *s;
+
+  switch (x->type) {
+  case LVAL_NUM:
+    if (x->num == LONG_MIN)
+      fprintf(f, "lval_num(LONG_MIN)");
+    else
+      fprintf(f, "lval_num(%ldL)", x->num);
+    return;
+  case LVAL_DBL:
+    fprintf(f, "lval_dbl(%a)", x->dbl);
+    return;
+  case LVAL_BIG:
+    s = lbig_to_str(x->big);
+    fprintf(f, "laot_big(");
+    laot_str(f, s, strlen(s));
+    fprintf(f, ")");
+    free(s);
+    return;
+  case LVAL_STR:
+    fprintf(f, "lval_str(");
+    laot_str(f, lval_str_ptr(x), x->slen);
+    fprintf(f, ", %zu)", x->slen);
+    return;
+  case LVAL_SYM:
+    fprintf(f, "lval_sym(");
+    laot_str(f, x->sym, strlen(x->sym));
+    fprintf(f, ")");
+    return;
+  case LVAL_ERR:
+    fprintf(f, "lval_err(\"%%s\", ");
+    laot_str(f, x->err, strlen(x->err));
+    fprintf(f, ")");
+    return;
+  case LVAL_SEXPR:
+  case LVAL_QEXPR:
+    fprintf(f, "laot_list(%s, %d",
+            x->type == LVAL_QEXPR ? "LVAL_QEXPR" : "LVAL_SEXPR", x->count);
+    for (int i = 0; i < x->count; i++) {
+      fprintf(f, ", ");
+      laot_data(f, x->cell[i]);
+    }
+    fprintf(f, ")");
+    return;
+  }
+
+  fprintf(f, "lval_sexpr()");
+}
+
+// Constant built the first time it is used, returns its index
+int laot_const(laot *c, lval *x) {
+  for (int i = 0; i < c->consts->count; i++) {
+    if (c->consts->cell[i]->type == x->type && lval_eq(c->consts->cell[i], x))
+      return i;
+  }
+
+  int i = c->consts->count;
+  fprintf(c->init, "    case %d:\n      lc_k[%d] = ", i, i);
+  laot_data(c->init, x);
+  fprintf(c->init, ";\n      break;\n");
+
+  c->consts = lval_push(c->consts, lval_copy(x));
+  return i;
+}
+
+int laot_name_of(laot *c, char *sym) {
+  for (int i = 0; i < c->count; i++) {
+    if (strcmp(c->names[i], sym) == 0)
+      return i;
+  }
+
+  c->names = realloc(c->names, sizeof(char *) * (c->count + 1));
+  c->names[c->count] = sym;
+  return c->count++;
+}
+
+void laot_expr(laot *c, lval *x, char *dst);
+void laot_sexpr(laot *c, lval *x, char *dst);
+
+// Evaluate x into a fresh temporary and append it to s-expression
+void laot_push(laot *c, lval *x, char *v) {
+  char t[32];
+  snprintf(t, sizeof(t), "v%d", c->tmp++);
+
+  laot_line(c, "lval *%s;", t);
+  laot_expr(c, x, t);
+  laot_line(c, "%s->cell[%s->count++] = %s;", v, v, t);
+}
+
+// Quoted branch of if, evaluated as s-expression
+void laot_branch(laot *c, lval *q, char *dst) {
+  lval *x = lval_copy(q);
+  x->type = LVAL_SEXPR;
+  laot_sexpr(c, x, dst);
+  lval_del(x);
+}
+
+// If with quoted branches, only the branch taken is run
+void laot_if_of(laot *c, lval *x, char *dst, int t) {
+  char cond[32];
+  snprintf(cond, sizeof(cond), "c%d", t);
+
+  laot_line(c, "lval *%s;", cond);
+  laot_expr(c, x->cell[1], cond);
+
+  int then = laot_const(c, x->cell[2]);
+  int other = laot_const(c, x->cell[3]);
+
+  laot_line(c, "if (%s->type != LVAL_NUM) {", cond);
+  c->depth++;
+  laot_line(c, "%s = laot_if(e, f%d, %s, lc_const(%d), lc_const(%d));", dst,
+            t, cond, then, other);
+  c->depth--;
+
+  for (int i = 2; i < 4; i++) {
+    laot_line(c, i == 2 ? "} else if (%s->num) {" : "} else {", cond);
+    c->depth++;
+    laot_line(c, "lval_del(%s);", cond);
+    laot_branch(c, x->cell[i], dst);
+    c->depth--;
+  }
+  laot_line(c, "}");
+}
+
+// Call of builtin, made directly unless the name was bound to
+// something else by the time it runs
+void laot_builtin_of(laot *c, lval *x, char *dst) {
+  int t = c->tmp++;
+
+  laot_line(c, "lbuiltin f%d = laot_builtin(e, &lc_g[%d]);", t,
+            laot_name_of(c, x->cell[0]->sym));
+  laot_line(c, "if (!f%d) {", t);
+  c->depth++;
+  laot_line(c, "%s = lval_eval(e, lval_copy(lc_const(%d)));", dst,
+            laot_const(c, x));
+  c->depth--;
+  laot_line(c, "} else {");
+  c->depth++;
+
+  if (strcmp(x->cell[0]->sym, "if") == 0 && x->count == 4 &&
+      x->cell[2]->type == LVAL_QEXPR && x->cell[3]->type == LVAL_QEXPR) {
+    laot_if_of(c, x, dst, t);
+  } else {
+    char a[32];
+    snprintf(a, sizeof(a), "a%d", t);
+
+    laot_line(c, "lval *%s = laot_args(%d);", a, x->count - 1);
+    for (int i = 1; i < x->count; i++)
+      laot_push(c, x->cell[i], a);
+    laot_line(c, "%s = laot_call(e, f%d, %s);", dst, t, a);
+  }
+
+  c->depth--;
+  laot_line(c, "}");
+}
+
+// Call as evaluated by lval_eval_sexpr, operands of lazy builtin
+// are passed as read
+void laot_call_of(laot *c, lval *x, char *dst) {
+  char s[32];
+  snprintf(s, sizeof(s), "s%d", c->tmp++);
+
+  laot_line(c, "lval *%s = laot_args(%d);", s, x->count);
+  laot_push(c, x->cell[0], s);
+
+  if (x->count > 1) {
+    laot_line(c, "if (lfunc_lazy(%s->cell[0])) {", s);
+    c->depth++;
+    for (int i = 1; i < x->count; i++)
+      laot_line(c, "%s->cell[%s->count++] = lval_copy(lc_const(%d));", s, s,
+                laot_const(c, x->cell[i]));
+    c->depth--;
+    laot_line(c, "} else {");
+    c->depth++;
+    for (int i = 1; i < x->count; i++)
+      laot_push(c, x->cell[i], s);
+    c->depth--;
+    laot_line(c, "}");
+  }
+
+  laot_line(c, "%s = lval_eval_call(e, %s);", dst, s);
+}
+
+void laot_sexpr(laot *c, lval *x, char *dst) {
+  if (x->count == 0) {
+    laot_line(c, "%s = lval_sexpr();", dst);
+    return;
+  }
+
+  lval *h = x->cell[0];
+  lval *f = h->type == LVAL_SYM ? lenv_find(c->root, h) : NULL;
+  if (f && f->type == LVAL_FUNC && f->builtin && !lfunc_lazy(f) &&
+      x->count > 1) {
+    laot_builtin_of(c, x, dst);
+    return;
+  }
+
+  laot_call_of(c, x, dst);
+}
+
+void laot_expr(laot *c, lval *x, char *dst) {
+  switch (x->type) {
+  case LVAL_SYM:
+    laot_line(c, "%s = laot_get(e, &lc_g[%d]);", dst,
+              laot_name_of(c, x->sym));
+    return;
+  case LVAL_SEXPR:
+    laot_sexpr(c, x, dst);
+    return;
+  case LVAL_QEXPR:
+    laot_line(c, "%s = lval_copy(lc_const(%d));", dst, laot_const(c, x));
+    return;
+  }
+
+  // Literal, built where it is used
+  fprintf(c->code, "%*s%s = ", 2 * c->depth, "", dst);
+  laot_data(c->code, x);
+  fprintf(c->code, ";\n");
+}
+
+// Directory of the runtime sources, the one this file was compiled
+// from unless LISPC_SRC names another
+char *laot_dir(char *buf, size_t n) {
+  char *dir = getenv("LISPC_SRC");
+  if (dir)
+    return dir;
+
+  char *slash = strrchr(__FILE__, '/');
+  if (!slash)
+    return ".";
+
+  snprintf(buf, n, "%.*s", (int)(slash - __FILE__), __FILE__);
+  return buf;
+}
+
+// Write the translation unit of the program to f, around the code of
+// its expressions and the cases building its constants
+void laot_unit(laot *c, lval *prog, FILE *f, char *code, char *init) {
+  int nconsts = c->consts->count;
+
+  fprintf(f, "// Generated by lispc\n\n");
+  fprintf(f, "#include <limits.h>\n\n");
+  fprintf(f, "#include \"laot.h\"\n#include \"lclo.h\"\n");
+  fprintf(f, "#include \"ljit.h\"\n#include \"lval.h\"\n\n");
+
+  fprintf(f, "static laot_name lc_g[%d] = {\n", c->count + 1);
+  for (int i = 0; i < c->count; i++) {
+    fprintf(f, "    {");
+    laot_str(f, c->names[i], strlen(c->names[i]));
+    fprintf(f, "},\n");
+  }
+  fprintf(f, "};\n\n");
+
+  fprintf(f, "static lval *lc_k[%d];\n\n", nconsts + 1);
+  fprintf(f, "static lval *lc_const(int i) {\n");
+  fprintf(f, "  if (!lc_k[i]) {\n    switch (i) {\n%s    }\n  }\n", init);
+  fprintf(f, "  return lc_k[i];\n}\n");
+  fputs(code, f);
+
+  fprintf(f, "\nstatic laot_top lc_exprs[%d] = {", prog->count + 1);
+  for (int i = 0; i < prog->count; i++)
+    fprintf(f, "lc_expr%d, ", i);
+  fprintf(f, "NULL};\n\n");
+
+  fprintf(f, "int main(void) {\n");
+  fprintf(f, "  lclo_engine = %d;\n", lclo_engine);
+  fprintf(f, "  ljit_enabled = %d;\n\n", ljit_enabled);
+  fprintf(f, "  lenv *e = lenv_new();\n");
+  fprintf(f, "  lenv_add_builtins(e);\n");
+  fprintf(f, "  laot_names(lc_g, %d);\n\n", c->count);
+  fprintf(f, "  int r = laot_run(e, lc_exprs, %d);\n\n", prog->count);
+  fprintf(f, "  for (int i = 0; i < %d; i++) {\n", nconsts);
+  fprintf(f, "    if (lc_k[i])\n      lval_del(lc_k[i]);\n  }\n");
+  fprintf(f, "  for (int i = 0; i < %d; i++)\n", c->count);
+  fprintf(f, "    lval_del(lc_g[i].sym);\n");
+  fprintf(f, "  lenv_del(e);\n");
+  fprintf(f, "  return r;\n}\n");
+}
+
+int laot_compile(lenv *e, lval *prog, char *out) {
+  laot c = {e, NULL, NULL, lval_qexpr(), 0, NULL, 0, 0};
+
+  char *code, *init;
+  size_t code_len, init_len;
+  c.code = open_memstream(&code, &code_len);
+  c.init = open_memstream(&init, &init_len);
+
+  for (int i = 0; i < prog->count; i++) {
+    fprintf(c.code, "\nstatic lval *lc_expr%d(lenv *e) {\n", i);
+    c.depth = 1;
+    laot_line(&c, "lval *r;");
+    laot_expr(&c, prog->cell[i], "r");
+    laot_line(&c, "return r;");
+    fprintf(c.code, "}\n");
+  }
+  fclose(c.code);
+  fclose(c.init);
+
+  char path[4096];
+  snprintf(path, sizeof(path), "%s.c", out);
+  FILE *f = fopen(path, "w");
+  if (f) {
+    laot_unit(&c, prog, f, code, init);
+    fclose(f);
+  }
+
+  free(code);
+  free(init);
+  free(c.names);
+  lval_del(c.consts);
+
+  if (!f) {
+    fprintf(stderr, "lispc: cannot write %s\n", path);
+    return 1;
+  }
+
+  // Build it with the runtime by the system compiler
+  char buf[4096];
+  char *dir = laot_dir(buf, sizeof(buf));
+  char *cc = getenv("CC") ? getenv("CC") : "cc";
+
+  size_t len = 4096;
+  char *cmd = malloc(len);
+  int n = snprintf(cmd, len, "%s -std=gnu99 -O2 -I'%s' -o '%s' '%s'", cc, dir,
+                   out, path);
+  for (size_t i = 0; i < sizeof(laot_runtime) / sizeof(char *); i++) {
+    len = n + strlen(dir) + strlen(laot_runtime[i]) + 16;
+    cmd = realloc(cmd, len);
+    n += snprintf(cmd + n, len - n, " '%s/%s'", dir, laot_runtime[i]);
+  }
+  cmd = realloc(cmd, n + 16);
+  strcpy(cmd + n, " -lm -lpthread");
+
+  int r = system(cmd);
+  free(cmd);
+
+  if (r != 0) {
+    fprintf(stderr, "lispc: building %s failed\n", out);
+    return 1;
+  }
+  return 0;
+}
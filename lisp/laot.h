@@ -0,0 +1,36 @@
+#include "lval.h"
+
+#ifndef laot_h
+#define laot_h
+
+// Global name used by compiled code, with the builtin it resolved to
+// at epoch and the slot of the global environment it was last found in
+typedef struct
+{
+    char *name;
+    lval *sym;
+    long epoch;
+    lbuiltin fn;
+    int slot;
+} laot_name;
+
+// Top level expression of compiled program, evaluated in global env
+typedef lval *(*laot_top)(lenv *);
+
+// Write program, the expressions read from source files, as C code
+// to out.c and build it with the runtime into the binary out. Returns
+// 0 when the binary was built.
+int laot_compile(lenv *e, lval *prog, char *out);
+
+// Runtime of compiled programs
+void laot_names(laot_name *n, int count);
+lbuiltin laot_builtin(lenv *e, laot_name *n);
+lval *laot_get(lenv *e, laot_name *n);
+lval *laot_args(int count);
+lval *laot_call(lenv *e, lbuiltin fn, lval *a);
+lval *laot_if(lenv *e, lbuiltin fn, lval *x, lval *then, lval *other);
+lval *laot_list(int type, int count, ...);
+lval *laot_big(char *s);
+int laot_run(lenv *e, laot_top *exprs, int count);
+
+#endif
@@ -0,0 +1,500 @@
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "lbig.h"
+
+// Below this many limbs schoolbook multiplication is faster
+#define LBIG_KARATSUBA 32
+
+/**
+ * ------------------------------------------------------------
+ * Magnitude functions. They work on raw limb arrays and do not
+ * care about the sign, lengths are passed along with arrays.
+ * ------------------------------------------------------------
+ */
+
+// Length of the limbs without the leading zeros
+int lmag_trim(const uint32_t *a, int n) {
+  while (n > 0 && a[n - 1] == 0)
+    n--;
+  return n;
+}
+
+int lmag_cmp(const uint32_t *a, int an, const uint32_t *b, int bn) {
+  if (an != bn)
+    return an < bn ? -1 : 1;
+
+  for (int i = an - 1; i >= 0; i--) {
+    if (a[i] != b[i])
+      return a[i] < b[i] ? -1 : 1;
+  }
+
+  return 0;
+}
+
+// Add b into a in place, a must have room for the carry
+void lmag_add_into(uint32_t *a, int an, const uint32_t *b, int bn) {
+  uint64_t c = 0;
+  int i = 0;
+
+  for (; i < bn; i++) {
+    c += (uint64_t)a[i] + b[i];
+    a[i] = (uint32_t)c;
+    c >>= 32;
+  }
+
+  for (; c && i < an; i++) {
+    c += a[i];
+    a[i] = (uint32_t)c;
+    c >>= 32;
+  }
+}
+
+// Subtract b from a in place, a must not be smaller than b
+void lmag_sub_into(uint32_t *a, int an, const uint32_t *b, int bn) {
+  int64_t c = 0;
+  int i = 0;
+
+  for (; i < bn; i++) {
+    c += (int64_t)a[i] - b[i];
+    a[i] = (uint32_t)c;
+    c >>= 32;
+  }
+
+  for (; c && i < an; i++) {
+    c += a[i];
+    a[i] = (uint32_t)c;
+    c >>= 32;
+  }
+}
+
+// Schoolbook multiplication, r is an + bn limbs and must not alias
+void lmag_mul_school(uint32_t *r, const uint32_t *a, int an, const uint32_t *b,
+                     int bn) {
+  memset(r, 0, sizeof(uint32_t) * (an + bn));
+
+  for (int i = 0; i < an; i++) {
+    uint64_t c = 0;
+    for (int j = 0; j < bn; j++) {
+      c += (uint64_t)a[i] * b[j] + r[i + j];
+      r[i + j] = (uint32_t)c;
+      c >>= 32;
+    }
+    r[i + bn] = (uint32_t)c;
+  }
+}
+
+// Karatsuba multiplication, r is an + bn limbs and must not alias
+void lmag_mul(uint32_t *r, const uint32_t *a, int an, const uint32_t *b,
+              int bn) {
+  if (an < bn) {
+    const uint32_t *t = a;
+    a = b;
+    b = t;
+    int tn = an;
+    an = bn;
+    bn = tn;
+  }
+
+  if (bn < LBIG_KARATSUBA) {
+    lmag_mul_school(r, a, an, b, bn);
+    return;
+  }
+
+  // Very unbalanced operands are multiplied one slice of a at a time
+  if (an >= 2 * bn) {
+    memset(r, 0, sizeof(uint32_t) * (an + bn));
+    uint32_t *t = malloc(sizeof(uint32_t) * 2 * bn);
+
+    for (int off = 0; off < an; off += bn) {
+      int n = an - off < bn ? an - off : bn;
+      lmag_mul(t, a + off, n, b, bn);
+      lmag_add_into(r + off, an + bn - off, t, n + bn);
+    }
+
+    free(t);
+    return;
+  }
+
+  // Split at m so a = a1 * B^m + a0 and b = b1 * B^m + b0, then
+  // a * b = z2 * B^2m + (z1 - z2 - z0) * B^m + z0 with three products
+  int m = an / 2;
+  int a1n = an - m;
+  int b1n = bn - m;
+  int sn = a1n + 1;
+
+  uint32_t *sa = calloc(sn, sizeof(uint32_t));
+  uint32_t *sb = calloc(sn, sizeof(uint32_t));
+  memcpy(sa, a, sizeof(uint32_t) * m);
+  memcpy(sb, b, sizeof(uint32_t) * m);
+  lmag_add_into(sa, sn, a + m, a1n);
+  lmag_add_into(sb, sn, b + m, b1n);
+
+  int san = lmag_trim(sa, sn);
+  int sbn = lmag_trim(sb, sn);
+  uint32_t *z1 = calloc(san + sbn + 1, sizeof(uint32_t));
+  if (san && sbn)
+    lmag_mul(z1, sa, san, sb, sbn);
+
+  // z0 and z2 are written straight into the low and high part of r
+  int a0n = lmag_trim(a, m);
+  int b0n = lmag_trim(b, m);
+  memset(r, 0, sizeof(uint32_t) * (an + bn));
+  if (a0n && b0n)
+    lmag_mul(r, a, a0n, b, b0n);
+  lmag_mul(r + 2 * m, a + m, a1n, b + m, b1n);
+
+  int z1n = san + sbn + 1;
+  lmag_sub_into(z1, z1n, r, lmag_trim(r, 2 * m));
+  lmag_sub_into(z1, z1n, r + 2 * m, lmag_trim(r + 2 * m, a1n + b1n));
+  lmag_add_into(r + m, an + bn - m, z1, lmag_trim(z1, z1n));
+
+  free(sa);
+  free(sb);
+  free(z1);
+}
+
+// Divide by single limb in place and return the remainder
+uint32_t lmag_div_small(uint32_t *a, int an, uint32_t d) {
+  uint64_t r = 0;
+  for (int i = an - 1; i >= 0; i--) {
+    r = (r << 32) | a[i];
+    a[i] = (uint32_t)(r / d);
+    r %= d;
+  }
+  return (uint32_t)r;
+}
+
+int lmag_nlz(uint32_t x) {
+  int n = 0;
+  while (!(x & 0x80000000u)) {
+    x <<= 1;
+    n++;
+  }
+  return n;
+}
+
+// Knuth algorithm D. q is an - bn + 1 limbs, r is bn limbs, bn >= 2
+// and an >= bn, top limb of b is not zero.
+void lmag_divmod(uint32_t *q, uint32_t *r, const uint32_t *a, int an,
+                 const uint32_t *b, int bn) {
+  int s = lmag_nlz(b[bn - 1]);
+
+  // Normalize so the top limb of divisor has its high bit set
+  uint32_t *vn = malloc(sizeof(uint32_t) * bn);
+  uint32_t *un = malloc(sizeof(uint32_t) * (an + 1));
+
+  for (int i = bn - 1; i > 0; i--) {
+    vn[i] = (uint32_t)(((uint64_t)b[i] << s) | ((uint64_t)b[i - 1] >> (32 - s)));
+  }
+  vn[0] = b[0] << s;
+
+  un[an] = (uint32_t)((uint64_t)a[an - 1] >> (32 - s));
+  for (int i = an - 1; i > 0; i--) {
+    un[i] = (uint32_t)(((uint64_t)a[i] << s) | ((uint64_t)a[i - 1] >> (32 - s)));
+  }
+  un[0] = a[0] << s;
+
+  for (int j = an - bn; j >= 0; j--) {
+    // Estimate the quotient digit from the top two limbs
+    uint64_t top = ((uint64_t)un[j + bn] << 32) | un[j + bn - 1];
+    uint64_t qhat = top / vn[bn - 1];
+    uint64_t rhat = top % vn[bn - 1];
+
+    while (qhat >> 32 ||
+           qhat * vn[bn - 2] > ((rhat << 32) | un[j + bn - 2])) {
+      qhat--;
+      rhat += vn[bn - 1];
+      if (rhat >> 32)
+        break;
+    }
+
+    // Multiply and subtract
+    int64_t k = 0;
+    int64_t t;
+    for (int i = 0; i < bn; i++) {
+      uint64_t p = qhat * vn[i];
+      t = (int64_t)un[i + j] - k - (int64_t)(p & 0xffffffffu);
+      un[i + j] = (uint32_t)t;
+      k = (int64_t)(p >> 32) - (t >> 32);
+    }
+    t = (int64_t)un[j + bn] - k;
+    un[j + bn] = (uint32_t)t;
+
+    // Estimate was one too big, add the divisor back
+    q[j] = (uint32_t)qhat;
+    if (t < 0) {
+      q[j]--;
+      uint64_t c = 0;
+      for (int i = 0; i < bn; i++) {
+        c += (uint64_t)un[i + j] + vn[i];
+        un[i + j] = (uint32_t)c;
+        c >>= 32;
+      }
+      un[j + bn] += (uint32_t)c;
+    }
+  }
+
+  for (int i = 0; i < bn - 1; i++) {
+    r[i] = (uint32_t)((un[i] >> s) | ((uint64_t)un[i + 1] << (32 - s)));
+  }
+  r[bn - 1] = un[bn - 1] >> s;
+
+  free(vn);
+  free(un);
+}
+
+/**
+ * -------------------------------------------------------
+ * Signed bignum functions. Results are always new values,
+ * arguments are never modified.
+ * -------------------------------------------------------
+ */
+
+lbig *lbig_new(int len) {
+  lbig *x = malloc(sizeof(lbig) + sizeof(uint32_t) * (len ? len : 1));
+  x->sign = 0;
+  x->len = len;
+  return x;
+}
+
+// Trim leading zeros and fix sign of zero
+lbig *lbig_norm(lbig *x, int sign) {
+  x->len = lmag_trim(x->d, x->len);
+  x->sign = x->len ? sign : 0;
+  return x;
+}
+
+lbig *lbig_from_long(long x) {
+  unsigned long m = x < 0 ? 0UL - (unsigned long)x : (unsigned long)x;
+  lbig *b = lbig_new(sizeof(long) / sizeof(uint32_t));
+
+  for (int i = 0; i < b->len; i++) {
+    b->d[i] = (uint32_t)m;
+    m = (sizeof(long) > sizeof(uint32_t)) ? m >> 16 >> 16 : 0;
+  }
+
+  return lbig_norm(b, x < 0 ? -1 : 1);
+}
+
+// Parse decimal string with optional minus sign
+lbig *lbig_from_str(const char *s) {
+  int sign = 1;
+  if (*s == '-') {
+    sign = -1;
+    s++;
+  }
+
+  int digits = strlen(s);
+  lbig *x = lbig_new(digits / 9 + 1);
+  memset(x->d, 0, sizeof(uint32_t) * x->len);
+  int n = 0;
+
+  // Feed nine digits at a time, multiply by 10^k and add
+  while (*s) {
+    uint32_t chunk = 0, scale = 1;
+    for (int i = 0; i < 9 && *s; i++, s++) {
+      chunk = chunk * 10 + (*s - '0');
+      scale *= 10;
+    }
+
+    uint64_t c = chunk;
+    for (int i = 0; i < n; i++) {
+      c += (uint64_t)x->d[i] * scale;
+      x->d[i] = (uint32_t)c;
+      c >>= 32;
+    }
+    if (c)
+      x->d[n++] = (uint32_t)c;
+  }
+
+  x->len = n;
+  return lbig_norm(x, sign);
+}
+
+lbig *lbig_copy(const lbig *x) {
+  lbig *r = lbig_new(x->len);
+  r->sign = x->sign;
+  memcpy(r->d, x->d, sizeof(uint32_t) * x->len);
+  return r;
+}
+
+char *lbig_to_str(const lbig *x) {
+  // Each limb is less than ten decimal digits
+  char *s = malloc(x->len * 10 + 3);
+  uint32_t *t = malloc(sizeof(uint32_t) * (x->len ? x->len : 1));
+  memcpy(t, x->d, sizeof(uint32_t) * x->len);
+
+  // Peel off nine digits at a time from the bottom
+  int n = x->len;
+  int p = 0;
+  while (n > 0) {
+    uint32_t r = lmag_div_small(t, n, 1000000000u);
+    n = lmag_trim(t, n);
+    for (int i = 0; i < 9 && (n > 0 || r); i++) {
+      s[p++] = '0' + r % 10;
+      r /= 10;
+    }
+  }
+
+  if (p == 0)
+    s[p++] = '0';
+  if (x->sign < 0)
+    s[p++] = '-';
+  s[p] = '\0';
+
+  for (int i = 0, j = p - 1; i < j; i++, j--) {
+    char c = s[i];
+    s[i] = s[j];
+    s[j] = c;
+  }
+
+  free(t);
+  return s;
+}
+
+double lbig_to_dbl(const lbig *x) {
+  double d = 0;
+  for (int i = x->len - 1; i >= 0; i--) {
+    d = d * 4294967296.0 + x->d[i];
+  }
+  return x->sign < 0 ? -d : d;
+}
+
+// Store value into r and return 1 when it fits into long
+int lbig_to_long(const lbig *x, long *r) {
+  if (x->len > (int)(sizeof(long) / sizeof(uint32_t)))
+    return 0;
+
+  unsigned long m = 0;
+  for (int i = x->len - 1; i >= 0; i--) {
+    m = (sizeof(long) > sizeof(uint32_t)) ? (m << 16 << 16) | x->d[i] : x->d[i];
+  }
+
+  if (x->sign >= 0 && m <= (unsigned long)LONG_MAX) {
+    *r = (long)m;
+    return 1;
+  }
+
+  if (x->sign < 0 && m <= (unsigned long)LONG_MAX + 1) {
+    *r = (long)(0UL - m);
+    return 1;
+  }
+
+  return 0;
+}
+
+int lbig_cmp(const lbig *x, const lbig *y) {
+  if (x->sign != y->sign)
+    return x->sign < y->sign ? -1 : 1;
+
+  int c = lmag_cmp(x->d, x->len, y->d, y->len);
+  return x->sign < 0 ? -c : c;
+}
+
+lbig *lbig_neg(const lbig *x) {
+  lbig *r = lbig_copy(x);
+  r->sign = -r->sign;
+  return r;
+}
+
+// Add x and y where y sign is taken as ysign
+lbig *lbig_addsign(const lbig *x, const lbig *y, int ysign) {
+  if (y->sign == 0)
+    return lbig_copy(x);
+  if (x->sign == 0) {
+    lbig *r = lbig_copy(y);
+    r->sign = ysign;
+    return r;
+  }
+
+  // Same sign add the magnitudes
+  if (x->sign == ysign) {
+    int n = (x->len > y->len ? x->len : y->len) + 1;
+    lbig *r = lbig_new(n);
+    memset(r->d, 0, sizeof(uint32_t) * n);
+    memcpy(r->d, x->d, sizeof(uint32_t) * x->len);
+    lmag_add_into(r->d, n, y->d, y->len);
+    return lbig_norm(r, x->sign);
+  }
+
+  // Otherwise subtract the smaller magnitude from the bigger one
+  int c = lmag_cmp(x->d, x->len, y->d, y->len);
+  const lbig *big = c >= 0 ? x : y;
+  const lbig *small = c >= 0 ? y : x;
+
+  lbig *r = lbig_copy(big);
+  lmag_sub_into(r->d, r->len, small->d, small->len);
+  return lbig_norm(r, c >= 0 ? x->sign : ysign);
+}
+
+lbig *lbig_add(const lbig *x, const lbig *y) {
+  return lbig_addsign(x, y, y->sign);
+}
+
+lbig *lbig_sub(const lbig *x, const lbig *y) {
+  return lbig_addsign(x, y, -y->sign);
+}
+
+lbig *lbig_mul(const lbig *x, const lbig *y) {
+  if (x->sign == 0 || y->sign == 0)
+    return lbig_new(0);
+
+  lbig *r = lbig_new(x->len + y->len);
+  lmag_mul(r->d, x->d, x->len, y->d, y->len);
+  return lbig_norm(r, x->sign * y->sign);
+}
+
+lbig *lbig_pow(const lbig *x, unsigned long n) {
+  lbig *r = lbig_from_long(1);
+  lbig *b = lbig_copy(x);
+
+  while (n > 0) {
+    if (n & 1) {
+      lbig *t = lbig_mul(r, b);
+      free(r);
+      r = t;
+    }
+
+    n >>= 1;
+    if (n) {
+      lbig *t = lbig_mul(b, b);
+      free(b);
+      b = t;
+    }
+  }
+
+  free(b);
+  return r;
+}
+
+lbig *lbig_div(const lbig *x, const lbig *y, lbig **r) {
+  // Divisor bigger than dividend give zero quotient
+  if (lmag_cmp(x->d, x->len, y->d, y->len) < 0) {
+    if (r)
+      *r = lbig_copy(x);
+    return lbig_new(0);
+  }
+
+  lbig *q = lbig_new(x->len - y->len + 1);
+  lbig *m = lbig_new(y->len);
+
+  if (y->len == 1) {
+    memcpy(q->d, x->d, sizeof(uint32_t) * x->len);
+    q->len = x->len;
+    m->d[0] = lmag_div_small(q->d, q->len, y->d[0]);
+  } else {
+    lmag_divmod(q->d, m->d, x->d, x->len, y->d, y->len);
+  }
+
+  lbig_norm(q, x->sign * y->sign);
+  lbig_norm(m, x->sign);
+
+  if (r)
+    *r = m;
+  else
+    free(m);
+
+  return q;
+}
@@ -0,0 +1,35 @@
+#include <stdint.h>
+
+#ifndef lbig_h
+#define lbig_h
+
+// Arbitrary precision integer, magnitude is stored as little endian
+// 32 bit limbs without leading zeros. Zero has no limbs and sign 0.
+typedef struct lbig
+{
+    int sign;
+    int len;
+    uint32_t d[];
+} lbig;
+
+lbig *lbig_from_long(long x);
+lbig *lbig_from_str(const char *s);
+lbig *lbig_copy(const lbig *x);
+
+char *lbig_to_str(const lbig *x);
+double lbig_to_dbl(const lbig *x);
+int lbig_to_long(const lbig *x, long *r);
+
+int lbig_cmp(const lbig *x, const lbig *y);
+
+lbig *lbig_neg(const lbig *x);
+lbig *lbig_add(const lbig *x, const lbig *y);
+lbig *lbig_sub(const lbig *x, const lbig *y);
+lbig *lbig_mul(const lbig *x, const lbig *y);
+lbig *lbig_pow(const lbig *x, unsigned long n);
+
+// Truncated division like C, the remainder is written when r is not NULL.
+// Divisor must not be zero.
+lbig *lbig_div(const lbig *x, const lbig *y, lbig **r);
+
+#endif
@@ -0,0 +1,208 @@
+#include <stdlib.h>
+
+#include "lcell.h"
+#include "lval.h"
+
+/**
+ * ---------------------------------------------------------------
+ * Reactive cells. Setting an input only marks the formulas that
+ * read it, directly or through other formulas, as dirty. Reading
+ * a dirty formula first brings its inputs up to date and only
+ * evaluates it again when one of them actually changed value.
+ * ---------------------------------------------------------------
+ */
+
+// Clock advanced on every change of value
+__thread long lcell_clock = 0;
+
+// Formula being computed, it records every cell read meanwhile
+__thread lcell *lcell_reading = NULL;
+
+lcell *lcell_new(lval *val, lval *expr, lenv *env) {
+  lcell *c = malloc(sizeof(lcell));
+  c->ref = 1;
+  c->val = val;
+  c->expr = expr;
+  c->env = env;
+  c->dirty = expr != NULL;
+  c->busy = 0;
+  c->changed = ++lcell_clock;
+  c->computed = 0;
+  c->ndeps = 0;
+  c->deps = NULL;
+  c->nusers = 0;
+  c->users = NULL;
+  c->names = (lnames){0, 0, NULL};
+  c->rebound = 0;
+
+  if (expr) {
+    env->formulas =
+        realloc(env->formulas, sizeof(lcell *) * (env->nformulas + 1));
+    env->formulas[env->nformulas++] = c;
+  }
+  return c;
+}
+
+// Forget the inputs of formula
+void lcell_undepend(lcell *c) {
+  for (int i = 0; i < c->ndeps; i++) {
+    lcell *d = c->deps[i];
+    for (int j = 0; j < d->nusers; j++) {
+      if (d->users[j] == c) {
+        d->users[j] = d->users[--d->nusers];
+        break;
+      }
+    }
+    lcell_release(d);
+  }
+
+  free(c->deps);
+  c->deps = NULL;
+  c->ndeps = 0;
+}
+
+void lcell_depend(lcell *c, lcell *d) {
+  for (int i = 0; i < c->ndeps; i++) {
+    if (c->deps[i] == d)
+      return;
+  }
+
+  c->deps = realloc(c->deps, sizeof(lcell *) * (c->ndeps + 1));
+  c->deps[c->ndeps++] = d;
+  d->ref++;
+
+  d->users = realloc(d->users, sizeof(lcell *) * (d->nusers + 1));
+  d->users[d->nusers++] = c;
+}
+
+void lcell_release(lcell *c) {
+  if (--c->ref > 0)
+    return;
+
+  lcell_undepend(c);
+  if (c->val)
+    lval_del(c->val);
+  if (c->expr)
+    lval_del(c->expr);
+
+  lenv *e = c->expr ? c->env : NULL;
+  for (int i = 0; e && i < e->nformulas; i++) {
+    if (e->formulas[i] == c) {
+      e->formulas[i] = e->formulas[--e->nformulas];
+      break;
+    }
+  }
+
+  lnames_free(&c->names);
+  free(c->users);
+  free(c);
+}
+
+// Bring formula up to date, NULL or the error it evaluated to
+lval *lcell_refresh(lcell *c) {
+  if (!c->dirty)
+    return NULL;
+
+  if (c->busy)
+    return lval_err("Formula depends on its own value");
+  c->busy = 1;
+
+  // Compute again only when an input changed after last time, or a
+  // global it read was bound again
+  int stale = c->val == NULL || c->rebound;
+  for (int i = 0; i < c->ndeps && !stale; i++) {
+    lval *err = lcell_refresh(c->deps[i]);
+    if (err) {
+      c->busy = 0;
+      return err;
+    }
+    stale = c->deps[i]->changed > c->computed;
+  }
+
+  if (stale) {
+    lcell_undepend(c);
+    lnames_free(&c->names);
+    c->names = (lnames){0, 0, NULL};
+    c->rebound = 0;
+
+    lcell *prev = lcell_reading;
+    lcell_reading = c;
+    lval *v = lval_eval_expr(c->env, c->expr);
+    lcell_reading = prev;
+
+    if (v->type == LVAL_ERR) {
+      if (c->val)
+        lval_del(c->val);
+      c->val = NULL;
+      c->busy = 0;
+      return v;
+    }
+
+    // Same value keeps formulas reading this one from recomputing
+    if (c->val && lval_eq(c->val, v)) {
+      lval_del(v);
+    } else {
+      if (c->val)
+        lval_del(c->val);
+      c->val = v;
+      c->changed = ++lcell_clock;
+    }
+  }
+
+  c->computed = lcell_clock;
+  c->dirty = 0;
+  c->busy = 0;
+  return NULL;
+}
+
+lval *lcell_get(lcell *c) {
+  lval *err = lcell_refresh(c);
+  if (err)
+    return err;
+
+  if (lcell_reading)
+    lcell_depend(lcell_reading, c);
+
+  return lval_copy(c->val);
+}
+
+void lcell_mark(lcell *c) {
+  for (int i = 0; i < c->nusers; i++) {
+    lcell *u = c->users[i];
+    if (!u->dirty) {
+      u->dirty = 1;
+      lcell_mark(u);
+    }
+  }
+}
+
+void lcell_watch(lcell *c, char *name) { lnames_add(&c->names, name); }
+
+// Bindings made while computing a formula are its side effects, as a
+// counter of runs, and leave the formulas as they are
+void lcell_rebind(lenv *e, char *name) {
+  if (lcell_reading)
+    return;
+
+  for (int i = 0; i < e->nformulas; i++) {
+    lcell *c = e->formulas[i];
+    if (c->rebound || !lnames_has(&c->names, name))
+      continue;
+
+    c->rebound = 1;
+    c->dirty = 1;
+    lcell_mark(c);
+  }
+}
+
+void lcell_set(lcell *c, lval *v) {
+  if (lval_eq(c->val, v)) {
+    lval_del(v);
+    return;
+  }
+
+  lval_del(c->val);
+  c->val = v;
+  c->changed = ++lcell_clock;
+  lcell_mark(c);
+}
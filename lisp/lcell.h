@@ -0,0 +1,56 @@
+#include "lopt.h"
+#include "lval.h"
+
+#ifndef lcell_h
+#define lcell_h
+
+// Reactive cell, either an input holding a value given by set or a
+// formula computing its value from expr. A formula keeps the cells it
+// read on its last computation in deps, each of them holding a
+// reference, and every cell lists the formulas reading it in users.
+// Changed is the clock of the last change of value, computed the clock
+// a formula was last known up to date. A formula also keeps the names
+// of globals it read, and is rebound when one of them got a new value.
+struct lcell
+{
+    int ref;
+    lval *val;
+    lval *expr;
+    lenv *env;
+
+    int dirty;
+    int busy;
+    long changed;
+    long computed;
+
+    int ndeps;
+    lcell **deps;
+    int nusers;
+    lcell **users;
+
+    lnames names;
+    int rebound;
+};
+
+// Clock of changes and formula being computed, of the context running
+extern __thread long lcell_clock;
+extern __thread lcell *lcell_reading;
+
+// Takes ownership of val, or of expr evaluated in env for a formula
+lcell *lcell_new(lval *val, lval *expr, lenv *env);
+void lcell_release(lcell *c);
+
+// Copy of current value, recomputed first if any input changed. Read
+// while computing a formula makes the cell one of its inputs.
+lval *lcell_get(lcell *c);
+
+// Replace value of input cell and mark the formulas reading it dirty.
+// Takes ownership of v.
+void lcell_set(lcell *c, lval *v);
+
+// Record global name as read by formula, and mark the formulas of
+// global environment e that read name dirty once it is bound again
+void lcell_watch(lcell *c, char *name);
+void lcell_rebind(lenv *e, char *name);
+
+#endif
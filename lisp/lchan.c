@@ -0,0 +1,150 @@
+#include <sched.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "lchan.h"
+#include "lval.h"
+
+/**
+ * ---------------------------------------------------------------
+ * Channels. A bounded ring where every slot carries a sequence
+ * number telling whether it waits for a sender or a receiver of
+ * which lap, so senders and receivers only race on the position
+ * they claim with a compare and swap and never take a lock. A
+ * value in the ring belongs to nobody until a receiver takes it.
+ * ---------------------------------------------------------------
+ */
+
+// Rounds of waiting before backing off to sleeping between tries
+#define LCHAN_SPIN 256
+#define LCHAN_NAP 50000
+
+lchan *lchan_new(long cap, int policy) {
+  long n = 2;
+  while (n < cap)
+    n *= 2;
+
+  lchan *c = calloc(1, sizeof(lchan));
+  c->ref = 1;
+  c->policy = policy;
+  c->mask = n - 1;
+  c->slots = malloc(sizeof(lchan_slot) * n);
+  for (long i = 0; i < n; i++) {
+    c->slots[i].seq = i;
+    c->slots[i].val = NULL;
+  }
+  return c;
+}
+
+void lchan_retain(lchan *c) {
+  __atomic_add_fetch(&c->ref, 1, __ATOMIC_RELAXED);
+}
+
+// Last reference drops what is still queued
+void lchan_release(lchan *c) {
+  if (__atomic_sub_fetch(&c->ref, 1, __ATOMIC_ACQ_REL))
+    return;
+
+  lval *v;
+  while ((v = lchan_take(c)))
+    lval_del(v);
+  free(c->slots);
+  free(c);
+}
+
+void lchan_lend(lchan *c) {
+  __atomic_add_fetch(&c->lent, 1, __ATOMIC_RELAXED);
+}
+
+// What a holder sent comes before it is given back
+void lchan_return(lchan *c) {
+  __atomic_sub_fetch(&c->lent, 1, __ATOMIC_RELEASE);
+}
+
+int lchan_alone(lchan *c) {
+  return !__atomic_load_n(&c->lent, __ATOMIC_ACQUIRE);
+}
+
+int lchan_put(lchan *c, lval *v) {
+  long pos = __atomic_load_n(&c->tail, __ATOMIC_RELAXED);
+
+  while (1) {
+    lchan_slot *s = &c->slots[pos & c->mask];
+    long seq = __atomic_load_n(&s->seq, __ATOMIC_ACQUIRE);
+
+    // Slot still holds the value of the last lap
+    if (seq < pos)
+      return 0;
+
+    if (seq == pos &&
+        __atomic_compare_exchange_n(&c->tail, &pos, pos + 1, 1,
+                                    __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+      s->val = v;
+      __atomic_store_n(&s->seq, pos + 1, __ATOMIC_RELEASE);
+      return 1;
+    }
+
+    // Another sender took the position first
+    if (seq > pos)
+      pos = __atomic_load_n(&c->tail, __ATOMIC_RELAXED);
+  }
+}
+
+lval *lchan_take(lchan *c) {
+  long pos = __atomic_load_n(&c->head, __ATOMIC_RELAXED);
+
+  while (1) {
+    lchan_slot *s = &c->slots[pos & c->mask];
+    long seq = __atomic_load_n(&s->seq, __ATOMIC_ACQUIRE);
+
+    // Nothing sent into the slot on this lap yet
+    if (seq < pos + 1)
+      return NULL;
+
+    if (seq == pos + 1 &&
+        __atomic_compare_exchange_n(&c->head, &pos, pos + 1, 1,
+                                    __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+      lval *v = s->val;
+      __atomic_store_n(&s->seq, pos + c->mask + 1, __ATOMIC_RELEASE);
+      return v;
+    }
+
+    if (seq > pos + 1)
+      pos = __atomic_load_n(&c->head, __ATOMIC_RELAXED);
+  }
+}
+
+// Wait for the other side, yielding and at last napping. Running
+// tasks of the pool instead could run the other side on top of this
+// wait, which then never returns to let it through.
+void lchan_wait(int round) {
+  if (round < LCHAN_SPIN) {
+    sched_yield();
+  } else {
+    struct timespec t = {0, LCHAN_NAP};
+    nanosleep(&t, NULL);
+  }
+}
+
+int lchan_send(lchan *c, lval *v) {
+  for (int round = 0; !lchan_put(c, v); round += round < LCHAN_SPIN) {
+    if (c->policy == LCHAN_DROP) {
+      lval_del(v);
+      return 0;
+    }
+    if (lchan_alone(c))
+      return lchan_put(c, v) ? 1 : -1;
+    lchan_wait(round);
+  }
+  return 1;
+}
+
+lval *lchan_recv(lchan *c) {
+  lval *v;
+  for (int round = 0; !(v = lchan_take(c)); round += round < LCHAN_SPIN) {
+    if (lchan_alone(c))
+      return lchan_take(c);
+    lchan_wait(round);
+  }
+  return v;
+}
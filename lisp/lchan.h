@@ -0,0 +1,61 @@
+#include "lval.h"
+
+#ifndef lchan_h
+#define lchan_h
+
+// What send does when the channel is full
+enum
+{
+    LCHAN_BLOCK, // Wait until a receiver makes room
+    LCHAN_DROP,  // Drop the message and return
+};
+
+// Slot of the ring, seq tells whose turn it is: equal to the position
+// for the sender writing it, one more for the receiver reading it
+typedef struct
+{
+    long seq;
+    lval *val;
+} lchan_slot;
+
+// Bounded queue of values for any number of senders and receivers on
+// any threads, its counts are the only ones changed atomically. Lent
+// counts the holders on threads other than the one creating it.
+struct lchan
+{
+    long ref;
+    long lent;
+    int policy;
+    long mask;
+    lchan_slot *slots;
+
+    char pad0[32];
+    long head;
+    char pad1[56];
+    long tail;
+    char pad2[56];
+};
+
+// Capacity is rounded up to a power of two
+lchan *lchan_new(long cap, int policy);
+void lchan_retain(lchan *c);
+void lchan_release(lchan *c);
+
+// Queue v, taking ownership of it, or return 0 when full
+int lchan_put(lchan *c, lval *v);
+
+// Oldest value or NULL when empty
+lval *lchan_take(lchan *c);
+
+// Channel goes to another thread, until given back
+void lchan_lend(lchan *c);
+void lchan_return(lchan *c);
+
+// Blocking versions, waiting for a thread of the other side. Send
+// returns 0 when the message was dropped. When nothing is lent no
+// other thread can ever reach the channel, then instead of waiting
+// forever send returns -1, keeping v, and recv returns NULL.
+int lchan_send(lchan *c, lval *v);
+lval *lchan_recv(lchan *c);
+
+#endif
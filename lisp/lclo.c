@@ -0,0 +1,293 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "lclo.h"
+#include "lopt.h"
+#include "lspec.h"
+#include "lval.h"
+
+/**
+ * ---------------------------------------------------------------
+ * Closure engine. Each lambda body is compiled once into a tree of
+ * nodes holding a C function and what it needs, so running it does
+ * not walk or copy the body. Formals are read from their slot of
+ * the frame, builtins that no local binding can hide are resolved
+ * when compiling and called directly. Everything else is given to
+ * the same functions the evaluator uses, so results and errors are
+ * the same.
+ * ---------------------------------------------------------------
+ */
+
+__thread int lclo_engine = 0;
+
+lclo *lclo_new(lclo_fn fn, lval *val, lval *src, int count) {
+  lclo *c = malloc(sizeof(lclo));
+  c->fn = fn;
+  c->val = val;
+  c->src = src;
+  c->slot = 0;
+  c->epoch = lopt_epoch;
+  c->count = count;
+  c->kids = count ? calloc(count, sizeof(lclo *)) : NULL;
+  c->ref = 1;
+  return c;
+}
+
+void lclo_del(lclo *c) {
+  if (!c)
+    return;
+
+  for (int i = 0; i < c->count; i++)
+    lclo_del(c->kids[i]);
+  free(c->kids);
+
+  if (c->val)
+    lval_del(c->val);
+  if (c->src)
+    lval_del(c->src);
+  free(c);
+}
+
+void lclo_release(lclo *c) {
+  if (--c->ref == 0)
+    lclo_del(c);
+}
+
+/**
+ * ---------------------------------------------
+ * Nodes, each one gives what lval_eval would on
+ * the expression it was compiled from.
+ * ---------------------------------------------
+ */
+
+lval *lclo_const(lenv *e, lclo *c) { return lval_copy(c->val); }
+
+lval *lclo_sym(lenv *e, lclo *c) { return lenv_get(e, c->val); }
+
+// Formal, looked up by name when the frame is not laid out as the
+// formals are, such as after binding a name with the same symbol
+lval *lclo_slot(lenv *e, lclo *c) {
+  if (c->slot < e->count && strcmp(e->syms[c->slot], c->val->sym) == 0 &&
+      e->vals[c->slot]->type != LVAL_CELL)
+    return lval_copy(e->vals[c->slot]);
+
+  return lenv_get(e, c->val);
+}
+
+// Builtin resolved when compiling, evaluated as written once anything
+// changed the bindings it was resolved against
+lval *lclo_func(lenv *e, lclo *c) {
+  if (c->epoch != lopt_epoch)
+    return lenv_get(e, c->src);
+  return lval_copy(c->val);
+}
+
+// Call as evaluated by lval_eval_sexpr, operands of lazy builtin
+// are passed as read
+lval *lclo_call(lenv *e, lclo *c) {
+  lval *v = lval_sexpr();
+  v->cell = malloc(sizeof(lval *) * c->count);
+  v->cell[v->count++] = c->kids[0]->fn(e, c->kids[0]);
+
+  int lazy = lfunc_lazy(v->cell[0]);
+  for (int i = 1; i < c->count; i++) {
+    lclo *k = c->kids[i];
+    v->cell[v->count++] = lazy ? lval_copy(c->src->cell[i]) : k->fn(e, k);
+  }
+
+  return lval_eval_call(e, v);
+}
+
+// Call of resolved builtin with at least one argument
+lval *lclo_builtin(lenv *e, lclo *c) {
+  if (c->epoch != lopt_epoch)
+    return lval_eval(e, lval_copy(c->src));
+
+  lval *a = lval_sexpr();
+  a->cell = malloc(sizeof(lval *) * (c->count - 1));
+  for (int i = 1; i < c->count; i++)
+    a->cell[a->count++] = c->kids[i]->fn(e, c->kids[i]);
+
+  for (int i = 0; i < a->count; i++) {
+    if (a->cell[i]->type == LVAL_ERR)
+      return lval_take(a, i);
+  }
+
+  return c->val->builtin(e, a);
+}
+
+// If with quoted branches, only the branch taken is run. A condition
+// that is not a number is left to if to report.
+lval *lclo_if(lenv *e, lclo *c) {
+  if (c->epoch != lopt_epoch)
+    return lval_eval(e, lval_copy(c->src));
+
+  lval *x = c->kids[1]->fn(e, c->kids[1]);
+  if (x->type == LVAL_NUM) {
+    lclo *b = c->kids[x->num ? 2 : 3];
+    lval_del(x);
+    return b->fn(e, b);
+  }
+
+  if (x->type == LVAL_ERR)
+    return x;
+
+  lval *a = lval_sexpr();
+  a = lval_push(a, x);
+  a = lval_push(a, lval_copy(c->src->cell[2]));
+  a = lval_push(a, lval_copy(c->src->cell[3]));
+  return c->val->builtin(e, a);
+}
+
+/**
+ * ---------------------------------------------
+ * Compiling, names in shadow are never resolved
+ * when compiling since a frame may bind them.
+ * ---------------------------------------------
+ */
+
+typedef struct
+{
+    lenv *root;
+    lnames shadow;
+
+    // Formals in the order the frame binds them
+    int count;
+    char **slots;
+} lcomp;
+
+lclo *lclo_expr(lcomp *c, lval *x);
+
+// Slot of formal, -1 when not a formal or bound twice
+int lclo_slot_of(lcomp *c, char *sym) {
+  int slot = -1;
+  for (int i = 0; i < c->count; i++) {
+    if (strcmp(c->slots[i], sym) != 0)
+      continue;
+    if (slot >= 0)
+      return -1;
+    slot = i;
+  }
+  return slot;
+}
+
+// Builtin symbol surely refers to, or NULL
+lval *lclo_resolve(lcomp *c, lval *x) {
+  if (x->type == LVAL_FUNC)
+    return x->builtin ? x : NULL;
+
+  if (x->type != LVAL_SYM || lnames_has(&c->shadow, x->sym) ||
+      lopt_is_local(x->sym))
+    return NULL;
+
+  lval *v = lenv_find(c->root, x);
+  return v && v->type == LVAL_FUNC && v->builtin ? v : NULL;
+}
+
+// Each element compiled, the head first
+lclo *lclo_kids(lcomp *c, lclo *n, lval *x) {
+  for (int i = 0; i < x->count; i++)
+    n->kids[i] = lclo_expr(c, x->cell[i]);
+  return n;
+}
+
+// Expression evaluated as call, or as its only element
+lclo *lclo_sexpr(lcomp *c, lval *x) {
+  if (x->count == 0)
+    return lclo_new(lclo_const, lval_sexpr(), NULL, 0);
+
+  lval *h = x->cell[0];
+  if (x->count == 1 && h->type != LVAL_SYM && h->type != LVAL_SEXPR &&
+      h->type != LVAL_FUNC)
+    return lclo_new(lclo_const, lval_copy(h), NULL, 0);
+
+  lclo_fn fn = lclo_call;
+  lval *f = lclo_resolve(c, h);
+  if (f && x->count > 1 && !lfunc_lazy(f)) {
+    fn = lclo_builtin;
+    if (strcmp(f->sym, "if") == 0 && x->count == 4 &&
+        x->cell[2]->type == LVAL_QEXPR && x->cell[3]->type == LVAL_QEXPR)
+      fn = lclo_if;
+  }
+
+  lval *src = lval_copy(x);
+  src->type = LVAL_SEXPR;
+
+  lval *val = fn != lclo_call ? lval_copy(f) : NULL;
+  lclo *n = lclo_new(fn, val, src, x->count);
+  lclo_kids(c, n, x);
+
+  // Branches are compiled as the calls they become
+  if (fn == lclo_if) {
+    for (int i = 2; i < 4; i++) {
+      lclo_del(n->kids[i]);
+      n->kids[i] = lclo_sexpr(c, x->cell[i]);
+    }
+  }
+
+  return n;
+}
+
+lclo *lclo_expr(lcomp *c, lval *x) {
+  if (x->type == LVAL_SEXPR)
+    return lclo_sexpr(c, x);
+
+  if (x->type != LVAL_SYM)
+    return lclo_new(lclo_const, lval_copy(x), NULL, 0);
+
+  int slot = lclo_slot_of(c, x->sym);
+  if (slot >= 0) {
+    lclo *n = lclo_new(lclo_slot, lval_copy(x), NULL, 0);
+    n->slot = slot;
+    return n;
+  }
+
+  lval *f = lclo_resolve(c, x);
+  if (f)
+    return lclo_new(lclo_func, lval_copy(f), lval_copy(x), 0);
+
+  return lclo_new(lclo_sym, lval_copy(x), NULL, 0);
+}
+
+lclo *lclo_compile(lenv *e, lval *f) {
+  while (e->par) {
+    e = e->par;
+  }
+
+  // Frame holds the bindings of partial application then formals
+  lcomp c = {e, {0, 0, NULL}, 0, NULL};
+  c.slots = malloc(sizeof(char *) * (f->env->count + f->formals->count));
+  for (int i = 0; i < f->env->count; i++)
+    c.slots[c.count++] = f->env->syms[i];
+  for (int i = 0; i < f->formals->count; i++) {
+    if (strcmp(f->formals->cell[i]->sym, "&") != 0)
+      c.slots[c.count++] = f->formals->cell[i]->sym;
+  }
+
+  // Names the body may bind, as symbols quoted for = and def
+  for (int i = 0; i < c.count; i++)
+    lnames_add(&c.shadow, c.slots[i]);
+  lopt_quoted_call(&c.shadow, f->body);
+
+  lclo *n = lclo_sexpr(&c, f->body);
+  lnames_free(&c.shadow);
+  free(c.slots);
+  return n;
+}
+
+lval *lclo_body(lenv *e, lval *f) {
+  lspec *s = f->spec;
+  if (!s->clo || s->clo_epoch != lopt_epoch) {
+    if (s->clo)
+      lclo_release(s->clo);
+    s->clo = lclo_compile(e, f);
+    s->clo_epoch = lopt_epoch;
+  }
+
+  // Kept alive while running in case a call inside compiles it again
+  lclo *c = s->clo;
+  c->ref++;
+  lval *r = c->fn(e, c);
+  lclo_release(c);
+  return r;
+}
@@ -0,0 +1,40 @@
+#include "lval.h"
+
+#ifndef lclo_h
+#define lclo_h
+
+typedef struct lclo lclo;
+typedef lval *(*lclo_fn)(lenv *, lclo *);
+
+// Node of compiled body, run by calling its fn with the frame
+struct lclo
+{
+    lclo_fn fn;
+
+    // Literal, symbol or builtin the node stands for, and the
+    // expression it was compiled from
+    lval *val;
+    lval *src;
+
+    // Frame slot of formal, epoch builtin was resolved at
+    int slot;
+    long epoch;
+
+    int count;
+    lclo **kids;
+
+    // Runs of the body in progress plus one for the lambda, only
+    // counted on the root
+    int ref;
+};
+
+// Selected by command line, lambda bodies run as closures
+extern __thread int lclo_engine;
+
+void lclo_release(lclo *c);
+
+// Evaluate body of lambda f in frame e of its call, compiling the
+// body the first time and whenever the optimiser epoch moved
+lval *lclo_body(lenv *e, lval *f);
+
+#endif
@@ -0,0 +1,227 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "lcell.h"
+#include "lchan.h"
+#include "lclo.h"
+#include "lctx.h"
+#include "ljit.h"
+#include "lopt.h"
+#include "lspec.h"
+#include "lval.h"
+#include "mpc.h"
+
+/**
+ * ---------------------------------------------------------------
+ * Contexts for embedding. All state the interpreter changes while
+ * running lives in thread-local variables, a context loads its own
+ * copy of them on entry and takes them back on leaving. Contexts on
+ * separate threads thus never share anything, and one thread may
+ * switch between any number of contexts.
+ * ---------------------------------------------------------------
+ */
+
+void lgrammar_new(lgrammar *g) {
+  g->Double = mpc_new("double");
+  g->Number = mpc_new("number");
+  g->Symbol = mpc_new("symbol");
+  g->String = mpc_new("string");
+  g->Sexpr = mpc_new("sexpr");
+  g->Qexpr = mpc_new("qexpr");
+  g->Expr = mpc_new("expr");
+  g->Lispy = mpc_new("lispy");
+
+  mpca_lang(MPCA_LANG_DEFAULT,
+            "double : /-?[0-9]+(\\.[0-9]+([eE][-+]?[0-9]+)?|[eE][-+]?[0-9]+)/ ;"
+            "number : /-?[0-9]+/ ;"
+            "symbol : /[a-zA-Z0-9_+\\-*\\/\\\\=<>!&%^?]+/ ;"
+            "string : /\"(\\\\.|[^\"])*\"/ ;"
+            "sexpr  : '(' <expr>* ')' ;"
+            "qexpr  : '{' <expr>* '}' ;"
+            "expr   : <double> | <number> | <symbol> | <string>"
+            "       | <sexpr> | <qexpr> ;"
+            "lispy  : /^/ <expr>* /$/ ;",
+            g->Double, g->Number, g->Symbol, g->String, g->Sexpr, g->Qexpr,
+            g->Expr, g->Lispy);
+}
+
+void lgrammar_del(lgrammar *g) {
+  mpc_cleanup(8, g->Double, g->Number, g->Symbol, g->String, g->Sexpr,
+              g->Qexpr, g->Expr, g->Lispy);
+}
+
+// Copy state of the thread into s, and the other way
+void lstate_save(lstate *s) {
+  s->opt_epoch = lopt_epoch;
+  s->opt_checked = lopt_checked;
+  s->opt_locals = lopt_locals;
+  s->opt_changes = lopt_changes;
+  s->cell_clock = lcell_clock;
+  s->cell_reading = lcell_reading;
+  s->spec_root = lspec_root;
+  s->clo_engine = lclo_engine;
+  s->jit = ljit_enabled;
+  s->out = lval_out;
+  s->exit = lval_exit;
+}
+
+void lstate_load(lstate *s) {
+  lopt_epoch = s->opt_epoch;
+  lopt_checked = s->opt_checked;
+  lopt_locals = s->opt_locals;
+  lopt_changes = s->opt_changes;
+  lcell_clock = s->cell_clock;
+  lcell_reading = s->cell_reading;
+  lspec_root = s->spec_root;
+  lclo_engine = s->clo_engine;
+  ljit_enabled = s->jit;
+  lval_out = s->out;
+  lval_exit = s->exit;
+}
+
+// Run on the context from here until leaving, saving the thread state
+void lctx_enter(lisp_ctx *c, lstate *saved) {
+  lstate_save(saved);
+  lstate_load(&c->state);
+}
+
+void lctx_leave(lisp_ctx *c, lstate *saved) {
+  lstate_save(&c->state);
+  lstate_load(saved);
+}
+
+void lctx_streams(lisp_ctx *c) {
+  c->out_buf = NULL;
+  c->err_buf = NULL;
+  c->out = open_memstream(&c->out_buf, &c->out_len);
+  c->err = open_memstream(&c->err_buf, &c->err_len);
+}
+
+lisp_ctx *lisp_ctx_new(void) {
+  lisp_ctx *c = malloc(sizeof(lisp_ctx));
+  lgrammar_new(&c->grammar);
+  lctx_streams(c);
+  c->exited = 0;
+
+  c->state = (lstate){.clo_engine = lclo_engine,
+                      .jit = ljit_enabled,
+                      .out = c->out,
+                      .exit = &c->exited};
+
+  lstate saved;
+  lctx_enter(c, &saved);
+  c->env = lenv_new();
+  lenv_add_builtins(c->env);
+  lctx_leave(c, &saved);
+
+  return c;
+}
+
+void lisp_ctx_del(lisp_ctx *c) {
+  lstate saved;
+  lctx_enter(c, &saved);
+  lenv_del(c->env);
+  lctx_leave(c, &saved);
+
+  lnames_free(&c->state.opt_locals);
+  lopt_log_free(&c->state.opt_changes);
+  fclose(c->out);
+  fclose(c->err);
+  free(c->out_buf);
+  free(c->err_buf);
+  lgrammar_del(&c->grammar);
+  free(c);
+}
+
+int lisp_ctx_eval(lisp_ctx *c, const char *src) {
+  if (c->exited)
+    return 0;
+
+  mpc_result_t r;
+  if (!mpc_parse("<eval>", src, c->grammar.Lispy, &r)) {
+    char *s = mpc_err_string(r.error);
+    fputs(s, c->err);
+    free(s);
+    mpc_err_delete(r.error);
+    return 1;
+  }
+
+  lval *x = lval_read(r.output);
+  mpc_ast_delete(r.output);
+
+  lstate saved;
+  lctx_enter(c, &saved);
+
+  int errors = 0;
+  while (x->count && !c->exited) {
+    lval *v = lval_eval(c->env, lval_pop(x, 0));
+
+    // Exit ends the program, its error only unwinds the evaluation
+    if (c->exited) {
+      lval_del(v);
+      break;
+    }
+
+    if (v->type == LVAL_ERR) {
+      lval_out = c->err;
+      lval_println(v);
+      lval_out = c->out;
+      errors++;
+    } else if (v->type != LVAL_NONE) {
+      lval_println(v);
+    }
+    lval_del(v);
+  }
+
+  lctx_leave(c, &saved);
+  lval_del(x);
+  return errors;
+}
+
+int lisp_ctx_eval_all(lisp_ctx *c, const char **srcs, int count) {
+  int errors = 0;
+  for (int i = 0; i < count && !c->exited; i++)
+    errors += lisp_ctx_eval(c, srcs[i]);
+  return errors;
+}
+
+int lisp_ctx_share(lisp_ctx *to, lisp_ctx *from, const char *name) {
+  lval *k = lval_sym((char *)name);
+  lval *v = lenv_find(from->env, k);
+  if (!v || v->type != LVAL_CHAN) {
+    lval_del(k);
+    return 0;
+  }
+
+  // The channel is the only thing both contexts hold, and each may
+  // wait on it for the other as long as they live
+  lchan_lend(v->chan);
+  lstate saved;
+  lctx_enter(to, &saved);
+  lenv_def(to->env, k, v);
+  lctx_leave(to, &saved);
+
+  lval_del(k);
+  return 1;
+}
+
+const char *lisp_ctx_out(lisp_ctx *c) {
+  fflush(c->out);
+  return c->out_buf ? c->out_buf : "";
+}
+
+const char *lisp_ctx_err(lisp_ctx *c) {
+  fflush(c->err);
+  return c->err_buf ? c->err_buf : "";
+}
+
+void lisp_ctx_clear(lisp_ctx *c) {
+  fclose(c->out);
+  fclose(c->err);
+  free(c->out_buf);
+  free(c->err_buf);
+
+  lctx_streams(c);
+  c->state.out = c->out;
+}
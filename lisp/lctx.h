@@ -0,0 +1,90 @@
+#include <stdio.h>
+
+#include "lcell.h"
+#include "lopt.h"
+#include "lval.h"
+#include "mpc.h"
+
+#ifndef lctx_h
+#define lctx_h
+
+// Parsers of the grammar, every context has its own
+typedef struct
+{
+    mpc_parser_t *Double;
+    mpc_parser_t *Number;
+    mpc_parser_t *Symbol;
+    mpc_parser_t *String;
+    mpc_parser_t *Sexpr;
+    mpc_parser_t *Qexpr;
+    mpc_parser_t *Expr;
+    mpc_parser_t *Lispy;
+} lgrammar;
+
+void lgrammar_new(lgrammar *g);
+void lgrammar_del(lgrammar *g);
+
+// State the interpreter keeps in thread-local variables, held by the
+// context while it is not running
+typedef struct
+{
+    long opt_epoch;
+    long opt_checked;
+    lnames opt_locals;
+    lopt_log opt_changes;
+    long cell_clock;
+    lcell *cell_reading;
+    lenv *spec_root;
+    int clo_engine;
+    int jit;
+    FILE *out;
+    int *exit;
+} lstate;
+
+// Copy the state of the thread into s, and back from s
+void lstate_save(lstate *s);
+void lstate_load(lstate *s);
+
+// Interpreter with its own global environment, parsers and state, so
+// contexts on separate threads run concurrently. What the program
+// prints and the values of expressions go to out, errors to err.
+typedef struct lisp_ctx
+{
+    lgrammar grammar;
+    lenv *env;
+    lstate state;
+
+    FILE *out;
+    char *out_buf;
+    size_t out_len;
+
+    FILE *err;
+    char *err_buf;
+    size_t err_len;
+
+    // Set once the program called exit, nothing runs afterwards
+    int exited;
+} lisp_ctx;
+
+// New context uses the engines selected on the thread creating it
+lisp_ctx *lisp_ctx_new(void);
+void lisp_ctx_del(lisp_ctx *c);
+
+// Evaluate each expression of src in order, returns the number of
+// errors, a parse error counting as one
+int lisp_ctx_eval(lisp_ctx *c, const char *src);
+int lisp_ctx_eval_all(lisp_ctx *c, const char **srcs, int count);
+
+// Bind name in context to to the channel bound globally to name in
+// from, so programs of contexts on separate threads can talk through
+// it. Neither context may be running. Returns 0 when from has no such
+// channel.
+int lisp_ctx_share(lisp_ctx *to, lisp_ctx *from, const char *name);
+
+// Output and errors captured since the context was created or last
+// cleared, valid until the next call on the context
+const char *lisp_ctx_out(lisp_ctx *c);
+const char *lisp_ctx_err(lisp_ctx *c);
+void lisp_ctx_clear(lisp_ctx *c);
+
+#endif
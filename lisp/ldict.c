@@ -0,0 +1,256 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "ldict.h"
+#include "lval.h"
+
+/**
+ * ---------------------------------------------------------------
+ * Hash table of dict values. Entries are kept sorted by distance
+ * from their home slot (Robin Hood hashing), so a lookup can stop
+ * as soon as it meet an entry closer to home than the probe is.
+ * ---------------------------------------------------------------
+ */
+
+ltable *ltable_new(int cap) {
+  ltable *t = malloc(sizeof(ltable));
+  t->count = 0;
+  t->cap = cap;
+  t->slots = calloc(cap, sizeof(lslot));
+  return t;
+}
+
+void ltable_del(ltable *t) {
+  for (int i = 0; i < t->cap; i++) {
+    if (t->slots[i].key) {
+      lval_del(t->slots[i].key);
+      lval_del(t->slots[i].val);
+    }
+  }
+
+  free(t->slots);
+  free(t);
+}
+
+// Place entry into table without checking for existing key
+void ltable_insert(ltable *t, lslot s) {
+  int mask = t->cap - 1;
+  int i = s.hash & mask;
+  s.dist = 0;
+
+  while (t->slots[i].key) {
+    // Take the slot from a richer entry and carry that one along
+    if (t->slots[i].dist < s.dist) {
+      lslot x = t->slots[i];
+      t->slots[i] = s;
+      s = x;
+    }
+
+    i = (i + 1) & mask;
+    s.dist++;
+  }
+
+  t->slots[i] = s;
+  t->count++;
+}
+
+void ltable_grow(ltable *t) {
+  lslot *old = t->slots;
+  int cap = t->cap;
+
+  t->cap *= 2;
+  t->count = 0;
+  t->slots = calloc(t->cap, sizeof(lslot));
+
+  for (int i = 0; i < cap; i++) {
+    if (old[i].key)
+      ltable_insert(t, old[i]);
+  }
+
+  free(old);
+}
+
+// Index of the slot holding the key or -1
+int ltable_find(ltable *t, lval *k, uint64_t h) {
+  int mask = t->cap - 1;
+  int i = h & mask;
+
+  for (int dist = 0; t->slots[i].key && t->slots[i].dist >= dist; dist++) {
+    if (t->slots[i].hash == h && lval_eq(t->slots[i].key, k))
+      return i;
+    i = (i + 1) & mask;
+  }
+
+  return -1;
+}
+
+// Empty the slot and shift the following entries back toward home
+void ltable_remove(ltable *t, int i) {
+  int mask = t->cap - 1;
+  int j = (i + 1) & mask;
+
+  while (t->slots[j].key && t->slots[j].dist > 0) {
+    t->slots[i] = t->slots[j];
+    t->slots[i].dist--;
+    i = j;
+    j = (j + 1) & mask;
+  }
+
+  memset(&t->slots[i], 0, sizeof(lslot));
+  t->count--;
+}
+
+// Set key to v, or remove it when v is NULL. The key and the value
+// it had before are handed back through k and v, NULL when absent.
+void ltable_swap(ltable *t, lval **k, lval **v) {
+  uint64_t h = lval_hash(*k);
+  int i = ltable_find(t, *k, h);
+
+  if (i >= 0) {
+    lval *old = t->slots[i].val;
+    if (*v) {
+      t->slots[i].val = *v;
+    } else {
+      lval_del(*k);
+      *k = t->slots[i].key;
+      ltable_remove(t, i);
+    }
+    *v = old;
+    return;
+  }
+
+  if (*v) {
+    // Keep load factor under 7/8
+    if ((t->count + 1) * 8 > t->cap * 7)
+      ltable_grow(t);
+
+    lslot s = {h, 0, *k, *v};
+    ltable_insert(t, s);
+    *k = lval_copy(*k);
+  }
+
+  *v = NULL;
+}
+
+/**
+ * --------------------------------------------------------------
+ * Versions of dictionary. Putting into a version that is shared
+ * takes the table for the new version and leaves the inverse of
+ * the change behind, so both stay valid without copying.
+ * --------------------------------------------------------------
+ */
+
+ldict *ldict_new(void) {
+  ldict *d = malloc(sizeof(ldict));
+  d->ref = 1;
+  d->tab = ltable_new(8);
+  d->next = NULL;
+  d->key = NULL;
+  d->val = NULL;
+  return d;
+}
+
+void ldict_release(ldict *d) {
+  // Walk the chain iteratively, long histories would blow the stack
+  while (d && --d->ref == 0) {
+    ldict *next = d->next;
+
+    if (d->tab)
+      ltable_del(d->tab);
+    if (d->key)
+      lval_del(d->key);
+    if (d->val)
+      lval_del(d->val);
+
+    free(d);
+    d = next;
+  }
+}
+
+// Move the table to this version by reverting diffs from the newest
+void ldict_reroot(ldict *d) {
+  if (d->tab)
+    return;
+
+  int n = 0, cap = 8;
+  ldict **chain = malloc(sizeof(ldict *) * cap);
+  for (ldict *p = d; !p->tab; p = p->next) {
+    if (n == cap) {
+      cap *= 2;
+      chain = realloc(chain, sizeof(ldict *) * cap);
+    }
+    chain[n++] = p;
+  }
+
+  for (int i = n - 1; i >= 0; i--) {
+    ldict *c = chain[i];
+    ldict *r = c->next;
+
+    // Apply the diff of c, what it replaced becomes the diff of r
+    ltable_swap(r->tab, &c->key, &c->val);
+    c->tab = r->tab;
+    r->tab = NULL;
+    r->key = c->key;
+    r->val = c->val;
+    c->key = NULL;
+    c->val = NULL;
+    c->next = NULL;
+
+    // Reverse the link, r now points at c
+    r->ref--;
+    if (r->ref == 0) {
+      lval_del(r->key);
+      if (r->val)
+        lval_del(r->val);
+      free(r);
+    } else {
+      r->next = c;
+      c->ref++;
+    }
+  }
+
+  free(chain);
+}
+
+ltable *ldict_table(ldict *d) {
+  ldict_reroot(d);
+  return d->tab;
+}
+
+lval *ldict_get(ldict *d, lval *k) {
+  ltable *t = ldict_table(d);
+  int i = ltable_find(t, k, lval_hash(k));
+  return i < 0 ? NULL : t->slots[i].val;
+}
+
+ldict *ldict_put(ldict *d, lval *k, lval *v) {
+  ldict_reroot(d);
+
+  // Only reference to this version so change it in place
+  if (d->ref == 1) {
+    ltable_swap(d->tab, &k, &v);
+    if (k)
+      lval_del(k);
+    if (v)
+      lval_del(v);
+    return d;
+  }
+
+  ldict *n = malloc(sizeof(ldict));
+  n->ref = 1;
+  n->tab = d->tab;
+  n->next = NULL;
+  n->key = NULL;
+  n->val = NULL;
+
+  // Old version keeps the inverse of the change as its diff
+  ltable_swap(n->tab, &k, &v);
+  d->tab = NULL;
+  d->key = k;
+  d->val = v;
+  d->next = n;
+  n->ref++;
+
+  ldict_release(d);
+  return n;
+}
@@ -0,0 +1,52 @@
+#include <stdint.h>
+
+#include "lval.h"
+
+#ifndef ldict_h
+#define ldict_h
+
+// Slot of hash table, empty when key is NULL. Distance is how far
+// the entry sits from the slot its hash points to.
+typedef struct
+{
+    uint64_t hash;
+    int dist;
+    lval *key;
+    lval *val;
+} lslot;
+
+// Robin Hood open addressing table
+typedef struct
+{
+    int count;
+    int cap;
+    lslot *slots;
+} ltable;
+
+// Version of a dictionary. Only the version used last owns the table,
+// any other version is a diff holding the value of one key that differs
+// from the next version (NULL when the key is absent). Using an older
+// version moves the table back to it by reverting the diffs.
+struct ldict
+{
+    int ref;
+    ltable *tab;
+    ldict *next;
+    lval *key;
+    lval *val;
+};
+
+ldict *ldict_new(void);
+void ldict_release(ldict *d);
+
+// Table of this version, valid until another version is used
+ltable *ldict_table(ldict *d);
+
+// Borrowed value of the key or NULL
+lval *ldict_get(ldict *d, lval *k);
+
+// New version with the key set to v or removed when v is NULL. Takes
+// over the reference to d and the ownership of k and v.
+ldict *ldict_put(ldict *d, lval *k, lval *v);
+
+#endif
@@ -0,0 +1,421 @@
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "leff.h"
+#include "lmemo.h"
+#include "lopt.h"
+#include "lspec.h"
+#include "lval.h"
+
+/**
+ * ---------------------------------------------------------------
+ * Effect analysis. Builtins carry the effect class they were
+ * registered with, a lambda is pure when every call in its body
+ * is pure, which for lambdas it calls is found the same way. The
+ * result is kept on the lambda until the optimiser epoch moves.
+ * ---------------------------------------------------------------
+ */
+
+// Isolated analysis also accepts channels, it keeps nothing on the
+// lambdas and only visits each of them once
+typedef struct
+{
+    lenv *root;
+    int depth;
+    int low;
+
+    int chan;
+    int nseen;
+    lval **seen;
+} leff;
+
+int leff_expr(leff *c, lnames *l, lval *x);
+int leff_call(leff *c, lnames *l, lval **x, int n);
+int leff_func(leff *c, lval *f);
+
+// Global value of symbol that no local binding can hide, or NULL
+lval *leff_global(leff *c, lnames *l, lval *s) {
+  if (lnames_has(l, s->sym) || lopt_is_local(s->sym))
+    return NULL;
+
+  for (int i = 0; i < c->root->count; i++) {
+    if (strcmp(c->root->syms[i], s->sym) == 0)
+      return c->root->vals[i];
+  }
+  return NULL;
+}
+
+// Global functions never change without moving the epoch, any
+// other global may be redefined at any time
+int leff_sym(leff *c, lnames *l, lval *s) {
+  if (lnames_has(l, s->sym))
+    return 1;
+
+  lval *v = leff_global(c, l, s);
+  return v && (v->type == LVAL_FUNC || (c->chan && v->type == LVAL_CHAN));
+}
+
+// Q-expr evaluated as code in place
+int leff_code(leff *c, lnames *l, lval *x) {
+  return x->type == LVAL_QEXPR && leff_call(c, l, x->cell, x->count);
+}
+
+int leff_expr(leff *c, lnames *l, lval *x) {
+  switch (x->type) {
+  case LVAL_SYM:
+    return leff_sym(c, l, x);
+  case LVAL_SEXPR:
+    return leff_call(c, l, x->cell, x->count);
+  default:
+    return 1;
+  }
+}
+
+int leff_args(leff *c, lnames *l, lval **x, int n) {
+  for (int i = 0; i < n; i++) {
+    if (!leff_expr(c, l, x[i]))
+      return 0;
+  }
+  return 1;
+}
+
+// Expression giving a function that is pure to call
+int leff_fn(leff *c, lnames *l, lval *x) {
+  if (x->type == LVAL_FUNC)
+    return leff_func(c, x);
+
+  if (x->type == LVAL_SYM) {
+    lval *v = leff_global(c, l, x);
+    return v && v->type == LVAL_FUNC && leff_func(c, v);
+  }
+
+  // Lambda made in place is checked with its body
+  return x->type == LVAL_SEXPR && x->count == 3 &&
+         x->cell[0]->type == LVAL_SYM && strcmp(x->cell[0]->sym, "\\") == 0 &&
+         leff_expr(c, l, x);
+}
+
+int leff_forces(lval *f) {
+  return f->builtin &&
+         (strcmp(f->sym, "collect") == 0 || strcmp(f->sym, "foldl") == 0 ||
+          strcmp(f->sym, "foldr") == 0);
+}
+
+// Expression giving no sequence, or one built in place from stages
+// whose functions are pure. Forcing a sequence from anywhere else,
+// such as an argument, may run any function stored in it.
+int leff_seq(leff *c, lnames *l, lval *x) {
+  if (x->type == LVAL_SYM)
+    return !lnames_has(l, x->sym) && leff_sym(c, l, x);
+  if (x->type != LVAL_SEXPR)
+    return 1;
+  if (x->count == 0)
+    return 1;
+
+  lval *f = x->cell[0];
+  if (f->type == LVAL_SYM)
+    f = leff_global(c, l, f);
+  if (!f || f->type != LVAL_FUNC || !f->builtin)
+    return 0;
+
+  if (strcmp(f->sym, "lmap") == 0 || strcmp(f->sym, "lfilter") == 0)
+    return x->count == 3 && leff_fn(c, l, x->cell[1]) &&
+           leff_seq(c, l, x->cell[2]);
+  if (strcmp(f->sym, "take") == 0 || strcmp(f->sym, "drop") == 0)
+    return x->count == 3 && leff_seq(c, l, x->cell[2]);
+  return strcmp(f->sym, "lrange") == 0;
+}
+
+// Bind the symbols of q-expr in a copy of locals
+int leff_bind(lnames *n, lval *syms) {
+  if (syms->type != LVAL_QEXPR)
+    return 0;
+
+  for (int i = 0; i < syms->count; i++) {
+    if (syms->cell[i]->type != LVAL_SYM)
+      return 0;
+    lnames_add(n, syms->cell[i]->sym);
+  }
+  return 1;
+}
+
+// Builtin evaluating some of its operands as code
+int leff_form(leff *c, lnames *l, char *sym, lval **x, int n) {
+  if (strcmp(sym, "if") == 0) {
+    return n == 3 && leff_expr(c, l, x[0]) && leff_code(c, l, x[1]) &&
+           leff_code(c, l, x[2]);
+  }
+
+  // Quoted operands are evaluated as code
+  if (strcmp(sym, "and") == 0 || strcmp(sym, "or") == 0 ||
+      strcmp(sym, "not") == 0) {
+    for (int i = 0; i < n; i++) {
+      if (x[i]->type == LVAL_QEXPR ? !leff_code(c, l, x[i])
+                                   : !leff_expr(c, l, x[i]))
+        return 0;
+    }
+    return 1;
+  }
+
+  if (strcmp(sym, "future") == 0)
+    return n == 1 && leff_code(c, l, x[0]);
+
+  if (strcmp(sym, "while") == 0)
+    return n == 2 && leff_code(c, l, x[0]) && leff_code(c, l, x[1]);
+
+  if (strcmp(sym, "cond") == 0) {
+    for (int i = 0; i < n; i++) {
+      if (x[i]->type != LVAL_QEXPR || x[i]->count != 2 ||
+          !leff_expr(c, l, x[i]->cell[0]))
+        return 0;
+
+      // Quoted expression runs as code
+      lval *b = x[i]->cell[1];
+      if (b->type == LVAL_QEXPR ? !leff_code(c, l, b) : !leff_expr(c, l, b))
+        return 0;
+    }
+    return 1;
+  }
+
+  // The rest bind symbols for the code they run
+  lnames b = lnames_copy(l);
+  int r = 0;
+
+  if (strcmp(sym, "\\") == 0) {
+    r = n == 2 && leff_bind(&b, x[0]) && leff_code(c, &b, x[1]);
+  }
+
+  if (strcmp(sym, "let") == 0 && n == 2 && x[0]->type == LVAL_QEXPR) {
+    r = 1;
+    for (int i = 0; r && i < x[0]->count; i++) {
+      lval *p = x[0]->cell[i];
+      r = p->type == LVAL_QEXPR && p->count == 2 &&
+          p->cell[0]->type == LVAL_SYM && leff_expr(c, &b, p->cell[1]);
+      if (r)
+        lnames_add(&b, p->cell[0]->sym);
+    }
+    r = r && leff_code(c, &b, x[1]);
+  }
+
+  if (strcmp(sym, "dotimes") == 0 || strcmp(sym, "for-each") == 0 ||
+      strcmp(sym, "pfor") == 0) {
+    r = n == 3 && leff_expr(c, l, x[1]) && leff_bind(&b, x[0]) &&
+        leff_code(c, &b, x[2]);
+  }
+
+  lnames_free(&b);
+  return r;
+}
+
+int leff_call(leff *c, lnames *l, lval **x, int n) {
+  if (n == 0)
+    return 1;
+
+  lval *f = x[0];
+  if (f->type == LVAL_SYM) {
+    if (lnames_has(l, f->sym))
+      return n == 1;
+
+    // Other globals may change at any time
+    f = leff_global(c, l, f);
+    if (!f || f->type != LVAL_FUNC)
+      return 0;
+  } else if (f->type == LVAL_SEXPR) {
+    // Only a lambda made in place is known when called
+    return leff_fn(c, l, f) && leff_args(c, l, x + 1, n - 1);
+  }
+
+  if (f->type != LVAL_FUNC)
+    return leff_args(c, l, x + 1, n - 1);
+
+  // Lambda alone evaluates to itself
+  if (!f->builtin && n == 1)
+    return 1;
+
+  if (!f->builtin)
+    return leff_func(c, f) && leff_args(c, l, x + 1, n - 1);
+
+  // Sequence forced is the last argument
+  if (leff_forces(f) && !leff_seq(c, l, x[n - 1]))
+    return 0;
+
+  switch (f->effect) {
+  case LEFF_PURE:
+    return leff_args(c, l, x + 1, n - 1);
+
+  // Function comes first, what it calls it with is evaluated as usual
+  case LEFF_APPLY:
+    return n > 1 && leff_fn(c, l, x[1]) && leff_args(c, l, x + 2, n - 2);
+
+  case LEFF_CODE:
+    return leff_form(c, l, f->sym, x + 1, n - 1);
+
+  case LEFF_CHAN:
+    return c->chan && leff_args(c, l, x + 1, n - 1);
+
+  // Binding into frame of the call is not seen after it returns
+  case LEFF_LOCAL:
+    return n > 1 && leff_bind(l, x[1]) && leff_args(c, l, x + 2, n - 2);
+
+  default:
+    return 0;
+  }
+}
+
+// Whether every call in the body of lambda is pure
+int leff_body(leff *c, lval *f) {
+  lnames l = {0, 0, NULL};
+  for (int i = 0; i < f->formals->count; i++)
+    lnames_add(&l, f->formals->cell[i]->sym);
+  for (int i = 0; i < f->env->count; i++)
+    lnames_add(&l, f->env->syms[i]);
+
+  lval *body = f->src ? f->src : f->body;
+  int r = leff_call(c, &l, body->cell, body->count);
+  lnames_free(&l);
+  return r;
+}
+
+// Lambda reached again is already being found, the result is the
+// conjunction over all lambdas reached anyway
+int leff_isolated_lambda(leff *c, lval *f) {
+  for (int i = 0; i < c->nseen; i++) {
+    if (c->seen[i] == f)
+      return 1;
+  }
+
+  c->seen = realloc(c->seen, sizeof(lval *) * (c->nseen + 1));
+  c->seen[c->nseen++] = f;
+  return leff_body(c, f);
+}
+
+int leff_lambda(leff *c, lval *f) {
+  if (c->chan)
+    return leff_isolated_lambda(c, f);
+
+  // Known, or being found further up in which case it is assumed
+  // pure and results depending on that are not kept
+  if (f->pure_epoch == lopt_epoch) {
+    if (f->pure >= 0)
+      return f->pure;
+    if (-f->pure < c->low)
+      c->low = -f->pure;
+    return 1;
+  }
+
+  int depth = ++c->depth;
+  int low = c->low;
+  c->low = INT_MAX;
+  f->pure = -depth;
+  f->pure_epoch = lopt_epoch;
+
+  int r = leff_body(c, f);
+
+  if (!r || c->low >= depth) {
+    f->pure = r;
+  } else {
+    f->pure_epoch = -1;
+  }
+
+  if (low < c->low)
+    c->low = low;
+  c->depth--;
+  return r;
+}
+
+int leff_func(leff *c, lval *f) {
+  if (f->builtin)
+    return f->effect == LEFF_PURE || (c->chan && f->effect == LEFF_CHAN);
+  if (f->memo)
+    return leff_func(c, f->memo->func);
+  return leff_lambda(c, f);
+}
+
+int leff_pure(lenv *e, lval *f) {
+  while (e->par) {
+    e = e->par;
+  }
+
+  leff c = {e, 0, INT_MAX, 0, 0, NULL};
+  return leff_func(&c, f);
+}
+
+int leff_isolated(lenv *e, lval *f) {
+  if (leff_pure(e, f))
+    return 1;
+
+  while (e->par) {
+    e = e->par;
+  }
+
+  leff c = {e, 0, INT_MAX, 1, 0, NULL};
+  int r = leff_func(&c, f);
+  free(c.seen);
+  return r;
+}
+
+/**
+ * ---------------------------------------------------------------
+ * Escape of call frames. A lambda made in a body gets its own
+ * frame when it is called and formulas evaluate in the global
+ * environment, so nothing a call makes keeps its frame. What
+ * reaches the frame is binding into it, by = or by code run with
+ * eval. A lambda whose body has neither can be called on a frame
+ * on the stack. A function passed in may still be = itself, the
+ * frame then moves to the heap when bound into.
+ * ---------------------------------------------------------------
+ */
+
+int leff_frame_func(lval *v) {
+  return v && v->type == LVAL_FUNC && v->builtin &&
+         (v->effect == LEFF_LOCAL || v->effect == LEFF_EVAL);
+}
+
+int leff_frame_expr(leff *c, lnames *l, lval *x) {
+  switch (x->type) {
+  case LVAL_FUNC:
+    return !leff_frame_func(x);
+  case LVAL_SYM:
+    return !leff_frame_func(leff_global(c, l, x));
+  case LVAL_SEXPR:
+  case LVAL_QEXPR:
+    for (int i = 0; i < x->count; i++) {
+      if (!leff_frame_expr(c, l, x->cell[i]))
+        return 0;
+    }
+    return 1;
+  default:
+    return 1;
+  }
+}
+
+int leff_frame(lenv *e, lval *f) {
+  lspec *s = f->spec;
+  if (s->frame_epoch == lopt_epoch)
+    return s->frame;
+
+  while (e->par) {
+    e = e->par;
+  }
+
+  leff c = {e, 0, INT_MAX, 0, 0, NULL};
+  lnames l = {0, 0, NULL};
+  int r = 1;
+  for (int i = 0; i < f->formals->count; i++) {
+    if (strcmp(f->formals->cell[i]->sym, "&") == 0)
+      r = 0;
+    lnames_add(&l, f->formals->cell[i]->sym);
+  }
+
+  r = r && leff_frame_expr(&c, &l, f->body);
+  lnames_free(&l);
+
+  // Formals are bound without lenv_put, which would report them
+  for (int i = 0; r && i < f->formals->count; i++)
+    lopt_local(f->formals->cell[i]->sym);
+
+  s->frame = r;
+  s->frame_epoch = lopt_epoch;
+  return r;
+}
@@ -0,0 +1,25 @@
+#include "lval.h"
+
+#ifndef leff_h
+#define leff_h
+
+// Whether calling f can neither cause an effect nor depend on state
+// other than its arguments and the global functions it calls. Unknown
+// counts as impure.
+int leff_pure(lenv *e, lval *f);
+
+// Whether f can run on another thread, taking its arguments and the
+// global functions and channels along. Like pure, but sending and
+// receiving on channels is allowed.
+int leff_isolated(lenv *e, lval *f);
+
+// Whether builtin f runs the stages of a sequence it is given, which
+// calls the functions stored in them
+int leff_forces(lval *f);
+
+// Whether nothing in the body of lambda f binds into the frame of
+// its call, so the frame can live on the stack of the caller. Only
+// asked for lambdas that are not partially applied.
+int leff_frame(lenv *e, lval *f);
+
+#endif
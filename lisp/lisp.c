@@ -1,12 +1,16 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include "mpc.h"
 #include "lval.h"
+#include "laot.h"
+#include "lclo.h"
+#include "lctx.h"
+#include "ljit.h"
 
 // If it run on windows compile these funcions
 #ifdef _WIN32
-#include <string.h>
 
 static char buffer[2048];
 
@@ -42,45 +46,105 @@ void add_history(char *unused) {}
 
 int main(int argc, char **argv)
 {
-    // Create some Parsers
-    mpc_parser_t *Number = mpc_new("number");
-    mpc_parser_t *Symbol = mpc_new("symbol");
-    mpc_parser_t *Sexpr = mpc_new("sexpr");
-    mpc_parser_t *Qexpr = mpc_new("qexpr");
-    mpc_parser_t *Expr = mpc_new("expr");
-    mpc_parser_t *Lispy = mpc_new("lispy");
-
-    // Define them with the following Language
-    mpca_lang(MPCA_LANG_DEFAULT,
-              "                                                           \
-                number : /-?[0-9]+/ ;                                     \
-                symbol : /[a-zA-Z0-9_+\\-*\\/\\\\=<>!&]+/ ;               \
-                sexpr  : '(' <expr>* ')' ;                                \
-                qexpr  : '{' <expr>* '}' ;                                \
-                expr   : <number> | <symbol> | <sexpr> | <qexpr> ;        \
-                lispy  : /^/ <expr>* /$/ ;                                \
-                ",
-              Number, Symbol, Sexpr, Qexpr, Expr, Lispy);
+    // Options come first, then the files to run
+    int arg = 1;
+    char *out = NULL;
+    for (; arg < argc && argv[arg][0] == '-'; arg++)
+    {
+        if (strcmp(argv[arg], "--closure") == 0)
+            lclo_engine = 1;
+        else if (strcmp(argv[arg], "--jit") == 0)
+            ljit_enabled = 1;
+        else if (strcmp(argv[arg], "--lispc") == 0 && arg + 1 < argc)
+            out = argv[++arg];
+        else
+        {
+            fprintf(stderr, "Unknown option %s\n", argv[arg]);
+            fprintf(stderr,
+                    "Usage: %s [--closure] [--jit] [--lispc out] [file...]\n",
+                    argv[0]);
+            return 1;
+        }
+    }
 
-    // Print Version and Exit Information
-    puts("Lispy Version 0.0.1");
-    puts("Press ctrl+c to Exit!\n");
+    if (out && arg == argc)
+    {
+        fprintf(stderr, "lispc: no files to compile\n");
+        return 1;
+    }
+
+    // Create the parsers of the grammar
+    lgrammar g;
+    lgrammar_new(&g);
 
     lenv *e = lenv_new();
     lenv_add_builtins(e);
 
+    // Run each expression of the files in order, only errors are
+    // printed, then exit without the prompt. With lispc they are
+    // compiled into one program instead.
+    if (arg < argc)
+    {
+        lval *prog = lval_sexpr();
+        int status = 0;
+
+        for (; arg < argc; arg++)
+        {
+            mpc_result_t r;
+            if (!mpc_parse_contents(argv[arg], g.Lispy, &r))
+            {
+                mpc_err_print(r.error);
+                mpc_err_delete(r.error);
+                status = 1;
+                continue;
+            }
+
+            lval *x = lval_read(r.output);
+            mpc_ast_delete(r.output);
+
+            while (x->count)
+            {
+                if (out)
+                {
+                    prog = lval_push(prog, lval_pop(x, 0));
+                    continue;
+                }
+
+                lval *v = lval_eval(e, lval_pop(x, 0));
+                if (v->type == LVAL_ERR)
+                    lval_println(v);
+                lval_del(v);
+            }
+            lval_del(x);
+        }
+
+        if (out)
+            status = status || laot_compile(e, prog, out);
+
+        lval_del(prog);
+        lenv_del(e);
+        lgrammar_del(&g);
+        return out ? status : 0;
+    }
+
+    // Print Version and Exit Information
+    puts("Lispy Version 0.0.1");
+    puts("Press ctrl+c to Exit!\n");
+
     // In a never ending loop
     while (1)
     {
         // Display the prompt and get input
         char *input = readline("lispy> ");
+        if (!input)
+            break;
 
         // Add input to history
         add_history(input);
 
         // Attempt to parse user input
         mpc_result_t r;
-        if (mpc_parse("<stdin>", input, Lispy, &r))
+        if (mpc_parse("<stdin>", input, g.Lispy, &r))
         {
             lval *v = lval_eval(e, lval_read(r.output));
             lval_println(v);
@@ -98,7 +162,7 @@ int main(int argc, char **argv)
     }
 
     lenv_del(e);
-    mpc_cleanup(6, Number, Symbol, Sexpr, Qexpr, Expr, Lispy);
+    lgrammar_del(&g);
 
     return 0;
 }
@@ -0,0 +1,387 @@
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ljit.h"
+#include "lspec.h"
+#include "lval.h"
+
+__thread int ljit_enabled = 0;
+
+#if defined(__x86_64__) && defined(__unix__)
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+/**
+ * ---------------------------------------------------------------
+ * Template JIT for x86-64. Each node of the integer code is emitted
+ * as a fixed sequence of instructions, the value of a node ends up
+ * in rax and operands wait on the machine stack. rbx holds the slots
+ * and r12 where the result goes. Overflow and division by zero jump
+ * to the bail label which returns 1, a tail call of itself stores
+ * the arguments into the slots and jumps back to the top.
+ * ---------------------------------------------------------------
+ */
+
+typedef struct
+{
+    unsigned char *code;
+    int len;
+    int cap;
+
+    lspec *self;
+    int top;
+
+    // Jumps to the bail label, patched once it is placed
+    int *bails;
+    int nbails;
+} ljit;
+
+void ljit_byte(ljit *j, int n, ...) {
+  if (j->len + n > j->cap) {
+    j->cap = (j->len + n) * 2;
+    j->code = realloc(j->code, j->cap);
+  }
+
+  va_list ap;
+  va_start(ap, n);
+  for (int i = 0; i < n; i++)
+    j->code[j->len++] = va_arg(ap, int);
+  va_end(ap);
+}
+
+void ljit_imm32(ljit *j, int32_t v) {
+  ljit_byte(j, 4, v & 0xff, (v >> 8) & 0xff, (v >> 16) & 0xff,
+            (v >> 24) & 0xff);
+}
+
+void ljit_imm64(ljit *j, int64_t v) {
+  ljit_imm32(j, (int32_t)v);
+  ljit_imm32(j, (int32_t)(v >> 32));
+}
+
+// Jump with 32 bit displacement to be patched, returns where it is
+int ljit_jump(ljit *j, int n, ...) {
+  va_list ap;
+  va_start(ap, n);
+  for (int i = 0; i < n; i++)
+    ljit_byte(j, 1, va_arg(ap, int));
+  va_end(ap);
+
+  ljit_imm32(j, 0);
+  return j->len - 4;
+}
+
+void ljit_patch(ljit *j, int at, int to) {
+  int32_t d = to - (at + 4);
+  memcpy(j->code + at, &d, 4);
+}
+
+// Jump taken when the overflow flag is set, or always
+void ljit_bail(ljit *j, int always) {
+  j->bails = realloc(j->bails, sizeof(int) * (j->nbails + 1));
+  if (always)
+    j->bails[j->nbails++] = ljit_jump(j, 1, 0xe9);
+  else
+    j->bails[j->nbails++] = ljit_jump(j, 2, 0x0f, 0x80);
+}
+
+// mov rax, [rbx + 8 * slot] and the other way
+void ljit_load(ljit *j, long slot) {
+  ljit_byte(j, 3, 0x48, 0x8b, 0x83);
+  ljit_imm32(j, slot * 8);
+}
+
+void ljit_store(ljit *j, long slot) {
+  ljit_byte(j, 3, 0x48, 0x89, 0x83);
+  ljit_imm32(j, slot * 8);
+}
+
+int ljit_node(ljit *j, lnode *n, int tail);
+
+// Left operand in rcx, right one in rax
+int ljit_pair(ljit *j, lnode *x, lnode *y) {
+  if (!ljit_node(j, x, 0))
+    return 0;
+  ljit_byte(j, 1, 0x50); // push rax
+  if (!ljit_node(j, y, 0))
+    return 0;
+  ljit_byte(j, 1, 0x59); // pop rcx
+  return 1;
+}
+
+// rax = rcx op rax as the evaluator divides
+void ljit_div(ljit *j, int mod) {
+  // test rax, rax; jz bail
+  ljit_byte(j, 3, 0x48, 0x85, 0xc0);
+  j->bails = realloc(j->bails, sizeof(int) * (j->nbails + 1));
+  j->bails[j->nbails++] = ljit_jump(j, 2, 0x0f, 0x84);
+
+  // cmp rax, -1; jne idiv
+  ljit_byte(j, 4, 0x48, 0x83, 0xf8, 0xff);
+  int other = ljit_jump(j, 2, 0x0f, 0x85);
+
+  if (mod) {
+    ljit_byte(j, 2, 0x31, 0xc0); // xor eax, eax
+  } else {
+    ljit_byte(j, 3, 0x48, 0xf7, 0xd9); // neg rcx
+    ljit_bail(j, 0);
+    ljit_byte(j, 3, 0x48, 0x89, 0xc8); // mov rax, rcx
+  }
+  int done = ljit_jump(j, 1, 0xe9);
+
+  ljit_patch(j, other, j->len);
+  ljit_byte(j, 3, 0x49, 0x89, 0xc0); // mov r8, rax
+  ljit_byte(j, 3, 0x48, 0x89, 0xc8); // mov rax, rcx
+  ljit_byte(j, 2, 0x48, 0x99);       // cqo
+  ljit_byte(j, 3, 0x49, 0xf7, 0xf8); // idiv r8
+  if (mod)
+    ljit_byte(j, 3, 0x48, 0x89, 0xd0); // mov rax, rdx
+
+  ljit_patch(j, done, j->len);
+}
+
+int ljit_arith(ljit *j, lnode *n) {
+  if (!ljit_node(j, n->kids[0], 0))
+    return 0;
+
+  for (int i = 1; i < n->count; i++) {
+    ljit_byte(j, 1, 0x50); // push rax
+    if (!ljit_node(j, n->kids[i], 0))
+      return 0;
+    ljit_byte(j, 1, 0x59); // pop rcx
+
+    switch (n->op) {
+    case LSPEC_ADD:
+      ljit_byte(j, 3, 0x48, 0x01, 0xc8); // add rax, rcx
+      ljit_bail(j, 0);
+      break;
+    case LSPEC_SUB:
+      ljit_byte(j, 3, 0x48, 0x29, 0xc1); // sub rcx, rax
+      ljit_bail(j, 0);
+      ljit_byte(j, 3, 0x48, 0x89, 0xc8); // mov rax, rcx
+      break;
+    case LSPEC_MUL:
+      ljit_byte(j, 4, 0x48, 0x0f, 0xaf, 0xc1); // imul rax, rcx
+      ljit_bail(j, 0);
+      break;
+    case LSPEC_DIV:
+    case LSPEC_MOD:
+      ljit_div(j, n->op == LSPEC_MOD);
+      break;
+    }
+  }
+
+  return 1;
+}
+
+// Set al from flags and widen it to rax
+void ljit_set(ljit *j, int cc) {
+  ljit_byte(j, 3, 0x0f, cc, 0xc0);
+  ljit_byte(j, 3, 0x0f, 0xb6, 0xc0);
+}
+
+// Each operand tested in turn, stop deciding the result
+int ljit_logic(ljit *j, lnode *n) {
+  int and = n->op == LSPEC_AND;
+  int *exits = malloc(sizeof(int) * (n->count + 1));
+
+  for (int i = 0; i < n->count; i++) {
+    if (!ljit_node(j, n->kids[i], 0)) {
+      free(exits);
+      return 0;
+    }
+    ljit_byte(j, 3, 0x48, 0x85, 0xc0); // test rax, rax
+    exits[i] = ljit_jump(j, 2, 0x0f, and ? 0x84 : 0x85);
+  }
+
+  ljit_byte(j, 5, 0xb8, and, 0, 0, 0); // mov eax, all decided
+  int done = ljit_jump(j, 1, 0xe9);
+
+  for (int i = 0; i < n->count; i++)
+    ljit_patch(j, exits[i], j->len);
+  ljit_byte(j, 5, 0xb8, !and, 0, 0, 0);
+
+  ljit_patch(j, done, j->len);
+  free(exits);
+  return 1;
+}
+
+int ljit_node(ljit *j, lnode *n, int tail) {
+  int at, done;
+
+  switch (n->op) {
+  case LSPEC_NUM:
+    ljit_byte(j, 2, 0x48, 0xb8);
+    ljit_imm64(j, n->val);
+    return 1;
+  case LSPEC_SLOT:
+    ljit_load(j, n->val);
+    return 1;
+  case LSPEC_SET:
+    if (!ljit_node(j, n->kids[0], 0))
+      return 0;
+    ljit_store(j, n->val);
+    return 1;
+
+  case LSPEC_ADD:
+  case LSPEC_SUB:
+  case LSPEC_MUL:
+  case LSPEC_DIV:
+  case LSPEC_MOD:
+    return ljit_arith(j, n);
+  case LSPEC_NEG:
+    if (!ljit_node(j, n->kids[0], 0))
+      return 0;
+    ljit_byte(j, 3, 0x48, 0xf7, 0xd8); // neg rax
+    ljit_bail(j, 0);
+    return 1;
+
+  case LSPEC_LT:
+  case LSPEC_GT:
+  case LSPEC_LE:
+  case LSPEC_GE:
+  case LSPEC_EQ:
+  case LSPEC_NE:
+    if (!ljit_pair(j, n->kids[0], n->kids[1]))
+      return 0;
+    ljit_byte(j, 3, 0x48, 0x39, 0xc1); // cmp rcx, rax
+    ljit_set(j, n->op == LSPEC_LT   ? 0x9c
+                : n->op == LSPEC_GT ? 0x9f
+                : n->op == LSPEC_LE ? 0x9e
+                : n->op == LSPEC_GE ? 0x9d
+                : n->op == LSPEC_EQ ? 0x94
+                                    : 0x95);
+    return 1;
+
+  case LSPEC_NOT:
+    if (!ljit_node(j, n->kids[0], 0))
+      return 0;
+    ljit_byte(j, 3, 0x48, 0x85, 0xc0);
+    ljit_set(j, 0x94);
+    return 1;
+  case LSPEC_AND:
+  case LSPEC_OR:
+    return ljit_logic(j, n);
+
+  case LSPEC_IF:
+    if (!ljit_node(j, n->kids[0], 0))
+      return 0;
+    ljit_byte(j, 3, 0x48, 0x85, 0xc0);
+    at = ljit_jump(j, 2, 0x0f, 0x84); // jz else
+    if (!ljit_node(j, n->kids[1], tail))
+      return 0;
+    done = ljit_jump(j, 1, 0xe9);
+    ljit_patch(j, at, j->len);
+    if (!ljit_node(j, n->kids[2], tail))
+      return 0;
+    ljit_patch(j, done, j->len);
+    return 1;
+  case LSPEC_LET:
+    for (int i = 0; i < n->count - 1; i++) {
+      if (!ljit_node(j, n->kids[i], 0))
+        return 0;
+    }
+    return ljit_node(j, n->kids[n->count - 1], tail);
+
+  case LSPEC_CALL:
+    // Only a tail call of itself, which becomes a loop
+    if (!tail || n->fn != j->self)
+      return 0;
+
+    for (int i = 0; i < n->count; i++) {
+      if (!ljit_node(j, n->kids[i], 0))
+        return 0;
+      ljit_byte(j, 1, 0x50);
+    }
+    for (int i = n->count - 1; i >= 0; i--) {
+      ljit_byte(j, 1, 0x58); // pop rax
+      ljit_store(j, i);
+    }
+    ljit_patch(j, ljit_jump(j, 1, 0xe9), j->top);
+    return 1;
+  }
+
+  return 0;
+}
+
+// Append the code to the map perf reads symbols of JIT code from
+void ljit_perf(void *code, size_t len, char *name) {
+  char path[64];
+  snprintf(path, sizeof(path), "/tmp/perf-%d.map", (int)getpid());
+
+  FILE *f = fopen(path, "a");
+  if (!f)
+    return;
+
+  fprintf(f, "%lx %zx lispy:%s\n", (unsigned long)code, len, name);
+  fclose(f);
+}
+
+ljit_fn ljit_compile(lspec *s, char *name, size_t *size) {
+  ljit j = {NULL, 0, 0, s, 0, NULL, 0};
+
+  // push rbp; mov rbp, rsp; push rbx; push r12
+  ljit_byte(&j, 4, 0x55, 0x48, 0x89, 0xe5);
+  ljit_byte(&j, 3, 0x53, 0x41, 0x54);
+  // mov rbx, rdi; mov r12, rsi
+  ljit_byte(&j, 6, 0x48, 0x89, 0xfb, 0x49, 0x89, 0xf4);
+  j.top = j.len;
+
+  if (!ljit_node(&j, s->code, 1)) {
+    free(j.code);
+    free(j.bails);
+    return NULL;
+  }
+
+  // mov [r12], rax; xor eax, eax
+  ljit_byte(&j, 4, 0x49, 0x89, 0x04, 0x24);
+  ljit_byte(&j, 2, 0x31, 0xc0);
+  int done = ljit_jump(&j, 1, 0xe9);
+
+  // Operands may still be on the stack, so reset it from rbp
+  for (int i = 0; i < j.nbails; i++)
+    ljit_patch(&j, j.bails[i], j.len);
+  ljit_byte(&j, 4, 0x48, 0x8d, 0x65, 0xf0); // lea rsp, [rbp - 16]
+  ljit_byte(&j, 5, 0xb8, 1, 0, 0, 0);       // mov eax, 1
+
+  // pop r12; pop rbx; pop rbp; ret
+  ljit_patch(&j, done, j.len);
+  ljit_byte(&j, 5, 0x41, 0x5c, 0x5b, 0x5d, 0xc3);
+
+  long page = sysconf(_SC_PAGESIZE);
+  *size = (j.len + page - 1) / page * page;
+
+  void *mem = mmap(NULL, *size, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (mem == MAP_FAILED) {
+    free(j.code);
+    free(j.bails);
+    return NULL;
+  }
+
+  memcpy(mem, j.code, j.len);
+  free(j.code);
+  free(j.bails);
+
+  if (mprotect(mem, *size, PROT_READ | PROT_EXEC) != 0) {
+    munmap(mem, *size);
+    return NULL;
+  }
+
+  ljit_perf(mem, j.len, name);
+  return (ljit_fn)mem;
+}
+
+void ljit_free(ljit_fn fn, size_t size) { munmap((void *)fn, size); }
+
+#else
+
+ljit_fn ljit_compile(lspec *s, char *name, size_t *size) { return NULL; }
+
+void ljit_free(ljit_fn fn, size_t size) {}
+
+#endif
@@ -0,0 +1,22 @@
+#include <stddef.h>
+
+#include "lval.h"
+
+#ifndef ljit_h
+#define ljit_h
+
+// Native code of a lambda, called with its slots. Stores the result
+// and returns 0, or returns 1 when the interpreter has to do the call.
+typedef int (*ljit_fn)(long *slots, long *r);
+
+// Selected by command line, hot integer code is compiled to native
+extern __thread int ljit_enabled;
+
+// Compile integer code of s into executable pages and report it in
+// the perf map under name. NULL when the code uses anything besides
+// arithmetic, comparison, logic, if, let and tail calls of itself, or
+// when native code is not supported here.
+ljit_fn ljit_compile(lspec *s, char *name, size_t *size);
+void ljit_free(ljit_fn fn, size_t size);
+
+#endif
@@ -0,0 +1,185 @@
+#include <stdlib.h>
+
+#include "lmemo.h"
+#include "lval.h"
+
+/**
+ * ---------------------------------------------------------------
+ * Bounded cache of function results. Entries live in a fixed
+ * array of capacity size, found through a linear probing index
+ * and evicted either least recently used first or by a CLOCK
+ * hand that spare entries used since it last passed.
+ * ---------------------------------------------------------------
+ */
+
+lmemo *lmemo_new(lval *func, int cap, int policy) {
+  lmemo *m = malloc(sizeof(lmemo));
+  m->ref = 1;
+  m->func = func;
+  m->policy = policy;
+  m->cap = cap;
+  m->count = 0;
+  m->ents = malloc(sizeof(lmemo_entry) * cap);
+
+  // Keep index at most half full
+  int n = 2;
+  while (n < cap * 2)
+    n *= 2;
+  m->index = calloc(n, sizeof(int));
+  m->mask = n - 1;
+
+  m->head = -1;
+  m->tail = -1;
+  m->hand = 0;
+  m->hits = 0;
+  m->misses = 0;
+  return m;
+}
+
+void lmemo_release(lmemo *m) {
+  if (--m->ref > 0)
+    return;
+
+  for (int i = 0; i < m->count; i++) {
+    lval_del(m->ents[i].key);
+    lval_del(m->ents[i].val);
+  }
+
+  lval_del(m->func);
+  free(m->ents);
+  free(m->index);
+  free(m);
+}
+
+// Index slot holding the arguments or the empty slot ending the probe
+int lmemo_slot(lmemo *m, lval *args, uint64_t h) {
+  int i = h & m->mask;
+
+  while (m->index[i]) {
+    lmemo_entry *x = &m->ents[m->index[i] - 1];
+    if (x->hash == h && lval_eq(x->key, args))
+      return i;
+    i = (i + 1) & m->mask;
+  }
+
+  return i;
+}
+
+// Empty the slot and move later entries of the probe back into it
+void lmemo_unindex(lmemo *m, int i) {
+  int j = i;
+
+  for (;;) {
+    j = (j + 1) & m->mask;
+    if (!m->index[j])
+      break;
+
+    int k = m->ents[m->index[j] - 1].hash & m->mask;
+    // Move the entry unless its home lies cyclically in (i, j]
+    if ((j > i && (k <= i || k > j)) || (j < i && k <= i && k > j)) {
+      m->index[i] = m->index[j];
+      i = j;
+    }
+  }
+
+  m->index[i] = 0;
+}
+
+void lmemo_unlink(lmemo *m, int n) {
+  lmemo_entry *x = &m->ents[n];
+
+  if (x->prev >= 0)
+    m->ents[x->prev].next = x->next;
+  else
+    m->head = x->next;
+
+  if (x->next >= 0)
+    m->ents[x->next].prev = x->prev;
+  else
+    m->tail = x->prev;
+}
+
+void lmemo_link(lmemo *m, int n) {
+  lmemo_entry *x = &m->ents[n];
+  x->prev = -1;
+  x->next = m->head;
+
+  if (m->head >= 0)
+    m->ents[m->head].prev = n;
+  else
+    m->tail = n;
+  m->head = n;
+}
+
+// Mark entry as just used
+void lmemo_touch(lmemo *m, int n) {
+  if (m->policy == LMEMO_CLOCK) {
+    m->ents[n].used = 1;
+  } else if (m->head != n) {
+    lmemo_unlink(m, n);
+    lmemo_link(m, n);
+  }
+}
+
+// Entry to reuse when the cache is full
+int lmemo_victim(lmemo *m) {
+  if (m->policy != LMEMO_CLOCK)
+    return m->tail;
+
+  while (m->ents[m->hand].used) {
+    m->ents[m->hand].used = 0;
+    m->hand = (m->hand + 1) % m->cap;
+  }
+
+  int n = m->hand;
+  m->hand = (m->hand + 1) % m->cap;
+  return n;
+}
+
+lval *lmemo_get(lmemo *m, lval *args, uint64_t h) {
+  int i = lmemo_slot(m, args, h);
+  if (!m->index[i])
+    return NULL;
+
+  lmemo_touch(m, m->index[i] - 1);
+  return m->ents[m->index[i] - 1].val;
+}
+
+void lmemo_put(lmemo *m, lval *args, uint64_t h, lval *val) {
+  int i = lmemo_slot(m, args, h);
+
+  // Already cached by a nested call with same arguments
+  if (m->index[i]) {
+    int n = m->index[i] - 1;
+    lval_del(m->ents[n].val);
+    m->ents[n].val = val;
+    lval_del(args);
+    lmemo_touch(m, n);
+    return;
+  }
+
+  int n;
+  if (m->count < m->cap) {
+    n = m->count++;
+  } else {
+    n = lmemo_victim(m);
+    lmemo_unindex(m, lmemo_slot(m, m->ents[n].key, m->ents[n].hash));
+    if (m->policy != LMEMO_CLOCK)
+      lmemo_unlink(m, n);
+
+    lval_del(m->ents[n].key);
+    lval_del(m->ents[n].val);
+
+    // Removal may have moved the probe end
+    i = lmemo_slot(m, args, h);
+  }
+
+  m->ents[n].hash = h;
+  m->ents[n].key = args;
+  m->ents[n].val = val;
+  m->ents[n].used = 0;
+  m->index[i] = n + 1;
+
+  if (m->policy != LMEMO_CLOCK)
+    lmemo_link(m, n);
+}
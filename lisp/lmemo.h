@@ -0,0 +1,61 @@
+#include <stdint.h>
+
+#include "lval.h"
+
+#ifndef lmemo_h
+#define lmemo_h
+
+// Eviction policies
+enum
+{
+    LMEMO_LRU,
+    LMEMO_CLOCK,
+};
+
+// Cached result of one argument list. LRU keeps entries in a list
+// from the most recently used, CLOCK only marks them as used.
+typedef struct
+{
+    uint64_t hash;
+    lval *key;
+    lval *val;
+    int prev;
+    int next;
+    int used;
+} lmemo_entry;
+
+// Cache of a function, shared between copies of the memo function
+struct lmemo
+{
+    int ref;
+    lval *func;
+    int policy;
+
+    int cap;
+    int count;
+    lmemo_entry *ents;
+
+    // Open addressing index holding entry number plus one, 0 is empty
+    int *index;
+    int mask;
+
+    int head;
+    int tail;
+    int hand;
+
+    long hits;
+    long misses;
+};
+
+// Takes ownership of the function
+lmemo *lmemo_new(lval *func, int cap, int policy);
+void lmemo_release(lmemo *m);
+
+// Borrowed result cached for the arguments or NULL
+lval *lmemo_get(lmemo *m, lval *args, uint64_t h);
+
+// Cache the result, evicting an entry when full. Takes ownership of
+// both arguments and result.
+void lmemo_put(lmemo *m, lval *args, uint64_t h, lval *val);
+
+#endif
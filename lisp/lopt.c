@@ -0,0 +1,644 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "leff.h"
+#include "lopt.h"
+#include "lval.h"
+
+/**
+ * ---------------------------------------------------------------
+ * Optimiser of lambda bodies. Calls of arithmetic and comparison
+ * builtins over literals are folded, if with a literal condition
+ * is replaced by its branch and calls of small global lambdas are
+ * inlined. Only names resolving to the global environment are
+ * touched, a name that is quoted in the body or was ever bound
+ * locally might refer to something else at run time.
+ * ---------------------------------------------------------------
+ */
+
+__thread long lopt_epoch = 0;
+
+// Epoch the global environment was last optimised at
+__thread long lopt_checked = 0;
+
+// Inlined body at most this many nodes and this deep in inlining
+#define LOPT_INLINE_SIZE 32
+#define LOPT_INLINE_DEPTH 3
+
+// Largest exponent of a power that is folded
+#define LOPT_FOLD_POW 64
+
+// Set of names ever bound outside of global environment
+__thread lnames lopt_locals = {0, 0, NULL};
+
+__thread lopt_log lopt_changes;
+
+uint64_t lopt_hash(char *s) {
+  uint64_t h = 14695981039346656037ULL;
+  for (; *s; s++) {
+    h ^= (unsigned char)*s;
+    h *= 1099511628211ULL;
+  }
+  return h;
+}
+
+// Slot of name in set or the empty slot where it belongs
+int lnames_slot(lnames *n, char *s) {
+  int i = lopt_hash(s) & (n->cap - 1);
+  while (n->names[i] && strcmp(n->names[i], s) != 0)
+    i = (i + 1) & (n->cap - 1);
+  return i;
+}
+
+int lnames_has(lnames *n, char *s) {
+  return n->cap && n->names[lnames_slot(n, s)];
+}
+
+// Add name, return 0 when it was already there
+int lnames_add(lnames *n, char *s) {
+  if ((n->count + 1) * 2 > n->cap) {
+    lnames old = *n;
+    n->cap = old.cap ? old.cap * 2 : 64;
+    n->count = 0;
+    n->names = calloc(n->cap, sizeof(char *));
+    for (int i = 0; i < old.cap; i++) {
+      if (old.names[i])
+        n->names[lnames_slot(n, old.names[i])] = old.names[i];
+    }
+    n->count = old.count;
+    free(old.names);
+  }
+
+  int i = lnames_slot(n, s);
+  if (n->names[i])
+    return 0;
+
+  n->names[i] = malloc(strlen(s) + 1);
+  strcpy(n->names[i], s);
+  n->count++;
+  return 1;
+}
+
+lnames lnames_copy(lnames *n) {
+  lnames c = {0, 0, NULL};
+  for (int i = 0; i < n->cap; i++) {
+    if (n->names[i])
+      lnames_add(&c, n->names[i]);
+  }
+  return c;
+}
+
+void lnames_free(lnames *n) {
+  for (int i = 0; i < n->cap; i++)
+    free(n->names[i]);
+  free(n->names);
+}
+
+void lopt_log_free(lopt_log *l) {
+  for (int i = 0; i < l->count; i++)
+    free(l->names[i]);
+  l->count = 0;
+}
+
+// Record name as changed at the current epoch. When full the older
+// half goes, lambdas optimised before it are then optimised in full.
+void lopt_log_add(char *name) {
+  lopt_log *l = &lopt_changes;
+  if (l->count == LOPT_LOG) {
+    int half = LOPT_LOG / 2;
+    l->base = l->epochs[half - 1];
+    for (int i = 0; i < half; i++)
+      free(l->names[i]);
+    memmove(l->epochs, l->epochs + half, sizeof(long) * (LOPT_LOG - half));
+    memmove(l->names, l->names + half, sizeof(char *) * (LOPT_LOG - half));
+    l->count -= half;
+  }
+
+  l->epochs[l->count] = lopt_epoch;
+  l->names[l->count] = malloc(strlen(name) + 1);
+  strcpy(l->names[l->count], name);
+  l->count++;
+}
+
+void lopt_changed(char *name) {
+  lopt_epoch++;
+  lopt_log_add(name);
+}
+
+int lopt_is_local(char *name) { return lnames_has(&lopt_locals, name); }
+
+void lopt_local(char *name) {
+  if (lnames_add(&lopt_locals, name))
+    lopt_changed(name);
+}
+
+// Only functions are folded or inlined, so only replacing one of
+// them matters. A new lambda may be inlined where it was unbound.
+void lopt_global(char *name, lval *old, lval *v) {
+  if ((old && old->type == LVAL_FUNC) ||
+      (v->type == LVAL_FUNC && !v->builtin))
+    lopt_changed(name);
+}
+
+typedef struct
+{
+    lenv *root;
+    lnames shadow;
+    int depth;
+} lopt;
+
+int lopt_is(lval *x, char *sym) {
+  if (x->type == LVAL_SYM)
+    return strcmp(x->sym, sym) == 0;
+  return x->type == LVAL_FUNC && x->builtin && strcmp(x->sym, sym) == 0;
+}
+
+// Branches of (if c {t} {e}) are code, every other q-expr is data
+int lopt_branch(lval *x, int i) {
+  return x->type == LVAL_SEXPR && x->count == 4 && i >= 2 &&
+         x->cell[i]->type == LVAL_QEXPR && lopt_is(x->cell[0], "if");
+}
+
+// Collect every symbol of q-expr
+void lopt_quote(lnames *n, lval *x) {
+  if (x->type == LVAL_SYM)
+    lnames_add(n, x->sym);
+
+  if (x->type == LVAL_SEXPR || x->type == LVAL_QEXPR) {
+    for (int i = 0; i < x->count; i++)
+      lopt_quote(n, x->cell[i]);
+  }
+}
+
+// Collect symbols quoted as data in the cells of call, a branch of
+// if is a call too
+void lopt_quoted_call(lnames *n, lval *x) {
+  int branches = x->count == 4 && lopt_is(x->cell[0], "if");
+  for (int i = 0; i < x->count; i++) {
+    lval *c = x->cell[i];
+    if (branches && i >= 2 && c->type == LVAL_QEXPR) {
+      lopt_quoted_call(n, c);
+    } else {
+      lopt_quoted(n, c);
+    }
+  }
+}
+
+// Collect symbols quoted as data anywhere in code
+void lopt_quoted(lnames *n, lval *x) {
+  if (x->type == LVAL_QEXPR) {
+    lopt_quote(n, x);
+    return;
+  }
+
+  if (x->type == LVAL_SEXPR)
+    lopt_quoted_call(n, x);
+}
+
+// Function the head of call surely refers to, or NULL
+lval *lopt_head(lopt *o, lval *h) {
+  if (h->type == LVAL_FUNC)
+    return h;
+
+  if (h->type != LVAL_SYM || lnames_has(&o->shadow, h->sym) ||
+      lnames_has(&lopt_locals, h->sym))
+    return NULL;
+
+  for (int i = 0; i < o->root->count; i++) {
+    if (strcmp(o->root->syms[i], h->sym) == 0) {
+      lval *v = o->root->vals[i];
+      return v->type == LVAL_FUNC ? v : NULL;
+    }
+  }
+
+  return NULL;
+}
+
+int lopt_literal(lval *x) {
+  return x->type == LVAL_NUM || x->type == LVAL_DBL || x->type == LVAL_BIG ||
+         x->type == LVAL_STR;
+}
+
+// Builtins folded over literals, each cheap and giving a number
+int lopt_foldable(char *sym) {
+  static char *ops[] = {"+",  "-",  "*",  "/",  "%",  "^",  "<",
+                        ">",  "<=", ">=", "==", "!=", "not", NULL};
+  for (int i = 0; ops[i]; i++) {
+    if (strcmp(ops[i], sym) == 0)
+      return 1;
+  }
+  return 0;
+}
+
+int lopt_size(lval *x) {
+  int n = 1;
+  if (x->type == LVAL_SEXPR || x->type == LVAL_QEXPR) {
+    for (int i = 0; i < x->count; i++)
+      n += lopt_size(x->cell[i]);
+  }
+  return n;
+}
+
+// Whether x mentions any of the names
+int lopt_mentions_any(lval *x, lnames *names) {
+  if (x->type == LVAL_SYM)
+    return lnames_has(names, x->sym);
+
+  if (x->type == LVAL_SEXPR || x->type == LVAL_QEXPR) {
+    for (int i = 0; i < x->count; i++) {
+      if (lopt_mentions_any(x->cell[i], names))
+        return 1;
+    }
+  }
+  return 0;
+}
+
+int lopt_mentions(lval *x, char *sym) {
+  if (x->type == LVAL_SYM)
+    return strcmp(x->sym, sym) == 0;
+
+  if (x->type == LVAL_SEXPR || x->type == LVAL_QEXPR) {
+    for (int i = 0; i < x->count; i++) {
+      if (lopt_mentions(x->cell[i], sym))
+        return 1;
+    }
+  }
+  return 0;
+}
+
+// Body only made of calls, atoms and branches of if, with nothing
+// that look at the frame of the call
+int lopt_inlinable(lval *x) {
+  if (x->type == LVAL_SYM)
+    return strcmp(x->sym, "eval") != 0 && strcmp(x->sym, "show") != 0;
+
+  if (x->type == LVAL_QEXPR)
+    return 0;
+
+  if (x->type == LVAL_SEXPR) {
+    for (int i = 0; i < x->count; i++) {
+      lval *c = x->cell[i];
+      if (lopt_branch(x, i)) {
+        for (int j = 0; j < c->count; j++) {
+          if (!lopt_inlinable(c->cell[j]))
+            return 0;
+        }
+      } else if (!lopt_inlinable(c)) {
+        return 0;
+      }
+    }
+  }
+
+  return 1;
+}
+
+// Body only calling builtins that call no function, if aside. A
+// lambda called from the body looks names up in the frame of the
+// call, so formals must then be bound rather than substituted.
+int lopt_builtin_calls(lopt *o, lval *x, lval *formals) {
+  if (x->type != LVAL_SEXPR)
+    return 1;
+
+  if (x->count > 1) {
+    lval *h = x->cell[0];
+    if (h->type == LVAL_SYM && lopt_mentions(formals, h->sym))
+      return 0;
+
+    lval *f = lopt_head(o, h);
+    if (!f || !f->builtin || leff_forces(f) ||
+        (f->effect != LEFF_PURE && !lopt_is(h, "if")))
+      return 0;
+  }
+
+  for (int i = 0; i < x->count; i++) {
+    lval *c = x->cell[i];
+    if (lopt_branch(x, i)) {
+      for (int j = 0; j < c->count; j++) {
+        if (!lopt_builtin_calls(o, c->cell[j], formals))
+          return 0;
+      }
+    } else if (!lopt_builtin_calls(o, c, formals)) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+// Replace symbols of formals by the arguments
+lval *lopt_subst(lval *x, lval *formals, lval *args) {
+  if (x->type == LVAL_SYM) {
+    for (int i = 0; i < formals->count; i++) {
+      if (strcmp(x->sym, formals->cell[i]->sym) == 0) {
+        lval_del(x);
+        return lval_copy(args->cell[i + 1]);
+      }
+    }
+  }
+
+  if (x->type == LVAL_SEXPR || x->type == LVAL_QEXPR) {
+    for (int i = 0; i < x->count; i++)
+      x->cell[i] = lopt_subst(x->cell[i], formals, args);
+  }
+
+  return x;
+}
+
+lval *lopt_expr(lopt *o, lval *x);
+
+// Evaluate body of if branch in place of the call
+lval *lopt_take_branch(lval *x, int i) {
+  lval *b = lval_take(x, i);
+  b->type = LVAL_SEXPR;
+
+  // Single literal evaluates to itself
+  if (b->count == 1 && lopt_literal(b->cell[0]))
+    return lval_take(b, 0);
+  return b;
+}
+
+lval *lopt_if(lopt *o, lval *x) {
+  for (int i = 2; i < 4; i++) {
+    if (x->cell[i]->type != LVAL_QEXPR)
+      continue;
+
+    // Optimise branch as the call it becomes, keeping it quoted
+    lval *b = x->cell[i];
+    b->type = LVAL_SEXPR;
+    b = lopt_expr(o, b);
+    if (b->type == LVAL_SEXPR) {
+      b->type = LVAL_QEXPR;
+    } else {
+      b = lval_push(lval_qexpr(), b);
+    }
+    x->cell[i] = b;
+  }
+
+  if (x->cell[1]->type == LVAL_NUM && x->cell[2]->type == LVAL_QEXPR &&
+      x->cell[3]->type == LVAL_QEXPR)
+    return lopt_take_branch(x, x->cell[1]->num ? 2 : 3);
+
+  return x;
+}
+
+lval *lopt_fold(lopt *o, lval *x, lval *f) {
+  // Only numbers of a machine word, and small powers, so folding
+  // stays cheap for code that may never run
+  for (int i = 1; i < x->count; i++) {
+    lval *c = x->cell[i];
+    if (c->type != LVAL_NUM && c->type != LVAL_DBL)
+      return x;
+    if (i > 1 && strcmp(f->sym, "^") == 0 &&
+        (c->type != LVAL_NUM || c->num > LOPT_FOLD_POW || c->num < 0))
+      return x;
+  }
+
+  lval *a = lval_copy(x);
+  lval_del(lval_pop(a, 0));
+
+  // Leave errors such as division by zero to run time, and lists
+  // to be built by each call rather than copied from the body
+  lval *r = f->builtin(o->root, a);
+  if (!lopt_literal(r)) {
+    lval_del(r);
+    return x;
+  }
+
+  lval_del(x);
+  return r;
+}
+
+// Put body of global lambda in place of the call. Atoms are put in
+// place of the formals when the body only calls builtins, otherwise
+// the arguments are bound by let as a call would bind them.
+lval *lopt_inline(lopt *o, lval *x, lval *g) {
+  lval *name = x->cell[0];
+  lval *body = g->src ? g->src : g->body;
+
+  if (o->depth >= LOPT_INLINE_DEPTH || g->memo || g->env->count ||
+      name->type != LVAL_SYM || g->formals->count != x->count - 1 ||
+      lopt_size(body) > LOPT_INLINE_SIZE || lopt_mentions(body, name->sym))
+    return x;
+
+  for (int i = 0; i < g->formals->count; i++) {
+    if (strcmp(g->formals->cell[i]->sym, "&") == 0)
+      return x;
+  }
+
+  for (int i = 0; i < body->count; i++) {
+    if (!lopt_inlinable(body->cell[i]))
+      return x;
+  }
+
+  lval *b = lval_copy(body);
+  b->type = LVAL_SEXPR;
+
+  int atoms = lopt_builtin_calls(o, b, g->formals);
+  for (int i = 1; i < x->count; i++) {
+    if (!lopt_literal(x->cell[i]) && x->cell[i]->type != LVAL_SYM)
+      atoms = 0;
+  }
+
+  // Let binds in order, an argument must not see earlier formals
+  if (!atoms) {
+    for (int i = 1; i < x->count; i++) {
+      for (int j = 0; j < g->formals->count; j++) {
+        if (lopt_mentions(x->cell[i], g->formals->cell[j]->sym)) {
+          lval_del(b);
+          return x;
+        }
+      }
+    }
+  }
+
+  if (atoms) {
+    b = lopt_subst(b, g->formals, x);
+    lval_del(x);
+
+    o->depth++;
+    b = lopt_expr(o, b);
+    o->depth--;
+    return b;
+  }
+
+  lopt inner = {o->root, lnames_copy(&o->shadow), o->depth + 1};
+  for (int i = 0; i < g->formals->count; i++)
+    lnames_add(&inner.shadow, g->formals->cell[i]->sym);
+  b = lopt_expr(&inner, b);
+  lnames_free(&inner.shadow);
+
+  if (b->type == LVAL_SEXPR) {
+    b->type = LVAL_QEXPR;
+  } else {
+    b = lval_push(lval_qexpr(), b);
+  }
+
+  lval *binds = lval_qexpr();
+  for (int i = 0; i < g->formals->count; i++) {
+    lval *p = lval_push(lval_qexpr(), lval_copy(g->formals->cell[i]));
+    binds = lval_push(binds, lval_push(p, lval_pop(x, 1)));
+  }
+  lval_del(x);
+
+  lval *r = lval_sexpr();
+  r = lval_push(r, lval_func("let", builtin_let, LEFF_CODE));
+  r = lval_push(r, binds);
+  return lval_push(r, b);
+}
+
+lval *lopt_expr(lopt *o, lval *x) {
+  if (x->type != LVAL_SEXPR)
+    return x;
+
+  for (int i = 0; i < x->count; i++)
+    x->cell[i] = lopt_expr(o, x->cell[i]);
+
+  // Single literal evaluates to itself
+  if (x->count == 1 && lopt_literal(x->cell[0]))
+    return lval_take(x, 0);
+
+  // Call without arguments returns the function unevaluated
+  if (x->count < 2)
+    return x;
+
+  lval *f = lopt_head(o, x->cell[0]);
+  if (!f)
+    return x;
+
+  if (f->builtin) {
+    if (strcmp(f->sym, "if") == 0 && x->count == 4)
+      return lopt_if(o, x);
+    if (lopt_foldable(f->sym))
+      return lopt_fold(o, x, f);
+    return x;
+  }
+
+  return lopt_inline(o, x, f);
+}
+
+void lopt_lambda(lenv *e, lval *f) {
+  while (e->par) {
+    e = e->par;
+  }
+
+  lopt o = {e, {0, 0, NULL}, 0};
+  for (int i = 0; i < f->formals->count; i++)
+    lnames_add(&o.shadow, f->formals->cell[i]->sym);
+  for (int i = 0; i < f->env->count; i++)
+    lnames_add(&o.shadow, f->env->syms[i]);
+
+  // Body is evaluated as a call itself, so the branches of an if at
+  // its top are code rather than data
+  lval *src = f->src ? f->src : f->body;
+  lval *b = lval_copy(src);
+  b->type = LVAL_SEXPR;
+  lopt_quoted(&o.shadow, b);
+  b = lopt_expr(&o, b);
+  lnames_free(&o.shadow);
+
+  if (b->type == LVAL_SEXPR) {
+    b->type = LVAL_QEXPR;
+  } else {
+    b = lval_push(lval_qexpr(), b);
+  }
+
+  // Keep the source for printing and optimising again
+  if (f->src) {
+    lval_del(f->body);
+  } else {
+    f->src = f->body;
+  }
+  f->body = b;
+
+  if (lval_eq(f->src, f->body)) {
+    lval_del(f->body);
+    f->body = f->src;
+    f->src = NULL;
+  }
+
+  f->epoch = lopt_epoch;
+}
+
+// Whether source of lambda mentions a name changed after it was
+// optimised, always when the log does not reach back that far
+int lopt_stale(lval *f) {
+  lopt_log *l = &lopt_changes;
+  if (f->epoch < l->base || f->epoch > lopt_epoch)
+    return 1;
+
+  lval *src = f->src ? f->src : f->body;
+  for (int i = l->count - 1; i >= 0 && l->epochs[i] > f->epoch; i--) {
+    if (lopt_mentions(src, l->names[i]))
+      return 1;
+  }
+  return 0;
+}
+
+int lopt_optimised(lval *v) {
+  return v->type == LVAL_FUNC && !v->builtin && !v->memo;
+}
+
+// Optimise again the global lambdas that are stale, and those that
+// mention one of them since they may have inlined it. The others are
+// still valid at the current epoch.
+void lopt_refresh(lenv *r) {
+  char *stale = calloc(r->count ? r->count : 1, 1);
+  lnames moved = {0, 0, NULL};
+
+  for (int i = 0; i < r->count; i++) {
+    lval *v = r->vals[i];
+    if (lopt_optimised(v) && v->epoch != lopt_epoch && lopt_stale(v)) {
+      stale[i] = 1;
+      lnames_add(&moved, r->syms[i]);
+    }
+  }
+
+  for (int grew = moved.count; grew;) {
+    grew = 0;
+    for (int i = 0; i < r->count; i++) {
+      lval *v = r->vals[i];
+      if (stale[i] || !lopt_optimised(v) || v->epoch == lopt_epoch ||
+          !lopt_mentions_any(v->src ? v->src : v->body, &moved))
+        continue;
+      stale[i] = 1;
+      grew = lnames_add(&moved, r->syms[i]);
+    }
+  }
+
+  // Lambdas outside the global environment see the ones optimised
+  // again through the log
+  for (int i = 0; i < r->count; i++) {
+    lval *v = r->vals[i];
+    if (!lopt_optimised(v) || v->epoch == lopt_epoch)
+      continue;
+    if (stale[i]) {
+      lopt_lambda(r, v);
+      lopt_log_add(r->syms[i]);
+    } else {
+      v->epoch = lopt_epoch;
+    }
+  }
+
+  lnames_free(&moved);
+  free(stale);
+}
+
+void lopt_check(lenv *e, lval *f) {
+  if (lopt_checked != lopt_epoch) {
+    lenv *r = e;
+    while (r->par) {
+      r = r->par;
+    }
+
+    lopt_checked = lopt_epoch;
+    lopt_refresh(r);
+  }
+
+  if (f->epoch == lopt_epoch)
+    return;
+
+  if (lopt_stale(f)) {
+    lopt_lambda(e, f);
+  } else {
+    f->epoch = lopt_epoch;
+  }
+}
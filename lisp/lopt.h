@@ -0,0 +1,64 @@
+#include "lval.h"
+
+#ifndef lopt_h
+#define lopt_h
+
+// Set of names
+typedef struct
+{
+    int count;
+    int cap;
+    char **names;
+} lnames;
+
+int lnames_has(lnames *n, char *s);
+int lnames_add(lnames *n, char *s);
+lnames lnames_copy(lnames *n);
+void lnames_free(lnames *n);
+
+// Collect symbols quoted as data anywhere in code, the branches of if
+// are code
+void lopt_quoted(lnames *n, lval *x);
+
+// Same for the cells of a call, such as a body or a branch of if
+void lopt_quoted_call(lnames *n, lval *x);
+
+// Advanced whenever a global the optimiser may have relied on is
+// redefined or a name is bound locally for the first time
+extern __thread long lopt_epoch;
+
+// Names whose global meaning changed, with the epoch each moved it to
+// or was optimised again at. Only the latest are kept, every change
+// after base is there.
+#define LOPT_LOG 64
+
+typedef struct
+{
+    long base;
+    int count;
+    long epochs[LOPT_LOG];
+    char *names[LOPT_LOG];
+} lopt_log;
+
+void lopt_log_free(lopt_log *l);
+
+// Epoch the global lambdas were last checked at, the names ever bound
+// locally and the latest changes. Like the epoch they belong to the
+// context running.
+extern __thread long lopt_checked;
+extern __thread lnames lopt_locals;
+extern __thread lopt_log lopt_changes;
+
+// Optimise body of lambda against global environment of e
+void lopt_lambda(lenv *e, lval *f);
+
+// Optimise again lambda and the lambdas of global environment that
+// mention a name which changed since they were optimised
+void lopt_check(lenv *e, lval *f);
+
+// Report binding of name into local or global environment
+void lopt_local(char *name);
+int lopt_is_local(char *name);
+void lopt_global(char *name, lval *old, lval *v);
+
+#endif
@@ -0,0 +1,744 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "lchan.h"
+#include "lclo.h"
+#include "lctx.h"
+#include "ldict.h"
+#include "leff.h"
+#include "ljit.h"
+#include "lmemo.h"
+#include "lopt.h"
+#include "lpar.h"
+#include "lpool.h"
+#include "lrcu.h"
+#include "lseq.h"
+#include "lspec.h"
+#include "lval.h"
+
+/**
+ * ---------------------------------------------------------------
+ * Data parallel map and reduce. Values share buffers, tables and
+ * caches through counts that are not atomic, so threads must never
+ * touch the same ones. The calling thread gives each other thread
+ * taking part a lane holding its own deep copy of the function and
+ * of the global lambdas, and its own interpreter state. Builtins and
+ * channels never change, the lane copies them itself from the global
+ * environment the caller publishes for such readers. Elements
+ * made of numbers, symbols and lists share nothing and go to lanes
+ * as they are, others are copied first. Lanes claim chunks of the
+ * list in order until none is left, what a lane made belongs to the
+ * caller once every lane finished.
+ * ---------------------------------------------------------------
+ */
+
+// Elements below which a map stays on the calling thread, chunks a
+// reduce splits its list into, and chunks per lane of a map
+#define LPAR_MIN 16
+#define LPAR_CHUNKS 64
+#define LPAR_SPLIT 8
+
+typedef struct
+{
+    lval **xs;
+    long n;
+    long chunk;
+    long nchunks;
+    int reduce;
+
+    // Next chunk to claim, and first element that gave an error or n
+    long next;
+    long err;
+
+    // Result of each chunk of a reduce
+    lval **part;
+} lpar_job;
+
+// Function and environment a lane runs with, and unless it is the
+// caller's lane its own state
+typedef struct
+{
+    lpar_job *job;
+    lenv *env;
+    lval *f;
+    int own;
+    lstate state;
+
+    // Global environment of the caller to share when not yet done
+    lenv *root;
+    lpar_lent lent;
+} lpar_lane;
+
+/** --- Copies sharing nothing --- */
+
+// Channels of the task being set up, NULL when copies go to threads
+// that are never known to be done with them
+__thread lpar_lent *lpar_lending = NULL;
+
+void lpar_lend(lchan *c) {
+  lchan_lend(c);
+  lpar_lent *l = lpar_lending;
+  if (!l)
+    return;
+
+  lchan_retain(c);
+  l->chans = realloc(l->chans, sizeof(lchan *) * (l->count + 1));
+  l->chans[l->count++] = c;
+}
+
+int lpar_lent_has(lpar_lent *l, lchan *c) {
+  for (int i = 0; i < l->count; i++) {
+    if (l->chans[i] == c)
+      return 1;
+  }
+  return 0;
+}
+
+void lpar_give_back(lpar_lent *l) {
+  for (int i = 0; i < l->count; i++) {
+    lchan_return(l->chans[i]);
+    lchan_release(l->chans[i]);
+  }
+  free(l->chans);
+  *l = (lpar_lent){0, NULL};
+}
+
+lval *lpar_clone(lval *v);
+
+// Only holds values owned by itself
+int lpar_plain(lval *v) {
+  switch (v->type) {
+  case LVAL_STR:
+    return !v->buf;
+  case LVAL_FUNC:
+  case LVAL_DICT:
+  case LVAL_SEQ:
+  case LVAL_CELL:
+  case LVAL_FUTURE:
+  case LVAL_CHAN:
+    return 0;
+  case LVAL_SEXPR:
+  case LVAL_QEXPR:
+    for (int i = 0; i < v->count; i++) {
+      if (!lpar_plain(v->cell[i]))
+        return 0;
+    }
+    return 1;
+  default:
+    return 1;
+  }
+}
+
+lenv *lpar_clone_env(lenv *e) {
+  lenv *n = lenv_new();
+  n->syms = malloc(sizeof(char *) * (e->count ? e->count : 1));
+  n->vals = malloc(sizeof(lval *) * (e->count ? e->count : 1));
+
+  for (int i = 0; i < e->count; i++) {
+    lval *v = lpar_clone(e->vals[i]);
+    if (!v) {
+      lenv_del(n);
+      return NULL;
+    }
+    n->syms[n->count] = malloc(strlen(e->syms[i]) + 1);
+    strcpy(n->syms[n->count], e->syms[i]);
+    n->vals[n->count++] = v;
+  }
+  return n;
+}
+
+// Lambda with its own copy of everything, optimised and compiled
+// again from its source when first called
+lval *lpar_clone_lambda(lval *f) {
+  lenv *env = lpar_clone_env(f->env);
+  lval *formals = lpar_clone(f->formals);
+  lval *body = lpar_clone(f->body);
+  lval *src = f->src ? lpar_clone(f->src) : NULL;
+
+  if (!env || !formals || !body || (f->src && !src)) {
+    if (env)
+      lenv_del(env);
+    if (formals)
+      lval_del(formals);
+    if (body)
+      lval_del(body);
+    if (src)
+      lval_del(src);
+    return NULL;
+  }
+
+  lval *v = malloc(sizeof(lval));
+  v->type = LVAL_FUNC;
+  v->builtin = NULL;
+  v->memo = NULL;
+  v->env = env;
+  v->formals = formals;
+  v->body = body;
+  v->src = src;
+  v->epoch = -1;
+  v->pure_epoch = -1;
+  v->spec = lspec_new();
+  return v;
+}
+
+lval *lpar_clone_dict(lval *d) {
+  ltable *t = ldict_table(d->dict);
+  lval *v = lval_dict();
+
+  for (int i = 0; i < t->cap; i++) {
+    if (!t->slots[i].key)
+      continue;
+
+    lval *k = lpar_clone(t->slots[i].key);
+    lval *x = lpar_clone(t->slots[i].val);
+    if (!k || !x) {
+      if (k)
+        lval_del(k);
+      if (x)
+        lval_del(x);
+      lval_del(v);
+      return NULL;
+    }
+    v->dict = ldict_put(v->dict, k, x);
+  }
+  return v;
+}
+
+// Deep copy sharing nothing with v but channels, NULL when v holds a
+// sequence, a reactive cell or a future
+lval *lpar_clone(lval *v) {
+  switch (v->type) {
+  case LVAL_STR:
+    return lval_str(lval_str_ptr(v), v->slen);
+
+  case LVAL_DICT:
+    return lpar_clone_dict(v);
+
+  case LVAL_SEQ:
+  case LVAL_CELL:
+  case LVAL_FUTURE:
+    return NULL;
+
+  case LVAL_FUNC:
+    if (v->builtin)
+      return lval_copy(v);
+    if (v->memo) {
+      lval *f = lpar_clone(v->memo->func);
+      if (!f)
+        return NULL;
+      lval *m = malloc(sizeof(lval));
+      m->type = LVAL_FUNC;
+      m->builtin = NULL;
+      m->memo = lmemo_new(f, v->memo->cap, v->memo->policy);
+      return m;
+    }
+    return lpar_clone_lambda(v);
+
+  case LVAL_SEXPR:
+  case LVAL_QEXPR: {
+    lval *c = v->type == LVAL_SEXPR ? lval_sexpr() : lval_qexpr();
+    for (int i = 0; i < v->count; i++) {
+      lval *x = lpar_clone(v->cell[i]);
+      if (!x) {
+        lval_del(c);
+        return NULL;
+      }
+      lval_push(c, x);
+    }
+    return c;
+  }
+
+  case LVAL_CHAN:
+    lpar_lend(v->chan);
+    return lval_copy(v);
+
+  default:
+    return lval_copy(v);
+  }
+}
+
+lval *lpar_move(lval *v) {
+  if (lpar_plain(v))
+    return v;
+
+  lval *c = lpar_clone(v);
+  lval_del(v);
+  return c;
+}
+
+// Copies of the global lambdas of the environment of e, which only
+// the thread of e may read since it changes them as it runs them.
+// Global channels are lent to the task, which shares them itself.
+lenv *lpar_globals(lenv *e) {
+  while (e->par) {
+    e = e->par;
+  }
+
+  lenv *g = lenv_new();
+  g->syms = malloc(sizeof(char *) * (e->count ? e->count : 1));
+  g->vals = malloc(sizeof(lval *) * (e->count ? e->count : 1));
+
+  for (int i = 0; i < e->count; i++) {
+    if (e->vals[i]->type == LVAL_CHAN)
+      lpar_lend(e->vals[i]->chan);
+    if (e->vals[i]->type != LVAL_FUNC || e->vals[i]->builtin)
+      continue;
+
+    lval *v = lpar_clone(e->vals[i]);
+    if (!v) {
+      lenv_del(g);
+      return NULL;
+    }
+    g->syms[g->count] = malloc(strlen(e->syms[i]) + 1);
+    strcpy(g->syms[g->count], e->syms[i]);
+    g->vals[g->count++] = v;
+  }
+
+  g->global = 1;
+  return g;
+}
+
+// Add to g the builtins and the channels lent of global environment
+// root, the values its thread never changes, reading it while that
+// thread may define into it. Runs on the task's own thread.
+void lpar_share(lenv *g, lenv *root, lpar_lent *lent) {
+  char **syms;
+  lval **vals;
+  int n = lenv_read(root, &syms, &vals);
+
+  g->syms = realloc(g->syms, sizeof(char *) * (g->count + n + 1));
+  g->vals = realloc(g->vals, sizeof(lval *) * (g->count + n + 1));
+
+  for (int i = 0; i < n; i++) {
+    lval *v = vals[i];
+    if (v->type == LVAL_CHAN ? !lpar_lent_has(lent, v->chan)
+                             : v->type != LVAL_FUNC || !v->builtin)
+      continue;
+
+    g->syms[g->count] = malloc(strlen(syms[i]) + 1);
+    strcpy(g->syms[g->count], syms[i]);
+    g->vals[g->count++] = lval_copy(v);
+  }
+}
+
+// Forget what a lane learnt about the lambdas of value it made, their
+// code may call lambdas of the lane that are gone
+void lpar_adopt(lval *v) {
+  switch (v->type) {
+  case LVAL_FUNC:
+    if (v->memo) {
+      lpar_adopt(v->memo->func);
+    } else if (!v->builtin) {
+      v->epoch = v->src ? -1 : v->epoch;
+      v->pure_epoch = -1;
+      lspec_release(v->spec);
+      v->spec = lspec_new();
+      for (int i = 0; i < v->env->count; i++)
+        lpar_adopt(v->env->vals[i]);
+    }
+    break;
+
+  case LVAL_SEXPR:
+  case LVAL_QEXPR:
+    for (int i = 0; i < v->count; i++)
+      lpar_adopt(v->cell[i]);
+    break;
+
+  case LVAL_DICT: {
+    ltable *t = ldict_table(v->dict);
+    for (int i = 0; i < t->cap; i++) {
+      if (t->slots[i].key)
+        lpar_adopt(t->slots[i].val);
+    }
+    break;
+  }
+
+  case LVAL_SEQ:
+    for (lseq *s = v->seq; s; s = s->src) {
+      if (s->val)
+        lpar_adopt(s->val);
+    }
+    break;
+  }
+}
+
+/** --- Lanes --- */
+
+// Fresh state for running on another thread, using the same engines
+// and output as the calling thread
+void lpar_state(lstate *s) {
+  *s = (lstate){.opt_locals = lnames_copy(&lopt_locals),
+                .clo_engine = lclo_engine,
+                .jit = ljit_enabled,
+                .out = lval_stream(),
+                .exit = lval_exit};
+}
+
+void lpar_error(lpar_job *j, long i) {
+  long err = __atomic_load_n(&j->err, __ATOMIC_RELAXED);
+  while (i < err && !__atomic_compare_exchange_n(&j->err, &err, i, 0,
+                                                  __ATOMIC_RELAXED,
+                                                  __ATOMIC_RELAXED))
+    ;
+}
+
+int lpar_stop(lpar_job *j, long i) {
+  return __atomic_load_n(&j->err, __ATOMIC_RELAXED) < i;
+}
+
+void lpar_map_chunk(lenv *e, lval *f, lpar_job *j, long lo, long hi) {
+  for (long i = lo; i < hi && !lpar_stop(j, i); i++) {
+    j->xs[i] = lval_apply(e, f, lval_args(j->xs[i], NULL));
+    if (j->xs[i]->type == LVAL_ERR) {
+      lpar_error(j, i);
+      return;
+    }
+  }
+}
+
+void lpar_reduce_chunk(lenv *e, lval *f, lpar_job *j, long c, long lo,
+                       long hi) {
+  lval *acc = j->xs[lo];
+  j->xs[lo] = NULL;
+
+  for (long i = lo + 1; i < hi && !lpar_stop(j, i); i++) {
+    acc = lval_apply(e, f, lval_args(acc, j->xs[i]));
+    j->xs[i] = NULL;
+    if (acc->type == LVAL_ERR) {
+      lpar_error(j, i);
+      break;
+    }
+  }
+  j->part[c] = acc;
+}
+
+void lpar_run(void *arg) {
+  lpar_lane *l = arg;
+  lpar_job *j = l->job;
+
+  // Other lanes load their own state, the caller's keeps running on its
+  lstate saved;
+  if (l->own) {
+    lstate_save(&saved);
+    lstate_load(&l->state);
+  }
+  if (l->root)
+    lpar_share(l->env, l->root, &l->lent);
+
+  while (1) {
+    long c = __atomic_fetch_add(&j->next, 1, __ATOMIC_RELAXED);
+    long lo = c * j->chunk;
+    if (c >= j->nchunks || lpar_stop(j, lo))
+      break;
+
+    long hi = lo + j->chunk < j->n ? lo + j->chunk : j->n;
+    if (j->reduce)
+      lpar_reduce_chunk(l->env, l->f, j, c, lo, hi);
+    else
+      lpar_map_chunk(l->env, l->f, j, lo, hi);
+  }
+
+  if (l->own) {
+    lstate_save(&l->state);
+    lstate_load(&saved);
+  }
+}
+
+// Run the job on the caller and as many lanes as the pool has workers
+// and the job chunks, or only on the caller when f is not isolated
+void lpar_job_run(lenv *e, lval *f, lpar_job *j, int parallel) {
+  int n = parallel ? lpool_workers() : 0;
+  if (n > j->nchunks - 1)
+    n = j->nchunks - 1;
+
+  lpar_lane *lanes = malloc(sizeof(lpar_lane) * (n + 1));
+  lanes[0].job = j;
+  lanes[0].env = e;
+  lanes[0].f = f;
+  lanes[0].own = 0;
+  lanes[0].root = NULL;
+
+  lenv *root = e;
+  while (root->par) {
+    root = root->par;
+  }
+
+  // Lanes share what they read of the caller's global environment
+  // each on its own thread, the caller keeps one reader for them all
+  lrcu_reader *r = NULL;
+  int ready = 1;
+  for (int i = 1; i <= n; i++) {
+    lpar_lane *l = &lanes[i];
+    l->job = j;
+    l->own = 1;
+    l->root = NULL;
+    l->lent = (lpar_lent){0, NULL};
+    lpar_lending = &l->lent;
+    l->env = lpar_globals(e);
+    l->f = l->env ? lpar_clone(f) : NULL;
+    lpar_lending = NULL;
+    if (!l->f) {
+      if (l->env)
+        lenv_del(l->env);
+      lpar_give_back(&l->lent);
+      break;
+    }
+
+    if (i == 1)
+      r = lrcu_enter(root);
+    if (r)
+      l->root = root;
+    else
+      lpar_share(l->env, root, &l->lent);
+
+    lpar_state(&l->state);
+    ready++;
+  }
+
+  lpool_group g = {0};
+  for (int i = 1; i < ready; i++)
+    lpool_spawn(&g, lpar_run, &lanes[i]);
+  lpar_run(&lanes[0]);
+  lpool_wait(&g);
+  if (r)
+    lrcu_leave(r);
+
+  for (int i = 1; i < ready; i++) {
+    lenv_del(lanes[i].env);
+    lval_del(lanes[i].f);
+    lnames_free(&lanes[i].state.opt_locals);
+    lopt_log_free(&lanes[i].state.opt_changes);
+    lpar_give_back(&lanes[i].lent);
+  }
+  free(lanes);
+}
+
+/** --- Map and reduce --- */
+
+// Elements a lane can own, copying those that share something
+int lpar_own(lval *l) {
+  for (int i = 0; i < l->count; i++) {
+    if (lpar_plain(l->cell[i]))
+      continue;
+
+    lval *x = lpar_clone(l->cell[i]);
+    if (!x)
+      return 0;
+    lval_del(l->cell[i]);
+    l->cell[i] = x;
+  }
+  return 1;
+}
+
+int lpar_map(lenv *e, lval *f, lval *l, lval **err) {
+  if (l->count < LPAR_MIN || !lpool_workers() || !leff_isolated(e, f) ||
+      !lpar_own(l))
+    return 0;
+
+  long lanes = lpool_workers() + 1;
+  long chunk = l->count / (lanes * LPAR_SPLIT);
+  chunk = chunk ? chunk : 1;
+
+  lpar_job j = {l->cell, l->count, chunk, (l->count + chunk - 1) / chunk,
+                0, 0, l->count, NULL};
+  lpar_job_run(e, f, &j, 1);
+
+  for (int i = 0; i < l->count; i++)
+    lpar_adopt(l->cell[i]);
+
+  *err = NULL;
+  if (j.err < l->count) {
+    *err = l->cell[j.err];
+    l->cell[j.err] = lval_num(0);
+  }
+  return 1;
+}
+
+lval *lpar_reduce(lenv *e, lval *f, lval *l) {
+  long n = l->count;
+  if (n == 0)
+    return NULL;
+
+  long chunk = (n + LPAR_CHUNKS - 1) / LPAR_CHUNKS;
+  long nchunks = (n + chunk - 1) / chunk;
+  lval **part = calloc(nchunks, sizeof(lval *));
+
+  int parallel = n >= LPAR_MIN && lpool_workers() && leff_isolated(e, f) &&
+                 lpar_own(l);
+  lpar_job j = {l->cell, n, chunk, nchunks, 1, 0, n, part};
+  lpar_job_run(e, f, &j, parallel);
+
+  // Elements left after an error
+  for (long i = 0; i < n; i++) {
+    if (l->cell[i])
+      lval_del(l->cell[i]);
+  }
+  l->count = 0;
+
+  // Chunks before the one of the first error all finished
+  lval *r = NULL;
+  for (long c = 0; c < nchunks; c++) {
+    if (!part[c])
+      continue;
+    lpar_adopt(part[c]);
+    if (!r && part[c]->type == LVAL_ERR)
+      r = part[c];
+  }
+
+  // Combine neighbours until one is left, always in the same tree
+  for (long w = nchunks; w > 1 && !r; w = (w + 1) / 2) {
+    for (long c = 0; c < w && !r; c += 2) {
+      lval *x = part[c];
+      part[c] = NULL;
+      if (c + 1 < w) {
+        x = lval_apply(e, f, lval_args(x, part[c + 1]));
+        part[c + 1] = NULL;
+      }
+      part[c / 2] = x;
+      if (x->type == LVAL_ERR)
+        r = x;
+    }
+  }
+
+  if (!r)
+    r = part[0];
+  for (long c = 0; c < nchunks; c++) {
+    if (part[c] && part[c] != r)
+      lval_del(part[c]);
+  }
+  free(part);
+  return r;
+}
+
+/** --- Futures --- */
+
+// Bind the names of expr that frames below the global environment of
+// e hold to copies of their values, 0 when one cannot be copied
+int lpar_capture(lenv *e, lval *x, lval *formals, lval *args) {
+  if (x->type == LVAL_SEXPR || x->type == LVAL_QEXPR) {
+    for (int i = 0; i < x->count; i++) {
+      if (!lpar_capture(e, x->cell[i], formals, args))
+        return 0;
+    }
+    return 1;
+  }
+
+  if (x->type != LVAL_SYM)
+    return 1;
+  for (int i = 0; i < formals->count; i++) {
+    if (strcmp(formals->cell[i]->sym, x->sym) == 0)
+      return 1;
+  }
+
+  for (; e->par; e = e->par) {
+    for (int i = 0; i < e->count; i++) {
+      if (strcmp(e->syms[i], x->sym) != 0)
+        continue;
+
+      lval *v = lpar_clone(e->vals[i]);
+      if (!v)
+        return 0;
+      lval_push(formals, lval_sym(x->sym));
+      lval_push(args, v);
+      return 1;
+    }
+  }
+  return 1;
+}
+
+void lpar_future_run(void *arg) {
+  lfuture *fu = arg;
+
+  lstate saved;
+  lstate_save(&saved);
+  lstate_load(&fu->state);
+
+  if (fu->reader) {
+    lpar_share(fu->env, fu->root, &fu->lent);
+    lrcu_leave(fu->reader);
+  }
+
+  lval *r = lval_apply(fu->env, fu->f, fu->args);
+  lpar_adopt(r);
+  lval_del(fu->f);
+  lenv_del(fu->env);
+  lpar_give_back(&fu->lent);
+
+  lstate_save(&fu->state);
+  lstate_load(&saved);
+  lnames_free(&fu->state.opt_locals);
+  lopt_log_free(&fu->state.opt_changes);
+  fu->val = r;
+}
+
+lval *lpar_future(lenv *e, lval *expr) {
+  lfuture *fu = malloc(sizeof(lfuture));
+  fu->ref = 1;
+  fu->group = (lpool_group){0};
+  fu->val = NULL;
+
+  fu->env = NULL;
+  fu->lent = (lpar_lent){0, NULL};
+
+  lval *v = malloc(sizeof(lval));
+  v->type = LVAL_FUTURE;
+  v->fut = fu;
+
+  // The expression becomes a lambda over the locals it reads, which
+  // runs on the pool when it is isolated
+  lpar_lending = &fu->lent;
+  lval *formals = lval_qexpr();
+  lval *args = lval_sexpr();
+  lval *body = expr->count ? lpar_clone(expr) : NULL;
+  lval *f = NULL;
+
+  if (body && lpool_workers() && lpar_capture(e, expr, formals, args)) {
+    f = lval_lambda(formals, body);
+    formals = body = NULL;
+    fu->env = leff_isolated(e, f) ? lpar_globals(e) : NULL;
+    f->pure_epoch = -1;
+  }
+  lpar_lending = NULL;
+
+  if (f && fu->env) {
+    fu->f = f;
+    fu->args = args;
+    fu->root = e;
+    while (fu->root->par) {
+      fu->root = fu->root->par;
+    }
+    fu->reader = lrcu_enter(fu->root);
+    if (!fu->reader)
+      lpar_share(fu->env, fu->root, &fu->lent);
+    lpar_state(&fu->state);
+    lval_del(expr);
+    lpool_spawn(&fu->group, lpar_future_run, fu);
+    return v;
+  }
+
+  // Evaluated here and now otherwise
+  lpar_give_back(&fu->lent);
+  if (f)
+    lval_del(f);
+  if (formals)
+    lval_del(formals);
+  if (body)
+    lval_del(body);
+  lval_del(args);
+  fu->val = builtin_eval(e, lval_args(expr, NULL));
+  return v;
+}
+
+lval *lpar_touch(lfuture *fu) {
+  lpool_wait(&fu->group);
+  return lval_copy(fu->val);
+}
+
+void lpar_future_release(lfuture *fu) {
+  if (--fu->ref)
+    return;
+
+  lpool_wait(&fu->group);
+  lval_del(fu->val);
+  free(fu);
+}
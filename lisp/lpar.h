@@ -0,0 +1,67 @@
+#include "lctx.h"
+#include "lpool.h"
+#include "lrcu.h"
+#include "lval.h"
+
+#ifndef lpar_h
+#define lpar_h
+
+// Value that can go to another thread, v itself when it shares
+// nothing, otherwise a copy sharing only channels. Takes ownership of
+// v, NULL when it holds something that cannot be copied.
+lval *lpar_move(lval *v);
+
+// Apply f to every element of list l on the threads of the pool,
+// writing the results in place. Returns 0, leaving the elements
+// equal to what they were, when f is not isolated, l is short or the
+// pool has no workers. Otherwise err is the first error in order
+// of the list, or NULL when l holds every result.
+int lpar_map(lenv *e, lval *f, lval *l, lval **err);
+
+// Combine the elements of list l with f, left to right inside chunks
+// and then the chunk results pairwise, the chunks only depending on
+// the length of l. Runs in parallel when f is isolated. Takes the
+// elements and returns the result, NULL for an empty list.
+lval *lpar_reduce(lenv *e, lval *f, lval *l);
+
+// Channels lent to a task, given back once it is done with them
+typedef struct
+{
+    int count;
+    lchan **chans;
+} lpar_lent;
+
+// Expression evaluated by a task of the pool, done once its group has
+// nothing pending. Until then the task owns the lambda it runs, the
+// arguments, the copy of the global functions and the channels lent,
+// and until it copied the builtins and channels of root it is a
+// reader of root.
+struct lfuture
+{
+    int ref;
+    lpool_group group;
+    lval *val;
+
+    lval *f;
+    lval *args;
+    lenv *env;
+    lstate state;
+
+    lenv *root;
+    lrcu_reader *reader;
+    lpar_lent lent;
+};
+
+// Future of q-expr expr, taking ownership of it. When expr is isolated
+// the locals it reads are copied and it runs on the pool, otherwise it
+// is evaluated at once.
+lval *lpar_future(lenv *e, lval *expr);
+
+// Copy of the value of the future, running other tasks until it is
+// done
+lval *lpar_touch(lfuture *fu);
+
+// Deleting the last copy waits for the task
+void lpar_future_release(lfuture *fu);
+
+#endif
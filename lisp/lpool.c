@@ -0,0 +1,270 @@
+#include <pthread.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "lpool.h"
+
+/**
+ * ---------------------------------------------------------------
+ * Work-stealing thread pool. Every thread spawning tasks owns a
+ * Chase-Lev deque, it pushes and takes at the bottom while other
+ * threads steal at the top, so the owner works depth first on its
+ * own tasks and thieves take the oldest and largest ones. Workers
+ * with nothing to steal sleep until a task is spawned, a thread
+ * waiting for a group keeps running tasks instead.
+ * ---------------------------------------------------------------
+ */
+
+// Deques of workers and other spawning threads, and tasks of one deque
+#define LPOOL_MAX 128
+#define LPOOL_CAP 4096
+
+// Workers at most, and rounds of stealing before a worker sleeps
+#define LPOOL_WORKERS 64
+#define LPOOL_SPIN 64
+
+typedef struct
+{
+    lpool_fn fn;
+    void *arg;
+    lpool_group *group;
+} lpool_task;
+
+// Top and bottom only grow, slot of index i is i modulo the capacity
+typedef struct
+{
+    long top;
+    char pad[56];
+    long bottom;
+    int used;
+    lpool_task *tasks[LPOOL_CAP];
+} lpool_deque;
+
+lpool_deque *lpool_deques[LPOOL_MAX];
+int lpool_ndeques = 0;
+int lpool_nworkers = 0;
+
+pthread_once_t lpool_once = PTHREAD_ONCE_INIT;
+pthread_key_t lpool_key;
+pthread_mutex_t lpool_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t lpool_wake = PTHREAD_COND_INITIALIZER;
+
+// Moves on every spawn, and workers asleep waiting for it to move
+long lpool_signal = 0;
+int lpool_sleeping = 0;
+
+__thread lpool_deque *lpool_self = NULL;
+
+/** --- Deque --- */
+
+int lpool_push(lpool_deque *d, lpool_task *t) {
+  long b = __atomic_load_n(&d->bottom, __ATOMIC_RELAXED);
+  long top = __atomic_load_n(&d->top, __ATOMIC_ACQUIRE);
+  if (b - top >= LPOOL_CAP)
+    return 0;
+
+  __atomic_store_n(&d->tasks[b % LPOOL_CAP], t, __ATOMIC_RELAXED);
+  __atomic_store_n(&d->bottom, b + 1, __ATOMIC_RELEASE);
+  return 1;
+}
+
+// Newest task of own deque, racing thieves for the last one
+lpool_task *lpool_take(lpool_deque *d) {
+  long b = __atomic_load_n(&d->bottom, __ATOMIC_RELAXED) - 1;
+  __atomic_store_n(&d->bottom, b, __ATOMIC_SEQ_CST);
+  long top = __atomic_load_n(&d->top, __ATOMIC_SEQ_CST);
+
+  if (top > b) {
+    __atomic_store_n(&d->bottom, b + 1, __ATOMIC_RELAXED);
+    return NULL;
+  }
+
+  lpool_task *t = __atomic_load_n(&d->tasks[b % LPOOL_CAP], __ATOMIC_RELAXED);
+  if (top == b) {
+    if (!__atomic_compare_exchange_n(&d->top, &top, top + 1, 0,
+                                     __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+      t = NULL;
+    __atomic_store_n(&d->bottom, b + 1, __ATOMIC_RELAXED);
+  }
+  return t;
+}
+
+// Oldest task of another deque, NULL when empty or lost to a thief
+lpool_task *lpool_steal(lpool_deque *d) {
+  long top = __atomic_load_n(&d->top, __ATOMIC_SEQ_CST);
+  long b = __atomic_load_n(&d->bottom, __ATOMIC_SEQ_CST);
+  if (top >= b)
+    return NULL;
+
+  lpool_task *t = __atomic_load_n(&d->tasks[top % LPOOL_CAP], __ATOMIC_RELAXED);
+  if (!__atomic_compare_exchange_n(&d->top, &top, top + 1, 0,
+                                   __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+    return NULL;
+  return t;
+}
+
+/** --- Threads --- */
+
+// Deque for the calling thread, reusing one a finished thread left
+lpool_deque *lpool_claim(void) {
+  pthread_mutex_lock(&lpool_lock);
+
+  lpool_deque *d = NULL;
+  for (int i = 0; i < lpool_ndeques && !d; i++) {
+    if (!__atomic_load_n(&lpool_deques[i]->used, __ATOMIC_ACQUIRE))
+      d = lpool_deques[i];
+  }
+
+  if (!d && lpool_ndeques < LPOOL_MAX) {
+    d = calloc(1, sizeof(lpool_deque));
+    __atomic_store_n(&lpool_deques[lpool_ndeques], d, __ATOMIC_RELEASE);
+    __atomic_store_n(&lpool_ndeques, lpool_ndeques + 1, __ATOMIC_RELEASE);
+  }
+
+  if (d)
+    __atomic_store_n(&d->used, 1, __ATOMIC_RELEASE);
+  pthread_mutex_unlock(&lpool_lock);
+
+  lpool_self = d;
+  if (d)
+    pthread_setspecific(lpool_key, d);
+  return d;
+}
+
+void lpool_release(void *d) {
+  __atomic_store_n(&((lpool_deque *)d)->used, 0, __ATOMIC_RELEASE);
+}
+
+void lpool_run(lpool_task *t) {
+  lpool_group *g = t->group;
+  t->fn(t->arg);
+  free(t);
+  __atomic_sub_fetch(&g->pending, 1, __ATOMIC_RELEASE);
+}
+
+// Task of own deque or else one stolen, starting after own deque
+lpool_task *lpool_find(void) {
+  lpool_task *t = lpool_self ? lpool_take(lpool_self) : NULL;
+  if (t)
+    return t;
+
+  int n = __atomic_load_n(&lpool_ndeques, __ATOMIC_ACQUIRE);
+  int start = 0;
+  for (int i = 0; i < n; i++) {
+    if (lpool_deques[i] == lpool_self)
+      start = i + 1;
+  }
+
+  for (int i = 0; i < n; i++) {
+    lpool_deque *d = __atomic_load_n(&lpool_deques[(start + i) % n],
+                                     __ATOMIC_ACQUIRE);
+    if (d != lpool_self && (t = lpool_steal(d)))
+      return t;
+  }
+  return NULL;
+}
+
+void *lpool_worker(void *arg) {
+  (void)arg;
+  lpool_claim();
+
+  while (1) {
+    lpool_task *t = NULL;
+    for (int i = 0; i < LPOOL_SPIN && !t; i++) {
+      t = lpool_find();
+      if (!t)
+        sched_yield();
+    }
+
+    if (t) {
+      lpool_run(t);
+      continue;
+    }
+
+    // Sleep unless a task was spawned since last looking
+    long seen = __atomic_load_n(&lpool_signal, __ATOMIC_SEQ_CST);
+    if ((t = lpool_find())) {
+      lpool_run(t);
+      continue;
+    }
+
+    pthread_mutex_lock(&lpool_lock);
+    __atomic_add_fetch(&lpool_sleeping, 1, __ATOMIC_SEQ_CST);
+    while (__atomic_load_n(&lpool_signal, __ATOMIC_SEQ_CST) == seen)
+      pthread_cond_wait(&lpool_wake, &lpool_lock);
+    __atomic_sub_fetch(&lpool_sleeping, 1, __ATOMIC_SEQ_CST);
+    pthread_mutex_unlock(&lpool_lock);
+  }
+  return NULL;
+}
+
+void lpool_start(void) {
+  pthread_key_create(&lpool_key, lpool_release);
+
+  char *s = getenv("LPOOL_THREADS");
+  long n = s ? atol(s) : sysconf(_SC_NPROCESSORS_ONLN) - 1;
+  if (n < 0)
+    n = 0;
+  if (n > LPOOL_WORKERS)
+    n = LPOOL_WORKERS;
+
+  pthread_attr_t attr;
+  pthread_attr_init(&attr);
+  pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+  // Evaluation recurses deeply, give workers the stack of a process
+  pthread_attr_setstacksize(&attr, 8 << 20);
+
+  for (long i = 0; i < n; i++) {
+    pthread_t t;
+    if (pthread_create(&t, &attr, lpool_worker, NULL) == 0)
+      lpool_nworkers++;
+  }
+  pthread_attr_destroy(&attr);
+}
+
+int lpool_workers(void) {
+  pthread_once(&lpool_once, lpool_start);
+  return lpool_nworkers;
+}
+
+/** --- Groups --- */
+
+void lpool_spawn(lpool_group *g, lpool_fn fn, void *arg) {
+  lpool_workers();
+  if (!lpool_self)
+    lpool_claim();
+
+  lpool_task *t = malloc(sizeof(lpool_task));
+  t->fn = fn;
+  t->arg = arg;
+  t->group = g;
+
+  __atomic_add_fetch(&g->pending, 1, __ATOMIC_RELAXED);
+  if (!lpool_self || !lpool_push(lpool_self, t)) {
+    lpool_run(t);
+    return;
+  }
+
+  __atomic_add_fetch(&lpool_signal, 1, __ATOMIC_SEQ_CST);
+  if (__atomic_load_n(&lpool_sleeping, __ATOMIC_SEQ_CST)) {
+    pthread_mutex_lock(&lpool_lock);
+    pthread_cond_signal(&lpool_wake);
+    pthread_mutex_unlock(&lpool_lock);
+  }
+}
+
+int lpool_help(void) {
+  lpool_task *t = lpool_find();
+  if (t)
+    lpool_run(t);
+  return t != NULL;
+}
+
+void lpool_wait(lpool_group *g) {
+  while (__atomic_load_n(&g->pending, __ATOMIC_ACQUIRE)) {
+    if (!lpool_help())
+      sched_yield();
+  }
+}
@@ -0,0 +1,27 @@
+#ifndef lpool_h
+#define lpool_h
+
+typedef void (*lpool_fn)(void *arg);
+
+// Tasks spawned together, pending counts the ones not yet finished
+typedef struct
+{
+    long pending;
+} lpool_group;
+
+// Worker threads of the pool, started on first use. Their number is
+// LPOOL_THREADS when set, otherwise one less than the processors.
+int lpool_workers(void);
+
+// Queue fn(arg) on the deque of the calling thread where idle threads
+// steal it from. Runs it at once when the deque is full.
+void lpool_spawn(lpool_group *g, lpool_fn fn, void *arg);
+
+// Run queued tasks, own ones first then stolen ones, until every
+// task of the group finished
+void lpool_wait(lpool_group *g);
+
+// Run one queued task, returns 0 when there was none
+int lpool_help(void);
+
+#endif
@@ -0,0 +1,114 @@
+#include <sched.h>
+#include <stdlib.h>
+
+#include "lpool.h"
+#include "lrcu.h"
+
+/**
+ * ---------------------------------------------------------------
+ * Epoch based reclamation. A writer never changes what it has
+ * published, it publishes a new version and retires the old one
+ * tagged with the global epoch, which it then moves. A reader
+ * announces the epoch it started in on a record of its own cache
+ * line, so readers share no writes with each other or the writer,
+ * and whatever was retired before that epoch may be freed once no
+ * record of the same owner announces it anymore.
+ * ---------------------------------------------------------------
+ */
+
+// Records of readers at most
+#define LRCU_MAX 1024
+
+lrcu_reader lrcu_readers[LRCU_MAX] __attribute__((aligned(64)));
+int lrcu_nreaders = 0;
+
+// Starts at 1 since an epoch of 0 marks a free record
+long lrcu_epoch = 1;
+
+/** --- Readers --- */
+
+lrcu_reader *lrcu_enter(void *owner) {
+  int n = __atomic_load_n(&lrcu_nreaders, __ATOMIC_ACQUIRE);
+  lrcu_reader *r = NULL;
+
+  for (int i = 0; i < LRCU_MAX && !r; i++) {
+    void *none = NULL;
+    if (__atomic_compare_exchange_n(&lrcu_readers[i].owner, &none, owner, 0,
+                                    __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+      r = &lrcu_readers[i];
+      while (i >= n && !__atomic_compare_exchange_n(&lrcu_nreaders, &n, i + 1,
+                                                    1, __ATOMIC_RELEASE,
+                                                    __ATOMIC_ACQUIRE))
+        ;
+    }
+  }
+
+  // Every record taken, caller reads on the thread of the writer
+  if (!r)
+    return NULL;
+
+  // A writer missing the announcement published before it, so what
+  // is read after it is already the new version
+  long epoch = __atomic_load_n(&lrcu_epoch, __ATOMIC_SEQ_CST);
+  __atomic_store_n(&r->epoch, epoch, __ATOMIC_SEQ_CST);
+  return r;
+}
+
+void lrcu_leave(lrcu_reader *r) {
+  __atomic_store_n(&r->epoch, 0, __ATOMIC_RELEASE);
+  __atomic_store_n(&r->owner, NULL, __ATOMIC_RELEASE);
+}
+
+// Oldest epoch a reader of owner announces, or 0 when there is none
+long lrcu_oldest(void *owner) {
+  int n = __atomic_load_n(&lrcu_nreaders, __ATOMIC_ACQUIRE);
+  long oldest = 0;
+
+  for (int i = 0; i < n; i++) {
+    lrcu_reader *r = &lrcu_readers[i];
+    if (__atomic_load_n(&r->owner, __ATOMIC_SEQ_CST) != owner)
+      continue;
+    long epoch = __atomic_load_n(&r->epoch, __ATOMIC_SEQ_CST);
+    if (epoch && (!oldest || epoch < oldest))
+      oldest = epoch;
+  }
+  return oldest;
+}
+
+/** --- Writers --- */
+
+// Free items retired before every reader started
+void lrcu_reclaim(void *owner, lrcu_item **list) {
+  long oldest = lrcu_oldest(owner);
+
+  lrcu_item **p = list;
+  while (*p) {
+    lrcu_item *it = *p;
+    if (oldest && it->epoch >= oldest) {
+      p = &it->next;
+      continue;
+    }
+    *p = it->next;
+    it->fn(it->p);
+    free(it);
+  }
+}
+
+void lrcu_retire(void *owner, lrcu_item **list, void (*fn)(void *), void *p) {
+  lrcu_item *it = malloc(sizeof(lrcu_item));
+  it->fn = fn;
+  it->p = p;
+  it->epoch = __atomic_fetch_add(&lrcu_epoch, 1, __ATOMIC_SEQ_CST);
+  it->next = *list;
+  *list = it;
+
+  lrcu_reclaim(owner, list);
+}
+
+void lrcu_barrier(void *owner, lrcu_item **list) {
+  while (lrcu_oldest(owner)) {
+    if (!lpool_help())
+      sched_yield();
+  }
+  lrcu_reclaim(owner, list);
+}
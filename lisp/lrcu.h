@@ -0,0 +1,36 @@
+#ifndef lrcu_h
+#define lrcu_h
+
+// Announcement of a reader of what writer owns. Epoch is 0 while the
+// record is free.
+typedef struct
+{
+    long epoch;
+    void *owner;
+    char pad[48];
+} lrcu_reader;
+
+// Something unpublished by a writer, freed by fn once every reader
+// that could see it left
+typedef struct lrcu_item
+{
+    void (*fn)(void *p);
+    void *p;
+    long epoch;
+    struct lrcu_item *next;
+} lrcu_item;
+
+// Start reading what owner publishes, possibly on another thread than
+// the one leaving
+lrcu_reader *lrcu_enter(void *owner);
+void lrcu_leave(lrcu_reader *r);
+
+// Queue p of owner on its list of retired items, freeing what no
+// reader can see anymore
+void lrcu_retire(void *owner, lrcu_item **list, void (*fn)(void *), void *p);
+
+// Wait until no reader of owner is left, running tasks of the pool
+// meanwhile, then free everything retired
+void lrcu_barrier(void *owner, lrcu_item **list);
+
+#endif
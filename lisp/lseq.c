@@ -0,0 +1,145 @@
+#include <stdlib.h>
+
+#include "lseq.h"
+#include "lval.h"
+
+/**
+ * ---------------------------------------------------------------
+ * Lazy sequences. Nothing is evaluated when a sequence is built,
+ * an iterator lays the stages out from the source and pushes each
+ * element through all of them before pulling the next one, so no
+ * stage ever holds a list.
+ * ---------------------------------------------------------------
+ */
+
+lseq *lseq_new(int kind, lseq *src, lval *val) {
+  lseq *s = malloc(sizeof(lseq));
+  s->ref = 1;
+  s->kind = kind;
+  s->src = src;
+  s->val = val;
+  s->start = 0;
+  s->end = 0;
+  s->step = 1;
+  return s;
+}
+
+void lseq_release(lseq *s) {
+  // Walk the chain iteratively, long pipelines would blow the stack
+  while (s && --s->ref == 0) {
+    lseq *src = s->src;
+    if (s->val)
+      lval_del(s->val);
+    free(s);
+    s = src;
+  }
+}
+
+void lseq_iter_init(lseq_iter *it, lseq *s) {
+  int n = 0;
+  for (lseq *p = s; p->src; p = p->src)
+    n++;
+
+  it->count = n;
+  it->stages = malloc(sizeof(lseq *) * (n ? n : 1));
+  it->seen = calloc(n ? n : 1, sizeof(long));
+  it->done = 0;
+
+  // Stages run in order from the one next to the source
+  lseq *p = s;
+  for (int i = n - 1; i >= 0; i--, p = p->src) {
+    it->stages[i] = p;
+    if (p->kind == LSEQ_TAKE && p->start <= 0)
+      it->done = 1;
+  }
+
+  it->seq = p;
+  it->pos = p->start;
+
+  if (p->kind == LSEQ_LIST) {
+    it->pos = 0;
+    it->left = p->val->count;
+  } else if (p->step > 0) {
+    it->left = p->end > p->start ? (p->end - p->start - 1) / p->step + 1 : 0;
+  } else {
+    it->left = p->end < p->start ? (p->start - p->end - 1) / -p->step + 1 : 0;
+  }
+}
+
+void lseq_iter_free(lseq_iter *it) {
+  free(it->stages);
+  free(it->seen);
+}
+
+lval *lseq_source(lseq_iter *it) {
+  if (it->left == 0)
+    return NULL;
+  it->left--;
+
+  if (it->seq->kind == LSEQ_LIST)
+    return lval_copy(it->seq->val->cell[it->pos++]);
+
+  lval *x = lval_num(it->pos);
+  it->pos += it->seq->step;
+  return x;
+}
+
+lval *lseq_next(lenv *e, lseq_iter *it) {
+  while (!it->done) {
+    lval *x = lseq_source(it);
+    if (!x) {
+      it->done = 1;
+      break;
+    }
+
+    for (int i = 0; i < it->count && x; i++) {
+      lseq *s = it->stages[i];
+
+      switch (s->kind) {
+      case LSEQ_MAP:
+        x = lval_apply(e, s->val, lval_args(x, NULL));
+        if (x->type == LVAL_ERR) {
+          it->done = 1;
+          return x;
+        }
+        break;
+
+      case LSEQ_FILTER: {
+        lval *r = lval_apply(e, s->val, lval_args(lval_copy(x), NULL));
+        if (r->type == LVAL_ERR) {
+          lval_del(x);
+          it->done = 1;
+          return r;
+        }
+
+        if (r->type != LVAL_NUM || !r->num) {
+          lval_del(x);
+          x = NULL;
+        }
+        lval_del(r);
+        break;
+      }
+
+      case LSEQ_DROP:
+        if (it->seen[i] < s->start) {
+          it->seen[i]++;
+          lval_del(x);
+          x = NULL;
+        }
+        break;
+
+      // Stop pulling once the last element passed, later stages
+      // still see this one
+      case LSEQ_TAKE:
+        if (++it->seen[i] >= s->start)
+          it->done = 1;
+        break;
+      }
+    }
+
+    if (x)
+      return x;
+  }
+
+  return NULL;
+}
@@ -0,0 +1,56 @@
+#include "lval.h"
+
+#ifndef lseq_h
+#define lseq_h
+
+// Kinds of sequence stage, the first two are sources
+enum
+{
+    LSEQ_LIST,
+    LSEQ_RANGE,
+    LSEQ_MAP,
+    LSEQ_FILTER,
+    LSEQ_TAKE,
+    LSEQ_DROP,
+};
+
+// Stage of a lazy sequence. Stages are never changed once built, a
+// transform makes a new stage pointing at its source, so sequences
+// share their common stages. Val is the list of a list source or the
+// function of map and filter. Range uses start, end and step, take
+// and drop keep their count in start.
+struct lseq
+{
+    int ref;
+    int kind;
+    lseq *src;
+    lval *val;
+    long start;
+    long end;
+    long step;
+};
+
+// Cursor running every stage of a sequence in one pass
+typedef struct
+{
+    lseq *seq;
+    lseq **stages;
+    long *seen;
+    int count;
+    long pos;
+    long left;
+    int done;
+} lseq_iter;
+
+// Takes ownership of val and of the reference to src
+lseq *lseq_new(int kind, lseq *src, lval *val);
+void lseq_release(lseq *s);
+
+void lseq_iter_init(lseq_iter *it, lseq *s);
+void lseq_iter_free(lseq_iter *it);
+
+// Next element or NULL at the end. An error is returned like any
+// element and ends the iteration.
+lval *lseq_next(lenv *e, lseq_iter *it);
+
+#endif
@@ -0,0 +1,571 @@
+#include <limits.h>
+#include <setjmp.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "lclo.h"
+#include "ljit.h"
+#include "lopt.h"
+#include "lspec.h"
+#include "lval.h"
+
+/**
+ * ---------------------------------------------------------------
+ * Integer code of numeric lambdas. Every call of a lambda records
+ * the types of its arguments. Once a lambda was called often with
+ * nothing but numbers its body is compiled into a tree working on
+ * longs, which runs without allocating values or looking up names.
+ * Only formals, number literals, arithmetic, comparison, logic, if,
+ * let and calls of global lambdas that compile too are accepted.
+ * What the tree cannot finish, such as an overflow or a division
+ * by zero, hands the whole call back to the evaluator.
+ * ---------------------------------------------------------------
+ */
+
+// Calls before compiling, and calls handed back before giving up
+#define LSPEC_HOT 8
+#define LSPEC_BAILS 64
+
+// Calls before compiling integer code to native code
+#define LSPEC_NATIVE 64
+
+// Formals and let bindings of one compiled lambda
+#define LSPEC_SLOTS 64
+
+lspec *lspec_new(void) {
+  lspec *s = malloc(sizeof(lspec));
+  s->ref = 1;
+  s->calls = 0;
+  s->seen = 0;
+  s->bails = 0;
+  s->state = LSPEC_NONE;
+  s->epoch = -1;
+  s->nargs = 0;
+  s->nslots = 1;
+  s->code = NULL;
+  s->native = NULL;
+  s->native_size = 0;
+  s->native_epoch = -1;
+  s->frame = 0;
+  s->frame_epoch = -1;
+  s->clo = NULL;
+  s->clo_epoch = -1;
+  return s;
+}
+
+lnode *lnode_new(int op, long val, int count) {
+  lnode *n = malloc(sizeof(lnode));
+  n->op = op;
+  n->val = val;
+  n->count = count;
+  n->kids = count ? calloc(count, sizeof(lnode *)) : NULL;
+  n->fn = NULL;
+  return n;
+}
+
+// Free node, kids not compiled yet are NULL
+void lnode_del(lnode *n) {
+  if (!n)
+    return;
+
+  for (int i = 0; i < n->count; i++)
+    lnode_del(n->kids[i]);
+  free(n->kids);
+  free(n);
+}
+
+// Drop integer code and its native code
+void lspec_drop(lspec *s) {
+  lnode_del(s->code);
+  s->code = NULL;
+
+  if (s->native)
+    ljit_free(s->native, s->native_size);
+  s->native = NULL;
+}
+
+void lspec_release(lspec *s) {
+  if (--s->ref)
+    return;
+
+  lspec_drop(s);
+  if (s->clo)
+    lclo_release(s->clo);
+  free(s);
+}
+
+/**
+ * -----------------------------------------------------------
+ * Running the code. Results never leave long, anything that
+ * would need another type jumps out to bail.
+ * -----------------------------------------------------------
+ */
+
+__thread lenv *lspec_root = NULL;
+
+// Global name of the lambda for profilers, first one bound to it
+char *lspec_name(lspec *s) {
+  for (int i = 0; i < lspec_root->count; i++) {
+    lval *v = lspec_root->vals[i];
+    if (v->type == LVAL_FUNC && !v->builtin && v->spec == s)
+      return lspec_root->syms[i];
+  }
+  return "lambda";
+}
+
+// Compile code of lambda to native once hot, calls made by the code
+// itself count too so a single call of a long loop gets there
+void lspec_native(lspec *s) {
+  if (!ljit_enabled || s->calls < LSPEC_NATIVE || s->native_epoch == s->epoch)
+    return;
+
+  s->native_epoch = s->epoch;
+  s->native = ljit_compile(s, lspec_name(s), &s->native_size);
+}
+
+long lnode_eval(jmp_buf bail, lnode *n, long *v);
+
+long lnode_call(jmp_buf bail, lnode *n, long *v) {
+  lspec *s = n->fn;
+  if (!s->code)
+    longjmp(bail, 1);
+
+  s->calls++;
+  lspec_native(s);
+
+  long w[s->nslots];
+  for (int i = 0; i < n->count; i++)
+    w[i] = lnode_eval(bail, n->kids[i], v);
+
+  long r;
+  if (s->native) {
+    if (s->native(w, &r))
+      longjmp(bail, 1);
+    return r;
+  }
+
+  return lnode_eval(bail, s->code, w);
+}
+
+long lnode_arith(jmp_buf bail, lnode *n, long *v) {
+  long x = lnode_eval(bail, n->kids[0], v);
+
+  for (int i = 1; i < n->count; i++) {
+    long y = lnode_eval(bail, n->kids[i], v);
+    switch (n->op) {
+    case LSPEC_ADD:
+      if (__builtin_add_overflow(x, y, &x))
+        longjmp(bail, 1);
+      break;
+    case LSPEC_SUB:
+      if (__builtin_sub_overflow(x, y, &x))
+        longjmp(bail, 1);
+      break;
+    case LSPEC_MUL:
+      if (__builtin_mul_overflow(x, y, &x))
+        longjmp(bail, 1);
+      break;
+    case LSPEC_DIV:
+      if (y == 0 || (x == LONG_MIN && y == -1))
+        longjmp(bail, 1);
+      x /= y;
+      break;
+    case LSPEC_MOD:
+      if (y == 0)
+        longjmp(bail, 1);
+      x = y == -1 ? 0 : x % y;
+      break;
+    }
+  }
+
+  return x;
+}
+
+long lnode_eval(jmp_buf bail, lnode *n, long *v) {
+  long x, y;
+
+  switch (n->op) {
+  case LSPEC_NUM:
+    return n->val;
+  case LSPEC_SLOT:
+    return v[n->val];
+  case LSPEC_SET:
+    return v[n->val] = lnode_eval(bail, n->kids[0], v);
+
+  case LSPEC_ADD:
+  case LSPEC_SUB:
+  case LSPEC_MUL:
+  case LSPEC_DIV:
+  case LSPEC_MOD:
+    return lnode_arith(bail, n, v);
+  case LSPEC_NEG:
+    x = lnode_eval(bail, n->kids[0], v);
+    if (x == LONG_MIN)
+      longjmp(bail, 1);
+    return -x;
+
+  case LSPEC_LT:
+  case LSPEC_GT:
+  case LSPEC_LE:
+  case LSPEC_GE:
+  case LSPEC_EQ:
+  case LSPEC_NE:
+    x = lnode_eval(bail, n->kids[0], v);
+    y = lnode_eval(bail, n->kids[1], v);
+    switch (n->op) {
+    case LSPEC_LT:
+      return x < y;
+    case LSPEC_GT:
+      return x > y;
+    case LSPEC_LE:
+      return x <= y;
+    case LSPEC_GE:
+      return x >= y;
+    case LSPEC_EQ:
+      return x == y;
+    default:
+      return x != y;
+    }
+
+  case LSPEC_NOT:
+    return !lnode_eval(bail, n->kids[0], v);
+  case LSPEC_AND:
+    for (int i = 0; i < n->count; i++) {
+      if (!lnode_eval(bail, n->kids[i], v))
+        return 0;
+    }
+    return 1;
+  case LSPEC_OR:
+    for (int i = 0; i < n->count; i++) {
+      if (lnode_eval(bail, n->kids[i], v))
+        return 1;
+    }
+    return 0;
+
+  case LSPEC_IF:
+    if (lnode_eval(bail, n->kids[0], v))
+      return lnode_eval(bail, n->kids[1], v);
+    return lnode_eval(bail, n->kids[2], v);
+  case LSPEC_LET:
+    for (int i = 0; i < n->count - 1; i++)
+      lnode_eval(bail, n->kids[i], v);
+    return lnode_eval(bail, n->kids[n->count - 1], v);
+
+  case LSPEC_CALL:
+    return lnode_call(bail, n, v);
+  }
+
+  longjmp(bail, 1);
+}
+
+/**
+ * -----------------------------------------------------------
+ * Compiling. Anything outside of what the code can do makes
+ * the whole lambda stay on the evaluator.
+ * -----------------------------------------------------------
+ */
+
+typedef struct
+{
+    lenv *root;
+
+    // Names in scope and their slots, later ones shadow earlier ones
+    int count;
+    char *names[LSPEC_SLOTS];
+    int slot[LSPEC_SLOTS];
+
+    // Slots used so far
+    int slots;
+} lcomp;
+
+// Builtins compiled as operation, arguments from min to max or any
+// number when max is -1
+typedef struct
+{
+    char *name;
+    int op;
+    int min;
+    int max;
+} lspec_op;
+
+lspec_op lspec_ops[] = {
+    {"+", LSPEC_ADD, 1, -1}, {"-", LSPEC_SUB, 1, -1},
+    {"*", LSPEC_MUL, 1, -1}, {"/", LSPEC_DIV, 1, -1},
+    {"%", LSPEC_MOD, 1, -1}, {"<", LSPEC_LT, 2, 2},
+    {">", LSPEC_GT, 2, 2},   {"<=", LSPEC_LE, 2, 2},
+    {">=", LSPEC_GE, 2, 2},  {"==", LSPEC_EQ, 2, 2},
+    {"!=", LSPEC_NE, 2, 2},  {"not", LSPEC_NOT, 1, 1},
+    {"and", LSPEC_AND, 0, -1}, {"or", LSPEC_OR, 0, -1},
+    {"if", LSPEC_IF, 3, 3},  {"let", LSPEC_LET, 2, 2},
+};
+
+int lspec_build(lenv *root, lval *f);
+lnode *lspec_expr(lcomp *c, lval *x);
+lnode *lspec_sexpr(lcomp *c, lval *x);
+
+int lspec_bind(lcomp *c, char *name) {
+  if (c->count == LSPEC_SLOTS || c->slots == LSPEC_SLOTS)
+    return 0;
+
+  // Evaluator would bind it in a frame, the optimiser must know
+  lopt_local(name);
+  c->names[c->count] = name;
+  c->slot[c->count] = c->slots;
+  c->count++;
+  c->slots++;
+  return 1;
+}
+
+// Global function the head of call surely refers to, or NULL
+lval *lspec_head(lcomp *c, lval *h) {
+  if (h->type == LVAL_FUNC)
+    return h->builtin ? h : NULL;
+
+  if (h->type != LVAL_SYM || lopt_is_local(h->sym))
+    return NULL;
+
+  for (int i = 0; i < c->count; i++) {
+    if (strcmp(c->names[i], h->sym) == 0)
+      return NULL;
+  }
+
+  lval *v = lenv_find(c->root, h);
+  return v && v->type == LVAL_FUNC && !v->memo ? v : NULL;
+}
+
+// Operand evaluated as truth, quoted one is evaluated as expression
+lnode *lspec_truth(lcomp *c, lval *x) {
+  if (x->type == LVAL_QEXPR)
+    return lspec_sexpr(c, x);
+  return lspec_expr(c, x);
+}
+
+// Bindings of let then its body, with the names in scope of body
+lnode *lspec_let(lcomp *c, lval *x) {
+  lval *binds = x->cell[1];
+  lval *body = x->cell[2];
+  if (binds->type != LVAL_QEXPR || body->type != LVAL_QEXPR)
+    return NULL;
+
+  int count = c->count;
+  lnode *n = lnode_new(LSPEC_LET, 0, binds->count + 1);
+
+  for (int i = 0; i < binds->count; i++) {
+    lval *b = binds->cell[i];
+    if (b->type != LVAL_QEXPR || b->count != 2 ||
+        b->cell[0]->type != LVAL_SYM || b->cell[1]->type == LVAL_QEXPR) {
+      lnode_del(n);
+      return NULL;
+    }
+
+    lnode *k = lspec_expr(c, b->cell[1]);
+    if (!k || !lspec_bind(c, b->cell[0]->sym)) {
+      lnode_del(k);
+      lnode_del(n);
+      return NULL;
+    }
+
+    n->kids[i] = lnode_new(LSPEC_SET, c->slot[c->count - 1], 1);
+    n->kids[i]->kids[0] = k;
+  }
+
+  n->kids[binds->count] = lspec_sexpr(c, body);
+  c->count = count;
+
+  if (!n->kids[binds->count]) {
+    lnode_del(n);
+    return NULL;
+  }
+  return n;
+}
+
+lnode *lspec_builtin(lcomp *c, lval *x, lval *f) {
+  int argc = x->count - 1;
+
+  for (size_t i = 0; i < sizeof(lspec_ops) / sizeof(lspec_op); i++) {
+    lspec_op *o = &lspec_ops[i];
+    if (strcmp(o->name, f->sym) != 0)
+      continue;
+    if (argc < o->min || (o->max >= 0 && argc > o->max))
+      return NULL;
+
+    if (o->op == LSPEC_LET)
+      return lspec_let(c, x);
+
+    int op = o->op == LSPEC_SUB && argc == 1 ? LSPEC_NEG : o->op;
+    lnode *n = lnode_new(op, 0, argc);
+
+    for (int j = 0; j < argc; j++) {
+      lval *a = x->cell[j + 1];
+
+      // Condition of if is evaluated, branches must be quoted
+      if (op == LSPEC_IF) {
+        if ((j == 0) == (a->type == LVAL_QEXPR)) {
+          lnode_del(n);
+          return NULL;
+        }
+        n->kids[j] = j ? lspec_sexpr(c, a) : lspec_expr(c, a);
+      } else if (op == LSPEC_NOT || op == LSPEC_AND || op == LSPEC_OR) {
+        n->kids[j] = lspec_truth(c, a);
+      } else {
+        n->kids[j] = lspec_expr(c, a);
+      }
+
+      if (!n->kids[j]) {
+        lnode_del(n);
+        return NULL;
+      }
+    }
+
+    return n;
+  }
+
+  return NULL;
+}
+
+// Call of global lambda, which is compiled first unless it already
+// is or is being compiled further up
+lnode *lspec_lambda(lcomp *c, lval *x, lval *g) {
+  if (g->env->count || g->formals->count != x->count - 1 ||
+      !lspec_build(c->root, g))
+    return NULL;
+
+  lnode *n = lnode_new(LSPEC_CALL, 0, x->count - 1);
+  n->fn = g->spec;
+
+  for (int i = 1; i < x->count; i++) {
+    n->kids[i - 1] = lspec_expr(c, x->cell[i]);
+    if (!n->kids[i - 1]) {
+      lnode_del(n);
+      return NULL;
+    }
+  }
+
+  return n;
+}
+
+// Expression evaluated as call, or as its value when single
+lnode *lspec_sexpr(lcomp *c, lval *x) {
+  if (x->count == 1)
+    return lspec_expr(c, x->cell[0]);
+
+  if (x->count == 0)
+    return NULL;
+
+  lval *f = lspec_head(c, x->cell[0]);
+  if (!f)
+    return NULL;
+
+  return f->builtin ? lspec_builtin(c, x, f) : lspec_lambda(c, x, f);
+}
+
+lnode *lspec_expr(lcomp *c, lval *x) {
+  switch (x->type) {
+  case LVAL_NUM:
+    return lnode_new(LSPEC_NUM, x->num, 0);
+
+  case LVAL_SYM:
+    for (int i = c->count - 1; i >= 0; i--) {
+      if (strcmp(c->names[i], x->sym) == 0)
+        return lnode_new(LSPEC_SLOT, c->slot[i], 0);
+    }
+    return NULL;
+
+  case LVAL_SEXPR:
+    return lspec_sexpr(c, x);
+  }
+
+  return NULL;
+}
+
+// Compile lambda unless its code is valid at this epoch, returns
+// whether it has code or is being compiled further up
+int lspec_build(lenv *root, lval *f) {
+  lspec *s = f->spec;
+  if (s->state == LSPEC_BUSY)
+    return 1;
+  if (s->epoch == lopt_epoch)
+    return s->state == LSPEC_READY;
+
+  // Stamped with the epoch it started at, so binding a name for the
+  // first time while compiling leaves the code stale
+  long epoch = lopt_epoch;
+  lcomp c = {root, 0, {NULL}, {0}, 0};
+  lspec_root = root;
+
+  lspec_drop(s);
+  s->state = LSPEC_BUSY;
+
+  int ok = 1;
+  for (int i = 0; i < f->formals->count && ok; i++) {
+    char *name = f->formals->cell[i]->sym;
+    ok = strcmp(name, "&") != 0 && lspec_bind(&c, name);
+  }
+
+  if (ok)
+    s->code = lspec_sexpr(&c, f->body);
+
+  s->state = s->code ? LSPEC_READY : LSPEC_FAILED;
+  s->epoch = epoch;
+  s->nargs = f->formals->count;
+  s->nslots = c.slots ? c.slots : 1;
+  return s->code != NULL;
+}
+
+lval *lspec_call(lenv *e, lval *f, lval *a) {
+  lspec *s = f->spec;
+  if (f->env->count || a->count != f->formals->count)
+    return NULL;
+
+  int seen = 0;
+  for (int i = 0; i < a->count; i++)
+    seen |= 1 << a->cell[i]->type;
+
+  s->seen |= seen;
+  s->calls++;
+
+  // The guard, any argument other than a number takes the evaluator
+  if (seen & ~(1 << LVAL_NUM) || s->bails >= LSPEC_BAILS)
+    return NULL;
+
+  if (s->state != LSPEC_READY || s->epoch != lopt_epoch) {
+    // Only compiled once hot and when never called with other types
+    if (s->seen & ~(1 << LVAL_NUM) || s->calls < LSPEC_HOT ||
+        s->epoch == lopt_epoch)
+      return NULL;
+
+    while (e->par) {
+      e = e->par;
+    }
+
+    long epoch = lopt_epoch;
+    if (!lspec_build(e, f) || lopt_epoch != epoch)
+      return NULL;
+  }
+
+  lspec_native(s);
+
+  long v[s->nslots];
+  for (int i = 0; i < a->count; i++)
+    v[i] = a->cell[i]->num;
+
+  long r;
+  if (s->native) {
+    if (s->native(v, &r)) {
+      s->bails++;
+      return NULL;
+    }
+    lval_del(a);
+    return lval_num(r);
+  }
+
+  jmp_buf bail;
+  if (setjmp(bail)) {
+    s->bails++;
+    return NULL;
+  }
+
+  r = lnode_eval(bail, s->code, v);
+  lval_del(a);
+  return lval_num(r);
+}
@@ -0,0 +1,103 @@
+#include <stddef.h>
+
+#include "ljit.h"
+#include "lval.h"
+
+#ifndef lspec_h
+#define lspec_h
+
+// Operations of integer code
+enum
+{
+    LSPEC_NUM,  // Literal val
+    LSPEC_SLOT, // Value of slot val
+    LSPEC_SET,  // Store the only kid into slot val
+    LSPEC_ADD,
+    LSPEC_SUB,
+    LSPEC_MUL,
+    LSPEC_DIV,
+    LSPEC_MOD,
+    LSPEC_NEG,
+    LSPEC_LT,
+    LSPEC_GT,
+    LSPEC_LE,
+    LSPEC_GE,
+    LSPEC_EQ,
+    LSPEC_NE,
+    LSPEC_NOT,
+    LSPEC_AND,
+    LSPEC_OR,
+    LSPEC_IF,   // Condition, then and else
+    LSPEC_LET,  // Stores in order, then the body
+    LSPEC_CALL, // Arguments of fn
+};
+
+// Compilation state of lambda
+enum
+{
+    LSPEC_NONE,
+    LSPEC_BUSY,
+    LSPEC_READY,
+    LSPEC_FAILED,
+};
+
+typedef struct lnode lnode;
+
+// Node of integer code, every node evaluates to a long
+struct lnode
+{
+    int op;
+    long val;
+    int count;
+    lnode **kids;
+
+    // Callee of a call, not counted as reference. The lambda holding
+    // it is global, replacing it moves the epoch of the caller.
+    lspec *fn;
+};
+
+// Type feedback, integer code, escape of frame and closures of lambda,
+// shared between copies
+struct lspec
+{
+    int ref;
+
+    // Calls seen, types of arguments they passed as mask of 1 << type
+    // and the calls the code could not finish
+    long calls;
+    int seen;
+    int bails;
+
+    // Code with formals in the first slots, valid at epoch
+    int state;
+    long epoch;
+    int nargs;
+    int nslots;
+    lnode *code;
+
+    // Native code of the integer code, tried once per epoch of code
+    ljit_fn native;
+    size_t native_size;
+    long native_epoch;
+
+    // Whether calls can use a frame on the stack, valid at frame_epoch
+    int frame;
+    long frame_epoch;
+
+    // Body compiled by the closure engine, valid at clo_epoch
+    lclo *clo;
+    long clo_epoch;
+};
+
+// Global environment code was last compiled against
+extern __thread lenv *lspec_root;
+
+lspec *lspec_new(void);
+void lspec_release(lspec *s);
+
+// Record the argument types of calling lambda f and run the call on
+// its integer code when it has one. Returns NULL, leaving arguments
+// untouched, when the call has to be evaluated.
+lval *lspec_call(lenv *e, lval *f, lval *a);
+
+#endif
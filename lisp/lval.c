@@ -1,9 +1,24 @@
+#include <limits.h>
+#include <math.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
 
+#include "lbig.h"
+#include "ldict.h"
+#include "leff.h"
+#include "lmemo.h"
+#include "lseq.h"
+#include "lcell.h"
+#include "lchan.h"
+#include "lclo.h"
+#include "lopt.h"
+#include "lpar.h"
+#include "lrcu.h"
+#include "lspec.h"
 #include "lval.h"
+#include "lvec.h"
 #include "mpc.h"
 
 /**
@@ -31,6 +46,14 @@
           "Function '%s' passed %i arguments. Expected %i", func, a->count,    \
           num)
 
+#define LASSERT_NUMERIC(func, args, index)                                     \
+  LASSERT(args,                                                                \
+          lval_numeric(args->cell[index]),                                     \
+          "Function '%s' passed incorrect type for argument %i. "              \
+          "Got %s, Expected %s.",                                              \
+          func, index, ltype_name(args->cell[index]->type),                    \
+          ltype_name(LVAL_NUM))
+
 #define LASSERT_NOT_EMPTY(func, args, index)                                   \
   LASSERT(args, args->cell[index]->count != 0,                                 \
           "Function '%s' passed {} for argument %i", func, index)
@@ -42,16 +65,30 @@
  */
 
 int lfunc_args(const char *name) {
-  if (strcmp(name, "show") == 0 || strcmp(name, "exit") == 0)
+  if (strcmp(name, "show") == 0 || strcmp(name, "exit") == 0 ||
+      strcmp(name, "dict") == 0 || strcmp(name, "do") == 0 ||
+      strcmp(name, "and") == 0 || strcmp(name, "or") == 0)
     return 1;
 
   return 0;
 }
 
+// Builtin that evaluate its own operands, so they are passed as read
+int lfunc_lazy(lval *f) {
+  if (f->type != LVAL_FUNC || !f->builtin)
+    return 0;
+
+  return strcmp(f->sym, "and") == 0 || strcmp(f->sym, "or") == 0;
+}
+
 char *ltype_name(int t) {
   switch (t) {
   case LVAL_NUM:
     return "Number";
+  case LVAL_BIG:
+    return "Bignum";
+  case LVAL_DBL:
+    return "Double";
   case LVAL_ERR:
     return "Error";
   case LVAL_SYM:
@@ -62,11 +99,127 @@ char *ltype_name(int t) {
     return "S-Experssion";
   case LVAL_QEXPR:
     return "Q-Experssion";
+  case LVAL_VEC:
+    return "Vector";
+  case LVAL_DICT:
+    return "Dictionary";
+  case LVAL_STR:
+    return "String";
+  case LVAL_SEQ:
+    return "Sequence";
+  case LVAL_CELL:
+    return "Cell";
+  case LVAL_FUTURE:
+    return "Future";
+  case LVAL_CHAN:
+    return "Channel";
   default:
     return "Unknown";
   }
 }
 
+/**
+ * --------------------------------------------------------
+ * Numeric helpers. Integers are kept as long and promoted
+ * to bignum only when an operation overflows, every result
+ * that fits into long again is demoted back.
+ * --------------------------------------------------------
+ */
+
+int lval_numeric(lval *v) {
+  return v->type == LVAL_NUM || v->type == LVAL_DBL || v->type == LVAL_BIG;
+}
+
+double lval_to_dbl(lval *v) {
+  switch (v->type) {
+  case LVAL_DBL:
+    return v->dbl;
+  case LVAL_BIG:
+    return lbig_to_dbl(v->big);
+  default:
+    return v->num;
+  }
+}
+
+// New bignum holding the integer value
+lbig *lval_to_big(lval *v) {
+  return v->type == LVAL_BIG ? lbig_copy(v->big) : lbig_from_long(v->num);
+}
+
+// Demote bignum in place when it fits into long
+lval *lval_norm(lval *v) {
+  long n;
+  if (v->type == LVAL_BIG && lbig_to_long(v->big, &n)) {
+    free(v->big);
+    v->type = LVAL_NUM;
+    v->num = n;
+  }
+  return v;
+}
+
+// Bignum holding integral double d exactly
+lbig *lval_dbl_big(double d) {
+  if (fabs(d) < 0x1p63)
+    return lbig_from_long((long)d);
+
+  // Past long the 53 bits of mantissa are shifted left
+  int exp;
+  lbig *m = lbig_from_long((long)ldexp(frexp(d, &exp), 53));
+  lbig *two = lbig_from_long(2);
+  lbig *p = lbig_pow(two, exp - 53);
+  lbig *r = lbig_mul(m, p);
+  free(m);
+  free(two);
+  free(p);
+  return r;
+}
+
+// Compare integer with double exactly, as double every long past 2^53
+// would equal its neighbours. NaN is above every integer.
+int lval_int_dbl_cmp(lval *x, double d) {
+  if (isnan(d))
+    return -1;
+  if (isinf(d))
+    return d > 0 ? -1 : 1;
+
+  double t = trunc(d);
+  int c;
+  if (x->type == LVAL_NUM && fabs(t) < 0x1p63) {
+    long n = (long)t;
+    c = (x->num > n) - (x->num < n);
+  } else {
+    lbig *bx = lval_to_big(x);
+    lbig *bt = lval_dbl_big(t);
+    c = lbig_cmp(bx, bt);
+    free(bx);
+    free(bt);
+  }
+
+  // Equal to the integral part, the fraction decides
+  return c ? c : (t > d) - (t < d);
+}
+
+// Compare two numbers of any numeric type by their value
+int lval_num_cmp(lval *x, lval *y) {
+  if (x->type == LVAL_NUM && y->type == LVAL_NUM)
+    return (x->num > y->num) - (x->num < y->num);
+
+  if (x->type == LVAL_DBL && y->type == LVAL_DBL)
+    return (x->dbl > y->dbl) - (x->dbl < y->dbl);
+
+  if (x->type == LVAL_DBL)
+    return -lval_int_dbl_cmp(y, x->dbl);
+  if (y->type == LVAL_DBL)
+    return lval_int_dbl_cmp(x, y->dbl);
+
+  lbig *bx = lval_to_big(x);
+  lbig *by = lval_to_big(y);
+  int c = lbig_cmp(bx, by);
+  free(bx);
+  free(by);
+  return c;
+}
+
 /**
  * -----------------------------------------
  * Below are some of lval basic functions
@@ -83,6 +236,14 @@ lval *lval_num(long x) {
   return v;
 }
 
+// Construct double lval type
+lval *lval_dbl(double x) {
+  lval *v = malloc(sizeof(lval));
+  v->type = LVAL_DBL;
+  v->dbl = x;
+  return v;
+}
+
 // Construct error lval type
 lval *lval_err(char *fmt, ...) {
   lval *v = malloc(sizeof(lval));
@@ -109,10 +270,12 @@ lval *lval_sym(char *s) {
   return v;
 }
 
-lval *lval_func(char *name, lbuiltin func) {
+lval *lval_func(char *name, lbuiltin func, int effect) {
   lval *v = malloc(sizeof(lval));
   v->type = LVAL_FUNC;
   v->builtin = func;
+  v->effect = effect;
+  v->memo = NULL;
   v->sym = malloc(strlen(name) + 1);
   strcpy(v->sym, name);
   return v;
@@ -136,16 +299,56 @@ lval *lval_qexpr(void) {
   return v;
 }
 
+// Construct vector lval type with n uninitialized elements
+lval *lval_vec(int n) {
+  lval *v = malloc(sizeof(lval));
+  v->type = LVAL_VEC;
+  v->count = n;
+  v->vec = malloc(sizeof(int64_t) * (n > 0 ? n : 1));
+  return v;
+}
+
+// Construct string lval type from n bytes of s
+lval *lval_str(const char *s, size_t n) {
+  lval *v = malloc(sizeof(lval));
+  v->type = LVAL_STR;
+  v->slen = n;
+  v->soff = 0;
+
+  if (n < LSTR_SSO) {
+    v->buf = NULL;
+    memcpy(v->sso, s, n);
+    v->sso[n] = '\0';
+  } else {
+    v->buf = malloc(sizeof(lbuf) + n + 1);
+    v->buf->ref = 1;
+    memcpy(v->buf->data, s, n);
+    v->buf->data[n] = '\0';
+  }
+
+  return v;
+}
+
+// Bytes of string, not terminated when it is a slice
+char *lval_str_ptr(lval *v) {
+  return v->buf ? v->buf->data + v->soff : v->sso;
+}
+
 // Constuct defined function lval type
 lval *lval_lambda(lval *formals, lval *body) {
   lval *v = malloc(sizeof(lval));
   v->type = LVAL_FUNC;
 
   v->builtin = NULL;
+  v->memo = NULL;
   v->env = lenv_new();
 
   v->formals = formals;
   v->body = body;
+  v->src = NULL;
+  v->epoch = -1;
+  v->pure_epoch = -1;
+  v->spec = lspec_new();
 
   return v;
 }
@@ -207,15 +410,35 @@ lval *lval_copy(lval *a) {
   case LVAL_NUM:
     v->num = a->num;
     break;
+  case LVAL_DBL:
+    v->dbl = a->dbl;
+    break;
+  case LVAL_BIG:
+    v->big = lbig_copy(a->big);
+    break;
 
   case LVAL_FUNC:
+    v->memo = NULL;
     if (a->builtin) {
       v->builtin = a->builtin;
+      v->effect = a->effect;
+      v->sym = malloc(strlen(a->sym) + 1);
+      strcpy(v->sym, a->sym);
+    } else if (a->memo) {
+      v->builtin = NULL;
+      v->memo = a->memo;
+      v->memo->ref++;
     } else {
       v->builtin = NULL;
       v->env = lenv_copy(a->env);
       v->formals = lval_copy(a->formals);
       v->body = lval_copy(a->body);
+      v->src = a->src ? lval_copy(a->src) : NULL;
+      v->epoch = a->epoch;
+      v->pure = a->pure;
+      v->pure_epoch = a->pure_epoch;
+      v->spec = a->spec;
+      v->spec->ref++;
     }
     break;
 
@@ -240,17 +463,116 @@ lval *lval_copy(lval *a) {
       v->cell[i] = lval_copy(a->cell[i]);
     }
     break;
+
+  case LVAL_VEC:
+    v->count = a->count;
+    v->vec = malloc(sizeof(int64_t) * (v->count ? v->count : 1));
+    memcpy(v->vec, a->vec, sizeof(int64_t) * v->count);
+    break;
+
+  // Table is shared until one of the copies modify it
+  case LVAL_DICT:
+    v->dict = a->dict;
+    v->dict->ref++;
+    break;
+
+  // Long strings share their buffer, short ones are copied inline
+  case LVAL_STR:
+    v->buf = a->buf;
+    v->soff = a->soff;
+    v->slen = a->slen;
+    if (v->buf)
+      v->buf->ref++;
+    else
+      memcpy(v->sso, a->sso, sizeof(v->sso));
+    break;
+
+  case LVAL_SEQ:
+    v->seq = a->seq;
+    v->seq->ref++;
+    break;
+
+  case LVAL_CELL:
+    v->rcell = a->rcell;
+    v->rcell->ref++;
+    break;
+
+  case LVAL_FUTURE:
+    v->fut = a->fut;
+    v->fut->ref++;
+    break;
+
+  case LVAL_CHAN:
+    v->chan = a->chan;
+    lchan_retain(v->chan);
+    break;
   }
 
   return v;
 }
 
+// Evaluate body of lambda in the frame of its call
+lval *lval_body(lenv *e, lval *f) {
+  if (lclo_engine) {
+    return lclo_body(e, f);
+  }
+
+  lval *body = lval_copy(f->body);
+  body->type = LVAL_SEXPR;
+  return lval_eval(e, body);
+}
+
+// Call lambda that never binds into its frame on a frame on the
+// stack. Arguments are bound as they are rather than copied and the
+// frame goes away with the call.
+lval *lval_frame_call(lenv *e, lval *f, lval *a) {
+  int n = a->count;
+  char *syms[n + 1];
+  lval *vals[n + 1];
+  lenv frame = {.count = n,
+                .syms = syms,
+                .vals = vals,
+                .par = e,
+                .global = 0,
+                .stack = 1,
+                .loop = 0,
+                .retired = NULL};
+
+  for (int i = 0; i < n; i++) {
+    syms[i] = f->formals->cell[i]->sym;
+    vals[i] = a->cell[i];
+  }
+  free(a->cell);
+  free(a);
+
+  lval *r = lval_body(&frame, f);
+  lenv_clear(&frame);
+  return r;
+}
+
 // Call the function when s-experssion is evaluates
 lval *lval_call(lenv *e, lval *f, lval *a) {
   if (f->builtin) {
     return f->builtin(e, a);
   }
 
+  if (f->memo) {
+    return lval_memo_call(e, f, a);
+  }
+
+  lopt_check(e, f);
+
+  lval *r = lspec_call(e, f, a);
+  if (r) {
+    return r;
+  }
+
+  // An empty body is left to eval below, which reports it
+  if (!f->env->count && a->count == f->formals->count && f->body->count &&
+      leff_frame(e, f)) {
+    return lval_frame_call(e, f, a);
+  }
+
   int given = a->count;
   int total = f->formals->count;
 
@@ -305,27 +627,63 @@ lval *lval_call(lenv *e, lval *f, lval *a) {
   // environment parent to evaluation and return
   if (f->formals->count == 0) {
     f->env->par = e;
+    if (f->body->count) {
+      return lval_body(f->env, f);
+    }
     return builtin_eval(f->env, lval_push(lval_sexpr(), lval_copy(f->body)));
   }
 
   return lval_copy(f);
 }
 
-// Read number type content and construct
+// Read number type content and construct, literals
+// beyond the range of long are read as bignum
 lval *lval_read_num(mpc_ast_t *t) {
   errno = 0;
   long n = strtol(t->contents, NULL, 0);
-  return errno != ERANGE ? lval_num(n) : lval_err("invalid number");
+  if (errno != ERANGE)
+    return lval_num(n);
+
+  lval *v = malloc(sizeof(lval));
+  v->type = LVAL_BIG;
+  v->big = lbig_from_str(t->contents);
+  return v;
+}
+
+// Read double type content and construct
+lval *lval_read_dbl(mpc_ast_t *t) {
+  errno = 0;
+  double d = strtod(t->contents, NULL);
+  return errno != ERANGE ? lval_dbl(d) : lval_err("invalid number");
+}
+
+// Read string literal, strip the quotes and unescape the content
+lval *lval_read_str(mpc_ast_t *t) {
+  size_t n = strlen(t->contents);
+  char *s = malloc(n);
+  memcpy(s, t->contents + 1, n - 2);
+  s[n - 2] = '\0';
+
+  s = mpcf_unescape(s);
+  lval *v = lval_str(s, strlen(s));
+  free(s);
+  return v;
 }
 
 // Read the tree
 lval *lval_read(mpc_ast_t *t) {
+  if (strstr(t->tag, "double"))
+    return lval_read_dbl(t);
+
   if (strstr(t->tag, "number"))
     return lval_read_num(t);
 
   if (strstr(t->tag, "symbol"))
     return lval_sym(t->contents);
 
+  if (strstr(t->tag, "string"))
+    return lval_read_str(t);
+
   lval *v = NULL;
 
   if ((strcmp(t->tag, ">")) == 0 || strstr(t->tag, "sexpr"))
@@ -350,10 +708,21 @@ lval *lval_read(mpc_ast_t *t) {
 
 // Evaluate sexpr lval
 lval *lval_eval_sexpr(lenv *e, lval *v) {
+  if (v->count == 0)
+    return v;
+
+  v->cell[0] = lval_eval(e, v->cell[0]);
+  if (lfunc_lazy(v->cell[0]))
+    return lval_eval_call(e, v);
 
-  for (int i = 0; i < v->count; i++)
+  for (int i = 1; i < v->count; i++)
     v->cell[i] = lval_eval(e, v->cell[i]);
 
+  return lval_eval_call(e, v);
+}
+
+// Call the head of sexpr whose elements are already evaluated
+lval *lval_eval_call(lenv *e, lval *v) {
   for (int i = 0; i < v->count; i++) {
     if (v->cell[i]->type == LVAL_ERR) {
       return lval_take(v, i);
@@ -366,7 +735,8 @@ lval *lval_eval_sexpr(lenv *e, lval *v) {
   if (v->count == 1) {
     // return lval_take(v, 0);
     // If the symbol not allow arguments return it instead
-    if (lfunc_args(v->cell[0]->sym) == 0) {
+    if (v->cell[0]->type != LVAL_FUNC || !v->cell[0]->builtin ||
+        lfunc_args(v->cell[0]->sym) == 0) {
       return lval_take(v, 0);
     }
 
@@ -405,6 +775,38 @@ lval *lval_eval(lenv *e, lval *v) {
   return v;
 }
 
+// Evaluate without consuming the expression, so the same
+// expression can be evaluated again without copying it first
+lval *lval_eval_expr(lenv *e, lval *v) {
+  if (v->type == LVAL_SYM) {
+    return lenv_get(e, v);
+  }
+
+  if (v->type != LVAL_SEXPR) {
+    return lval_copy(v);
+  }
+
+  lval *a = lval_sexpr();
+  a->cell = malloc(sizeof(lval *) * v->count);
+
+  for (int i = 0; i < v->count; i++) {
+    // Operands of lazy builtin are passed as read
+    if (i > 0 && lfunc_lazy(a->cell[0])) {
+      a->cell[a->count++] = lval_copy(v->cell[i]);
+      continue;
+    }
+
+    lval *x = lval_eval_expr(e, v->cell[i]);
+    if (x->type == LVAL_ERR) {
+      lval_del(a);
+      return x;
+    }
+    a->cell[a->count++] = x;
+  }
+
+  return lval_eval_call(e, a);
+}
+
 // Join each elements from y to x
 lval *lval_join(lval *x, lval *y) {
   while (y->count) {
@@ -419,13 +821,25 @@ lval *lval_join(lval *x, lval *y) {
 void lval_del(lval *v) {
   switch (v->type) {
   case LVAL_NUM:
+  case LVAL_DBL:
+    break;
+
+  case LVAL_BIG:
+    free(v->big);
     break;
 
   case LVAL_FUNC:
-    if (!v->builtin) {
+    if (v->builtin) {
+      free(v->sym);
+    } else if (v->memo) {
+      lmemo_release(v->memo);
+    } else {
       lenv_del(v->env);
       lval_del(v->formals);
       lval_del(v->body);
+      if (v->src)
+        lval_del(v->src);
+      lspec_release(v->spec);
     }
     break;
 
@@ -445,12 +859,45 @@ void lval_del(lval *v) {
 
     free(v->cell);
     break;
+
+  case LVAL_VEC:
+    free(v->vec);
+    break;
+
+  case LVAL_DICT:
+    ldict_release(v->dict);
+    break;
+
+  case LVAL_STR:
+    if (v->buf && --v->buf->ref == 0)
+      free(v->buf);
+    break;
+
+  case LVAL_SEQ:
+    lseq_release(v->seq);
+    break;
+
+  case LVAL_CELL:
+    lcell_release(v->rcell);
+    break;
+
+  case LVAL_FUTURE:
+    lpar_future_release(v->fut);
+    break;
+
+  case LVAL_CHAN:
+    lchan_release(v->chan);
+    break;
   }
 
   free(v);
 }
 
 int lval_eq(lval *x, lval *y) {
+  // Numbers of different types are equal when they hold the same value
+  if (x->type != y->type && lval_numeric(x) && lval_numeric(y))
+    return lval_num_cmp(x, y) == 0;
+
   if (x->type != y->type) {
     return 0;
   }
@@ -459,12 +906,16 @@ int lval_eq(lval *x, lval *y) {
   // Comparation for number
   case LVAL_NUM:
     return (x->num == y->num);
+  case LVAL_DBL:
+    return (x->dbl == y->dbl);
+  case LVAL_BIG:
+    return lbig_cmp(x->big, y->big) == 0;
 
   // Comparation for string values
   case LVAL_ERR:
-    return (strcmp(x->err, y->err));
+    return (strcmp(x->err, y->err) == 0);
   case LVAL_SYM:
-    return (strcmp(x->sym, y->sym));
+    return (strcmp(x->sym, y->sym) == 0);
 
   // Comparation for builtin function
   // would compare formals and body
@@ -472,7 +923,11 @@ int lval_eq(lval *x, lval *y) {
     if (x->builtin || y->builtin) {
       return x->builtin == y->builtin;
     }
-    return lval_eq(x->formals, x->formals) && lval_eq(x->body, y->body);
+    if (x->memo || y->memo) {
+      return x->memo == y->memo;
+    }
+    return lval_eq(x->formals, y->formals) &&
+           lval_eq(x->src ? x->src : x->body, y->src ? y->src : y->body);
 
   // Comparation for list would
   // compare individual element
@@ -488,55 +943,212 @@ int lval_eq(lval *x, lval *y) {
 
     return 1;
     break;
+
+  case LVAL_VEC:
+    return x->count == y->count &&
+           memcmp(x->vec, y->vec, sizeof(int64_t) * x->count) == 0;
+
+  case LVAL_STR:
+    return x->slen == y->slen &&
+           memcmp(lval_str_ptr(x), lval_str_ptr(y), x->slen) == 0;
+
+  // Dictionaries are equal when they hold the same pairs
+  case LVAL_DICT: {
+    if (x->dict == y->dict)
+      return 1;
+
+    lval *items = lval_dict_items(x, 1, 1);
+    int eq = items->count / 2 == ldict_table(y->dict)->count;
+
+    for (int i = 0; eq && i < items->count; i += 2) {
+      lval *v = ldict_get(y->dict, items->cell[i]);
+      eq = v && lval_eq(items->cell[i + 1], v);
+    }
+
+    lval_del(items);
+    return eq;
+  }
+
+  // Sequences are only equal to themselves and their copies
+  case LVAL_SEQ:
+    return x->seq == y->seq;
+
+  case LVAL_CELL:
+    return x->rcell == y->rcell;
+
+  case LVAL_FUTURE:
+    return x->fut == y->fut;
+
+  case LVAL_CHAN:
+    return x->chan == y->chan;
   }
 
   return 0;
 }
 
+// Mix the bytes into hash, taken from FNV-1a
+uint64_t lhash_mix(uint64_t h, const void *p, size_t n) {
+  const unsigned char *b = p;
+  for (size_t i = 0; i < n; i++) {
+    h ^= b[i];
+    h *= 1099511628211ULL;
+  }
+  return h;
+}
+
+// Hash of the structure of lval, values which are equal by
+// lval_eq always get the same hash
+uint64_t lval_hash(lval *v) {
+  uint64_t h = 14695981039346656037ULL;
+
+  // Numbers hash by their value so 1 and 1.0 collide on purpose. A
+  // double equals a long only when integral and in its range, and
+  // equals a bignum only when that converts to the same double.
+  if (lval_numeric(v)) {
+    if (v->type == LVAL_NUM)
+      return lhash_mix(h, &v->num, sizeof(v->num));
+
+    double d = lval_to_dbl(v);
+    if (v->type == LVAL_DBL && d >= -0x1p63 && d < 0x1p63 && d == trunc(d)) {
+      long n = (long)d;
+      return lhash_mix(h, &n, sizeof(n));
+    }
+    return lhash_mix(h, &d, sizeof(d));
+  }
+
+  h = lhash_mix(h, &v->type, sizeof(v->type));
+
+  switch (v->type) {
+  case LVAL_ERR:
+    return lhash_mix(h, v->err, strlen(v->err));
+
+  case LVAL_SYM:
+    return lhash_mix(h, v->sym, strlen(v->sym));
+
+  case LVAL_FUNC:
+    if (v->builtin)
+      return lhash_mix(h, &v->builtin, sizeof(v->builtin));
+    if (v->memo)
+      return lhash_mix(h, &v->memo, sizeof(v->memo));
+    h ^= lval_hash(v->formals);
+    return lhash_mix(h, &h, sizeof(h)) ^ lval_hash(v->src ? v->src : v->body);
+
+  case LVAL_SEXPR:
+  case LVAL_QEXPR:
+    for (int i = 0; i < v->count; i++) {
+      uint64_t c = lval_hash(v->cell[i]);
+      h = lhash_mix(h, &c, sizeof(c));
+    }
+    return h;
+
+  case LVAL_VEC:
+    return lhash_mix(h, v->vec, sizeof(int64_t) * v->count);
+
+  case LVAL_STR:
+    return lhash_mix(h, lval_str_ptr(v), v->slen);
+
+  // Order of pairs in table does not matter
+  case LVAL_DICT: {
+    lval *items = lval_dict_items(v, 1, 1);
+    uint64_t sum = 0;
+    for (int i = 0; i < items->count; i += 2) {
+      sum += lval_hash(items->cell[i]) * 31 + lval_hash(items->cell[i + 1]);
+    }
+    lval_del(items);
+    return lhash_mix(h, &sum, sizeof(sum));
+  }
+
+  case LVAL_SEQ:
+    return lhash_mix(h, &v->seq, sizeof(v->seq));
+
+  case LVAL_CELL:
+    return lhash_mix(h, &v->rcell, sizeof(v->rcell));
+
+  case LVAL_FUTURE:
+    return lhash_mix(h, &v->fut, sizeof(v->fut));
+
+  case LVAL_CHAN:
+    return lhash_mix(h, &v->chan, sizeof(v->chan));
+  }
+
+  return h;
+}
+
+__thread FILE *lval_out = NULL;
+__thread int *lval_exit = NULL;
+
+FILE *lval_stream(void) { return lval_out ? lval_out : stdout; }
+
+// Print double so it read back the same and still look like a double
+void lval_print_dbl(double d) {
+  char buf[32];
+  snprintf(buf, sizeof(buf), "%.15g", d);
+  if (strtod(buf, NULL) != d)
+    snprintf(buf, sizeof(buf), "%.17g", d);
+
+  if (!strpbrk(buf, ".eni"))
+    strcat(buf, ".0");
+
+  fputs(buf, lval_stream());
+}
+
 // Print the exp type of lval
 void lval_expr_print(lval *v, char open, char close) {
-  putchar(open);
+  fputc(open, lval_stream());
 
   for (int i = 0; i < v->count; i++) {
     lval_print(v->cell[i]);
 
     // Do not print trailing space at last element
     if (i != (v->count - 1)) {
-      putchar(' ');
+      fputc(' ', lval_stream());
     }
   }
 
-  putchar(close);
+  fputc(close, lval_stream());
 }
 
 // Print the `lval`
 void lval_print(lval *v) {
   switch (v->type) {
   case LVAL_NONE:
-    printf("\033[A");
+    fprintf(lval_stream(), "\033[A");
     break;
 
   case LVAL_ERR:
-    printf("Error: %s", v->err);
+    fprintf(lval_stream(), "Error: %s", v->err);
     break;
 
   case LVAL_NUM:
-    printf("%li", v->num);
+    fprintf(lval_stream(), "%li", v->num);
+    break;
+
+  case LVAL_DBL:
+    lval_print_dbl(v->dbl);
+    break;
+
+  case LVAL_BIG: {
+    char *s = lbig_to_str(v->big);
+    fputs(s, lval_stream());
+    free(s);
     break;
+  }
 
   case LVAL_SYM:
-    printf("%s", v->sym);
+    fprintf(lval_stream(), "%s", v->sym);
     break;
 
   case LVAL_FUNC:
     if (v->builtin) {
-      printf("<builtin>");
+      fprintf(lval_stream(), "<builtin>");
+    } else if (v->memo) {
+      fprintf(lval_stream(), "<memo>");
     } else {
-      printf("(\\");
+      fprintf(lval_stream(), "(\\");
       lval_print(v->formals);
-      putchar(' ');
-      lval_print(v->body);
-      printf(")");
+      fputc(' ', lval_stream());
+      lval_print(v->src ? v->src : v->body);
+      fprintf(lval_stream(), ")");
     }
     break;
 
@@ -547,13 +1159,57 @@ void lval_print(lval *v) {
   case LVAL_QEXPR:
     lval_expr_print(v, '{', '}');
     break;
+
+  case LVAL_VEC:
+    fputc('[', lval_stream());
+    for (int i = 0; i < v->count; i++) {
+      fprintf(lval_stream(), i ? " %lli" : "%lli", (long long)v->vec[i]);
+    }
+    fputc(']', lval_stream());
+    break;
+
+  // Print string escaped and quoted the way it is read
+  case LVAL_STR: {
+    char *s = malloc(v->slen + 1);
+    memcpy(s, lval_str_ptr(v), v->slen);
+    s[v->slen] = '\0';
+
+    s = mpcf_escape(s);
+    fprintf(lval_stream(), "\"%s\"", s);
+    free(s);
+    break;
+  }
+
+  case LVAL_DICT: {
+    lval *items = lval_dict_items(v, 1, 1);
+    fputc('#', lval_stream());
+    lval_expr_print(items, '{', '}');
+    lval_del(items);
+    break;
+  }
+
+  case LVAL_SEQ:
+    fprintf(lval_stream(), "<seq>");
+    break;
+
+  case LVAL_CELL:
+    fprintf(lval_stream(), "<cell>");
+    break;
+
+  case LVAL_FUTURE:
+    fprintf(lval_stream(), "<future>");
+    break;
+
+  case LVAL_CHAN:
+    fprintf(lval_stream(), "<chan>");
+    break;
   }
 }
 
 // Print lval value by newline
 void lval_println(lval *v) {
   lval_print(v);
-  putchar('\n');
+  fputc('\n', lval_stream());
 }
 
 /**
@@ -568,10 +1224,12 @@ lval *builtin_head(lenv *e, lval *a) {
   LASSERT_COUNT("head", a, 1);
   LASSERT_NOT_EMPTY("head", a, 0);
 
+  // Delete the rest at once rather than popping one by one
   lval *f = lval_take(a, 0);
-  while (f->count > 1) {
-    lval_del(lval_pop(f, 1));
+  for (int i = 1; i < f->count; i++) {
+    lval_del(f->cell[i]);
   }
+  f->count = 1;
 
   return f;
 }
@@ -608,7 +1266,6 @@ lval *builtin_join(lenv *e, lval *a) {
 
   for (int i = 0; i < a->count; i++) {
     LASSERT_TYPE("join", a, i, LVAL_QEXPR);
-    LASSERT_NOT_EMPTY("eval", a, i);
   }
 
   lval *f = lval_pop(a, 0);
@@ -636,10 +1293,24 @@ lval *builtin_cons(lenv *e, lval *a) {
 }
 
 lval *builtin_len(lenv *e, lval *a) {
-  LASSERT_TYPE("len", a, 0, LVAL_QEXPR);
   LASSERT_COUNT("len", a, 1);
-
-  return lval_num(a->cell[0]->count);
+  LASSERT(a,
+          a->cell[0]->type == LVAL_QEXPR || a->cell[0]->type == LVAL_VEC ||
+              a->cell[0]->type == LVAL_DICT || a->cell[0]->type == LVAL_STR,
+          "Function 'len' passed incorrect type for argument 0. "
+          "Got %s, Expected %s.",
+          ltype_name(a->cell[0]->type), ltype_name(LVAL_QEXPR));
+
+  lval *x = a->cell[0];
+  lval *n;
+  if (x->type == LVAL_DICT)
+    n = lval_num(ldict_table(x->dict)->count);
+  else if (x->type == LVAL_STR)
+    n = lval_num(x->slen);
+  else
+    n = lval_num(x->count);
+  lval_del(a);
+  return n;
 }
 
 // Display the first item of q-expr
@@ -673,7 +1344,7 @@ lval *builtin_var(lenv *e, lval *a, char *func) {
   for (int i = 0; i < syms->count; i++) {
     // Define it locally
     if (strcmp(func, "=") == 0) {
-      lenv_put(e, syms->cell[i], a->cell[i + 1]);
+      lenv_put(lenv_local(e, syms->cell[i]), syms->cell[i], a->cell[i + 1]);
     }
 
     // Define it globally
@@ -693,7 +1364,7 @@ lval *builtin_def(lenv *e, lval *a) { return builtin_var(e, a, "def"); }
 lval *builtin_show(lenv *e, lval *a) {
   for (int i = 0; i < e->count; i++) {
     if (e->vals[i]->type == LVAL_NUM)
-      printf("%s\n", e->syms[i]);
+      fprintf(lval_stream(), "%s\n", e->syms[i]);
   }
 
   lval_del(a);
@@ -706,202 +1377,2226 @@ lval *builtin_exit(lenv *e, lval *a) {
           "Got %i, Expected %i",
           a->count, 0);
 
+  // Inside a context only the context stops
+  if (lval_exit) {
+    *lval_exit = 1;
+    lval_del(a);
+    return lval_err("Exit");
+  }
+
   lenv_del(e);
   lval_del(a);
 
   exit(EXIT_SUCCESS);
 }
 
-lval *builtin_op(lenv *e, lval *a, char *op) {
-  for (int i = 0; i < a->count; i++) {
-    LASSERT_TYPE(op, a, i, LVAL_NUM);
+/**
+ * ----------------------------------------------------------
+ * Vector functions. Arithmetic and comparison over vectors
+ * work element-wise and broadcast numbers to every element,
+ * the loops themselves are the kernels in lvec.c.
+ * ----------------------------------------------------------
+ */
+
+// Kernel operation of the builtin operator, -1 when there is none
+int lvec_opcode(char *op) {
+  char *ops[] = {"+", "-", "*", "/", "%", "<", ">", "<=", ">=", "==", "!="};
+  for (int i = 0; i < (int)(sizeof(ops) / sizeof(ops[0])); i++) {
+    if (strcmp(op, ops[i]) == 0)
+      return i;
   }
+  return -1;
+}
 
-  lval *f = lval_pop(a, 0);
-  if ((strcmp(op, "-") == 0) && a->count == 0) {
-    f->num = -f->num;
+lval *lval_vop_err(int res) {
+  if (res == LVEC_ZERO)
+    return lval_err("Division by zero!");
+  return lval_err("Integer overflow in %s", ltype_name(LVAL_VEC));
+}
+
+// Apply the kernel operation to x and y, both are consumed
+lval *lval_vop(lval *x, lval *y, int op) {
+  if (x->type == LVAL_NUM && y->type == LVAL_NUM) {
+    int64_t r, a = x->num, b = y->num;
+    int res = lvec_op(op, &r, &a, &b, 1, LVEC_NONE);
+    lval_del(y);
+    if (res != LVEC_OK) {
+      lval_del(x);
+      return lval_vop_err(res);
+    }
+    x->num = r;
+    return x;
   }
 
-  while (a->count > 0) {
-    lval *n = lval_pop(a, 0);
+  if (x->type == LVAL_VEC && y->type == LVAL_VEC && x->count != y->count) {
+    lval *err = lval_err("Vector length mismatch. Got %i and %i", x->count,
+                         y->count);
+    lval_del(x);
+    lval_del(y);
+    return err;
+  }
 
-    if (strcmp(op, "+") == 0)
-      f->num += n->num;
+  // Write the result into the buffer of whichever side is a vector
+  lval *r = x->type == LVAL_VEC ? x : y;
+  int bcast = LVEC_NONE;
+  int64_t sx, sy;
 
-    if (strcmp(op, "-") == 0)
-      f->num -= n->num;
+  if (x->type == LVAL_NUM) {
+    sx = x->num;
+    bcast = LVEC_LEFT;
+  }
+  if (y->type == LVAL_NUM) {
+    sy = y->num;
+    bcast = LVEC_RIGHT;
+  }
 
-    if (strcmp(op, "*") == 0)
-      f->num *= n->num;
+  int res = lvec_op(op, r->vec, bcast == LVEC_LEFT ? &sx : x->vec,
+                    bcast == LVEC_RIGHT ? &sy : y->vec, r->count, bcast);
 
-    if (strcmp(op, "/") == 0) {
-      if (n->num == 0) {
-        lval_del(f);
-        lval_del(n);
-        f = lval_err("Division by zero!");
-        break;
-      }
+  lval_del(r == x ? y : x);
+  if (res != LVEC_OK) {
+    lval_del(r);
+    return lval_vop_err(res);
+  }
 
-      f->num /= n->num;
-    }
+  return r;
+}
 
-    if (strcmp(op, "^") == 0)
-      f->num = pow(f->num, n->num);
+lval *builtin_vop(lenv *e, lval *a, char *op) {
+  for (int i = 0; i < a->count; i++) {
+    LASSERT(a, a->cell[i]->type == LVAL_NUM || a->cell[i]->type == LVAL_VEC,
+            "Function '%s' passed incorrect type for argument %i. "
+            "Got %s, Expected %s or %s.",
+            op, i, ltype_name(a->cell[i]->type), ltype_name(LVAL_NUM),
+            ltype_name(LVAL_VEC));
+  }
 
-    if (strcmp(op, "%") == 0) {
-      if (n->num == 0) {
-        lval_del(f);
-        lval_del(n);
-        f = lval_err("Comparable by zero!");
-        break;
-      }
+  int code = lvec_opcode(op);
+  LASSERT(a, code >= 0, "Function '%s' does not support %s", op,
+          ltype_name(LVAL_VEC));
 
-      f->num = f->num % n->num;
-    }
+  lval *f = lval_pop(a, 0);
+
+  // Unary minus negate every element
+  if (code == LVEC_SUB && a->count == 0) {
+    f = lval_vop(lval_num(0), f, LVEC_SUB);
+  }
 
-    lval_del(n);
+  while (a->count > 0 && f->type != LVAL_ERR) {
+    f = lval_vop(f, lval_pop(a, 0), code);
   }
 
   lval_del(a);
   return f;
 }
 
-lval *builtin_add(lenv *e, lval *a) { return builtin_op(e, a, "+"); }
+// Construct vector from q-expr of numbers
+lval *builtin_vec(lenv *e, lval *a) {
+  LASSERT_COUNT("vec", a, 1);
+  LASSERT_TYPE("vec", a, 0, LVAL_QEXPR);
 
-lval *builtin_sub(lenv *e, lval *a) { return builtin_op(e, a, "-"); }
+  lval *l = a->cell[0];
+  for (int i = 0; i < l->count; i++) {
+    LASSERT(a, l->cell[i]->type == LVAL_NUM,
+            "Function 'vec' passed non-number at index %i. Got %s", i,
+            ltype_name(l->cell[i]->type));
+  }
 
-lval *builtin_mul(lenv *e, lval *a) { return builtin_op(e, a, "*"); }
+  lval *v = lval_vec(l->count);
+  for (int i = 0; i < l->count; i++) {
+    v->vec[i] = l->cell[i]->num;
+  }
+
+  lval_del(a);
+  return v;
+}
+
+// Convert vector back to q-expr of numbers
+lval *builtin_unvec(lenv *e, lval *a) {
+  LASSERT_COUNT("unvec", a, 1);
+  LASSERT_TYPE("unvec", a, 0, LVAL_VEC);
+
+  lval *x = a->cell[0];
+  lval *v = lval_qexpr();
+  v->count = x->count;
+  v->cell = malloc(sizeof(lval *) * v->count);
+
+  for (int i = 0; i < v->count; i++) {
+    v->cell[i] = lval_num(x->vec[i]);
+  }
+
+  lval_del(a);
+  return v;
+}
+
+// Exact sum of x, or of the products of x and y when y is given, as
+// the scalar arithmetic would give it
+lval *lval_vsum_big(const int64_t *x, const int64_t *y, long n) {
+  lbig *s = lbig_from_long(0);
+  for (long i = 0; i < n; i++) {
+    lbig *t = lbig_from_long(x[i]);
+    if (y) {
+      lbig *u = lbig_from_long(y[i]);
+      lbig *p = lbig_mul(t, u);
+      free(t);
+      free(u);
+      t = p;
+    }
+
+    lbig *r = lbig_add(s, t);
+    free(s);
+    free(t);
+    s = r;
+  }
+
+  lval *v = malloc(sizeof(lval));
+  v->type = LVAL_BIG;
+  v->big = s;
+  return lval_norm(v);
+}
+
+// Reduce vector into single number
+lval *builtin_reduce(lenv *e, lval *a, char *func) {
+  LASSERT_COUNT(func, a, 1);
+  LASSERT_TYPE(func, a, 0, LVAL_VEC);
+
+  lval *x = a->cell[0];
+  int64_t r;
+
+  if (strcmp(func, "sum") == 0) {
+    if (!lvec_sum(x->vec, x->count, &r)) {
+      lval *v = lval_vsum_big(x->vec, NULL, x->count);
+      lval_del(a);
+      return v;
+    }
+  } else {
+    LASSERT(a, x->count != 0, "Function '%s' passed empty %s", func,
+            ltype_name(LVAL_VEC));
+    r = strcmp(func, "min") == 0 ? lvec_min(x->vec, x->count)
+                                 : lvec_max(x->vec, x->count);
+  }
+
+  lval_del(a);
+  return lval_num(r);
+}
+
+lval *builtin_sum(lenv *e, lval *a) { return builtin_reduce(e, a, "sum"); }
+
+lval *builtin_min(lenv *e, lval *a) { return builtin_reduce(e, a, "min"); }
+
+lval *builtin_max(lenv *e, lval *a) { return builtin_reduce(e, a, "max"); }
+
+lval *builtin_dot(lenv *e, lval *a) {
+  LASSERT_COUNT("dot", a, 2);
+  LASSERT_TYPE("dot", a, 0, LVAL_VEC);
+  LASSERT_TYPE("dot", a, 1, LVAL_VEC);
+  LASSERT(a, a->cell[0]->count == a->cell[1]->count,
+          "Vector length mismatch. Got %i and %i", a->cell[0]->count,
+          a->cell[1]->count);
+
+  lval *x = a->cell[0];
+  lval *y = a->cell[1];
+  int64_t r;
+  lval *v = lvec_dot(x->vec, y->vec, x->count, &r)
+                ? lval_num(r)
+                : lval_vsum_big(x->vec, y->vec, x->count);
+  lval_del(a);
+  return v;
+}
+
+// Raise integer to non-negative power by squaring,
+// return 0 when the result does not fit into long
+int lnum_pow(long b, long n, long *r) {
+  long acc = 1;
+  while (n > 0) {
+    if ((n & 1) && __builtin_mul_overflow(acc, b, &acc))
+      return 0;
+    n >>= 1;
+    if (n && __builtin_mul_overflow(b, b, &b))
+      return 0;
+  }
+  *r = acc;
+  return 1;
+}
+
+// Apply the operator on integers, at least one of them is bignum
+lval *lval_big_op(lval *f, lval *n, char o) {
+  lbig *x = lval_to_big(f);
+  lbig *y = lval_to_big(n);
+  lbig *r = NULL;
+
+  switch (o) {
+  case '+':
+    r = lbig_add(x, y);
+    break;
+  case '-':
+    r = lbig_sub(x, y);
+    break;
+  case '*':
+    r = lbig_mul(x, y);
+    break;
+  case '/':
+    r = lbig_div(x, y, NULL);
+    break;
+  case '%':
+    free(lbig_div(x, y, &r));
+    break;
+  case '^':
+    r = lbig_pow(x, n->num);
+    break;
+  }
+
+  free(x);
+  free(y);
+
+  if (f->type == LVAL_BIG)
+    free(f->big);
+
+  f->type = LVAL_BIG;
+  f->big = r;
+  return f;
+}
+
+lval *builtin_op(lenv *e, lval *a, char *op) {
+  for (int i = 0; i < a->count; i++) {
+    if (a->cell[i]->type == LVAL_VEC)
+      return builtin_vop(e, a, op);
+  }
+
+  for (int i = 0; i < a->count; i++) {
+    LASSERT_NUMERIC(op, a, i);
+  }
+
+  // The first argument hold the result so no value is allocated
+  // while folding, the rest are read in place and deleted at once
+  char o = op[0];
+  lval *f = lval_pop(a, 0);
+
+  if (o == '-' && a->count == 0) {
+    if (f->type == LVAL_DBL)
+      f->dbl = -f->dbl;
+    else if (f->type == LVAL_NUM && f->num != LONG_MIN)
+      f->num = -f->num;
+    else {
+      lval *m = lval_num(-1);
+      lval_big_op(f, m, '*');
+      lval_del(m);
+    }
+  }
+
+  for (int i = 0; i < a->count; i++) {
+    lval *n = a->cell[i];
+
+    // Both are integers, stay on long while it does not overflow
+    if (f->type == LVAL_NUM && n->type == LVAL_NUM) {
+      long r;
+
+      switch (o) {
+      case '+':
+        if (__builtin_add_overflow(f->num, n->num, &r))
+          break;
+        f->num = r;
+        continue;
+      case '-':
+        if (__builtin_sub_overflow(f->num, n->num, &r))
+          break;
+        f->num = r;
+        continue;
+      case '*':
+        if (__builtin_mul_overflow(f->num, n->num, &r))
+          break;
+        f->num = r;
+        continue;
+      case '/':
+        if (n->num == 0) {
+          lval_del(f);
+          lval_del(a);
+          return lval_err("Division by zero!");
+        }
+        if (f->num == LONG_MIN && n->num == -1)
+          break;
+        f->num /= n->num;
+        continue;
+      case '%':
+        if (n->num == 0) {
+          lval_del(f);
+          lval_del(a);
+          return lval_err("Comparable by zero!");
+        }
+        f->num = n->num == -1 ? 0 : f->num % n->num;
+        continue;
+      case '^':
+        // Negative exponent has fractional result
+        if (n->num < 0) {
+          f->type = LVAL_DBL;
+          f->dbl = pow(f->num, n->num);
+          continue;
+        }
+        if (!lnum_pow(f->num, n->num, &r))
+          break;
+        f->num = r;
+        continue;
+      }
+
+      // Overflowed, redo it on bignum
+      lval_big_op(f, n, o);
+      continue;
+    }
+
+    // Bignum on either side and no double
+    if (f->type != LVAL_DBL && n->type != LVAL_DBL) {
+      if ((o == '/' || o == '%') && n->type == LVAL_NUM && n->num == 0) {
+        lval_del(f);
+        lval_del(a);
+        return lval_err(o == '/' ? "Division by zero!" : "Comparable by zero!");
+      }
+
+      if (o == '^' && (n->type == LVAL_BIG || n->num < 0)) {
+        if (n->type == LVAL_BIG) {
+          lval_del(f);
+          lval_del(a);
+          return lval_err("Exponent is too large");
+        }
+        double d = lval_to_dbl(f);
+        lval_del(lval_norm(f));
+        f = lval_dbl(pow(d, n->num));
+        continue;
+      }
+
+      lval_big_op(f, n, o);
+      continue;
+    }
+
+    // Otherwise promote both to double
+    if (f->type != LVAL_DBL) {
+      double d = lval_to_dbl(f);
+      if (f->type == LVAL_BIG)
+        free(f->big);
+      f->type = LVAL_DBL;
+      f->dbl = d;
+    }
+    double d = lval_to_dbl(n);
+
+    switch (o) {
+    case '+':
+      f->dbl += d;
+      break;
+    case '-':
+      f->dbl -= d;
+      break;
+    case '*':
+      f->dbl *= d;
+      break;
+    case '/':
+      if (d == 0) {
+        lval_del(f);
+        lval_del(a);
+        return lval_err("Division by zero!");
+      }
+      f->dbl /= d;
+      break;
+    case '%':
+      if (d == 0) {
+        lval_del(f);
+        lval_del(a);
+        return lval_err("Comparable by zero!");
+      }
+      f->dbl = fmod(f->dbl, d);
+      break;
+    case '^':
+      f->dbl = pow(f->dbl, d);
+      break;
+    }
+  }
+
+  lval_del(a);
+  return lval_norm(f);
+}
+
+lval *builtin_add(lenv *e, lval *a) { return builtin_op(e, a, "+"); }
+
+lval *builtin_sub(lenv *e, lval *a) { return builtin_op(e, a, "-"); }
+
+lval *builtin_mul(lenv *e, lval *a) { return builtin_op(e, a, "*"); }
 
 lval *builtin_div(lenv *e, lval *a) { return builtin_op(e, a, "/"); }
 
-lval *builtin_pow(lenv *e, lval *a) { return builtin_op(e, a, "^"); }
+lval *builtin_pow(lenv *e, lval *a) { return builtin_op(e, a, "^"); }
+
+lval *builtin_dif(lenv *e, lval *a) { return builtin_op(e, a, "%"); }
+
+lval *builtin_ord(lenv *e, lval *a, char *op) {
+  LASSERT_COUNT(op, a, 2);
+
+  if (a->cell[0]->type == LVAL_VEC || a->cell[1]->type == LVAL_VEC)
+    return builtin_vop(e, a, op);
+
+  LASSERT_NUMERIC(op, a, 0);
+  LASSERT_NUMERIC(op, a, 1);
+
+  int c = lval_num_cmp(a->cell[0], a->cell[1]);
+  int r = 0;
+
+  if (strcmp(op, ">") == 0) {
+    r = c > 0;
+  }
+
+  if (strcmp(op, ">=") == 0) {
+    r = c >= 0;
+  }
+
+  if (strcmp(op, "<") == 0) {
+    r = c < 0;
+  }
+
+  if (strcmp(op, "<=") == 0) {
+    r = c <= 0;
+  }
+
+  lval_del(a);
+  return lval_num(r);
+}
+
+lval *builtin_gt(lenv *e, lval *a) { return builtin_ord(e, a, ">"); }
+
+lval *builtin_ge(lenv *e, lval *a) { return builtin_ord(e, a, ">="); }
+
+lval *builtin_lt(lenv *e, lval *a) { return builtin_ord(e, a, "<"); }
+
+lval *builtin_le(lenv *e, lval *a) { return builtin_ord(e, a, "<="); }
+
+lval *builtin_cmp(lenv *e, lval *a, char *op) {
+  LASSERT_COUNT(op, a, 2);
+
+  if (a->cell[0]->type == LVAL_VEC || a->cell[1]->type == LVAL_VEC)
+    return builtin_vop(e, a, op);
+
+  int r;
+
+  if (strcmp(op, "==") == 0) {
+    r = lval_eq(a->cell[0], a->cell[1]);
+  }
+
+  if (strcmp(op, "!=") == 0) {
+    r = !lval_eq(a->cell[0], a->cell[1]);
+  }
+
+  lval_del(a);
+  return lval_num(r);
+}
+
+lval *builtin_eq(lenv *e, lval *a) { return builtin_cmp(e, a, "=="); }
+
+lval *builtin_ne(lenv *e, lval *a) { return builtin_cmp(e, a, "!="); }
+
+// Evaluate operand of logical function, quoted operand is evaluated
+// as expression, and the result must be a number to be used as truth
+lval *lval_truth(lenv *e, char *op, lval *x, int *r) {
+  if (x->type == LVAL_QEXPR)
+    x->type = LVAL_SEXPR;
+
+  x = lval_eval(e, x);
+  if (x->type == LVAL_ERR)
+    return x;
+
+  if (x->type != LVAL_NUM) {
+    lval *err = lval_err("Function '%s' passed incorrect type. "
+                         "Got %s, Expected %s",
+                         op, ltype_name(x->type), ltype_name(LVAL_NUM));
+    lval_del(x);
+    return err;
+  }
+
+  *r = x->num != 0;
+  lval_del(x);
+  return NULL;
+}
+
+// Operands are evaluated in order until one decides the result,
+// which is false for "and" and true for "or"
+lval *builtin_lgc(lenv *e, lval *a, char *op) {
+  int stop = strcmp(op, "or") == 0;
+  int r = !stop;
+
+  while (a->count) {
+    lval *err = lval_truth(e, op, lval_pop(a, 0), &r);
+    if (err) {
+      lval_del(a);
+      return err;
+    }
+
+    if (r == stop)
+      break;
+  }
+
+  lval_del(a);
+  return lval_num(r);
+}
+
+lval *builtin_and(lenv *e, lval *a) { return builtin_lgc(e, a, "and"); }
+
+lval *builtin_or(lenv *e, lval *a) { return builtin_lgc(e, a, "or"); }
+
+lval *builtin_not(lenv *e, lval *a) {
+  LASSERT_COUNT("not", a, 1);
+
+  int r;
+  lval *err = lval_truth(e, "not", lval_pop(a, 0), &r);
+  lval_del(a);
+  if (err)
+    return err;
+
+  return lval_num(!r);
+}
+
+lval *builtin_if(lenv *e, lval *a) {
+  LASSERT_COUNT("if", a, 3);
+  LASSERT_TYPE("if", a, 0, LVAL_NUM);
+  LASSERT_TYPE("if", a, 1, LVAL_QEXPR);
+  LASSERT_TYPE("if", a, 2, LVAL_QEXPR);
+
+  // Change both QEXPR expression
+  // to SEXPR so it evaluable
+  a->cell[1]->type = LVAL_SEXPR;
+  a->cell[2]->type = LVAL_SEXPR;
+
+  lval *x;
+
+  // If condition is set as true
+  // then evaluate first expression
+  // otherwise evaluate the second
+  if (a->cell[0]->num) {
+    x = lval_eval(e, lval_pop(a, 1));
+  } else {
+    x = lval_eval(e, lval_pop(a, 2));
+  }
+
+  lval_del(a);
+  return x;
+}
+
+// Bind each {symbol expression} pair in one new frame, in order so
+// later expressions see earlier symbols, then evaluate the body there
+lval *builtin_let(lenv *e, lval *a) {
+  LASSERT_COUNT("let", a, 2);
+  LASSERT_TYPE("let", a, 0, LVAL_QEXPR);
+  LASSERT_TYPE("let", a, 1, LVAL_QEXPR);
+
+  lval *binds = a->cell[0];
+  for (int i = 0; i < binds->count; i++) {
+    lval *b = binds->cell[i];
+    LASSERT(a,
+            b->type == LVAL_QEXPR && b->count == 2 &&
+                b->cell[0]->type == LVAL_SYM,
+            "Function 'let' binding %i is not {symbol expression}", i);
+  }
+
+  lenv *frame = lenv_new();
+  frame->par = e;
+
+  for (int i = 0; i < binds->count; i++) {
+    lval *x = lval_eval_expr(frame, binds->cell[i]->cell[1]);
+    if (x->type == LVAL_ERR) {
+      lenv_del(frame);
+      lval_del(a);
+      return x;
+    }
+
+    lenv_put(frame, binds->cell[i]->cell[0], x);
+    lval_del(x);
+  }
+
+  a->cell[1]->type = LVAL_SEXPR;
+  lval *r = lval_eval_expr(frame, a->cell[1]);
+
+  lenv_del(frame);
+  lval_del(a);
+  return r;
+}
+
+// Evaluate the expression of the first {test expression} clause
+// whose test is true, clauses after it are never evaluated
+lval *builtin_cond(lenv *e, lval *a) {
+  for (int i = 0; i < a->count; i++) {
+    LASSERT(a, a->cell[i]->type == LVAL_QEXPR && a->cell[i]->count == 2,
+            "Function 'cond' clause %i is not {test expression}", i);
+  }
+
+  for (int i = 0; i < a->count; i++) {
+    lval *t = lval_eval_expr(e, a->cell[i]->cell[0]);
+    if (t->type == LVAL_ERR) {
+      lval_del(a);
+      return t;
+    }
+
+    int hit = t->type == LVAL_NUM && t->num;
+    lval_del(t);
+
+    if (hit) {
+      // Quoted expression is evaluated as code, as the branches of if
+      lval *x = a->cell[i]->cell[1];
+      if (x->type == LVAL_QEXPR)
+        x->type = LVAL_SEXPR;
+
+      lval *r = lval_eval_expr(e, x);
+      lval_del(a);
+      return r;
+    }
+  }
+
+  lval_del(a);
+  return lval_sexpr();
+}
+
+// Arguments are already evaluated in order, return the last one
+lval *builtin_do(lenv *e, lval *a) {
+  if (a->count == 0)
+    return a;
+
+  return lval_take(a, a->count - 1);
+}
+
+/**
+ * ---------------------------------------------------------------
+ * Loop functions. Condition and body are q-exprs evaluated again
+ * on every iteration straight from the arguments, loop variables
+ * live in one frame which is updated in place.
+ * ---------------------------------------------------------------
+ */
+
+// Check that q-expr holds a single symbol to bind the loop value to
+lval *lval_loop_var(lval *a, char *func) {
+  lval *x = a->cell[0];
+  if (x->count != 1 || x->cell[0]->type != LVAL_SYM) {
+    lval *err = lval_err("Function '%s' expects single symbol to bind. "
+                         "Got %i elements",
+                         func, x->count);
+    lval_del(a);
+    return err;
+  }
+  return NULL;
+}
+
+lval *builtin_while(lenv *e, lval *a) {
+  LASSERT_COUNT("while", a, 2);
+  LASSERT_TYPE("while", a, 0, LVAL_QEXPR);
+  LASSERT_TYPE("while", a, 1, LVAL_QEXPR);
+
+  lval *cond = a->cell[0];
+  lval *body = a->cell[1];
+  cond->type = LVAL_SEXPR;
+  body->type = LVAL_SEXPR;
+
+  while (1) {
+    lval *c = lval_eval_expr(e, cond);
+    if (c->type == LVAL_ERR) {
+      lval_del(a);
+      return c;
+    }
+
+    int go = c->type == LVAL_NUM && c->num;
+    lval_del(c);
+    if (!go)
+      break;
+
+    lval *r = lval_eval_expr(e, body);
+    if (r->type == LVAL_ERR) {
+      lval_del(a);
+      return r;
+    }
+    lval_del(r);
+  }
+
+  lval_del(a);
+  return lval_sexpr();
+}
+
+// Evaluate body once per value with the symbol bound to it
+lval *lval_loop(lenv *e, lval *sym, lval **vals, long n, lval *body) {
+  lenv *frame = lenv_new();
+  frame->par = e;
+  frame->loop = 1;
+
+  body->type = LVAL_SEXPR;
+  lval *r = NULL;
+
+  for (long i = 0; i < n; i++) {
+    lval *x = vals ? vals[i] : lval_num(i);
+    lenv_put(frame, sym, x);
+    if (!vals)
+      lval_del(x);
+
+    r = lval_eval_expr(frame, body);
+    if (r->type == LVAL_ERR)
+      break;
+
+    lval_del(r);
+    r = NULL;
+  }
+
+  lenv_del(frame);
+  return r ? r : lval_sexpr();
+}
+
+lval *builtin_dotimes(lenv *e, lval *a) {
+  LASSERT_COUNT("dotimes", a, 3);
+  LASSERT_TYPE("dotimes", a, 0, LVAL_QEXPR);
+  LASSERT_TYPE("dotimes", a, 1, LVAL_NUM);
+  LASSERT_TYPE("dotimes", a, 2, LVAL_QEXPR);
+
+  lval *err = lval_loop_var(a, "dotimes");
+  if (err)
+    return err;
+
+  lval *r =
+      lval_loop(e, a->cell[0]->cell[0], NULL, a->cell[1]->num, a->cell[2]);
+  lval_del(a);
+  return r;
+}
+
+lval *builtin_for_each(lenv *e, lval *a) {
+  LASSERT_COUNT("for-each", a, 3);
+  LASSERT_TYPE("for-each", a, 0, LVAL_QEXPR);
+  LASSERT_TYPE("for-each", a, 1, LVAL_QEXPR);
+  LASSERT_TYPE("for-each", a, 2, LVAL_QEXPR);
+
+  lval *err = lval_loop_var(a, "for-each");
+  if (err)
+    return err;
+
+  lval *l = a->cell[1];
+  lval *r = lval_loop(e, a->cell[0]->cell[0], l->cell, l->count, a->cell[2]);
+  lval_del(a);
+  return r;
+}
+
+lval *builtin_lambda(lenv *e, lval *a) {
+  LASSERT_COUNT("\\", a, 2);
+  LASSERT_TYPE("\\", a, 0, LVAL_QEXPR);
+  LASSERT_TYPE("\\", a, 1, LVAL_QEXPR);
+
+  for (int i = 0; i < a->cell[0]->count; i++) {
+    LASSERT(a, a->cell[0]->cell[i]->type == LVAL_SYM,
+            "Cannot define non-symbol. Got %s, Expected %s",
+            ltype_name(a->cell[0]->cell[i]->type), ltype_name(LVAL_SYM));
+  }
+
+  lval *formals = lval_pop(a, 0);
+  lval *body = lval_pop(a, 0);
+  lval_del(a);
+
+  lval *f = lval_lambda(formals, body);
+  lopt_lambda(e, f);
+  return f;
+}
+
+lval *builtin_func(lenv *e, lval *a) {
+  LASSERT_COUNT("func", a, 2);
+  LASSERT_TYPE("func", a, 0, LVAL_QEXPR);
+  LASSERT_TYPE("func", a, 1, LVAL_QEXPR);
+
+  lval *func_args = lval_pop(a, 0);
+  lval *func_body = lval_pop(a, 0);
+
+  lval *ff_args = lval_pop(func_args, 0);
+  lval *ff_body = lval_copy(func_args);
+
+  lval *f = lval_lambda(ff_body, func_body);
+  lopt_lambda(e, f);
+  lenv_def(e, ff_args, f);
+
+  lval_del(f);
+  lval_del(func_args);
+  lval_del(ff_args);
+  lval_del(a);
+
+  return lval_sexpr();
+}
+
+/**
+ * ----------------------------------------------------------
+ * Lazy sequence functions. Transforms only add a stage to
+ * the sequence, elements are produced one at a time when it
+ * is collected or folded, passing through all stages at once.
+ * ----------------------------------------------------------
+ */
+
+lval *lval_seq(lseq *s) {
+  lval *v = malloc(sizeof(lval));
+  v->type = LVAL_SEQ;
+  v->seq = s;
+  return v;
+}
+
+// Take the sequence out of argument, a list becomes its source
+lseq *lval_seq_of(lval *a, int i) {
+  lval *x = a->cell[i];
+  if (x->type == LVAL_SEQ) {
+    x->seq->ref++;
+    return x->seq;
+  }
+
+  a->cell[i] = lval_num(0);
+  return lseq_new(LSEQ_LIST, NULL, x);
+}
+
+#define LASSERT_SEQ(func, args, index)                                         \
+  LASSERT(args,                                                                \
+          args->cell[index]->type == LVAL_SEQ ||                               \
+              args->cell[index]->type == LVAL_QEXPR,                           \
+          "Function '%s' passed incorrect type for argument %i. "              \
+          "Got %s, Expected %s.",                                              \
+          func, index, ltype_name(args->cell[index]->type),                    \
+          ltype_name(LVAL_SEQ))
+
+lval *builtin_lrange(lenv *e, lval *a) {
+  LASSERT(a, a->count == 2 || a->count == 3,
+          "Function 'lrange' passed %i arguments. Expected 2 or 3", a->count);
+
+  for (int i = 0; i < a->count; i++) {
+    LASSERT_TYPE("lrange", a, i, LVAL_NUM);
+  }
+
+  lseq *s = lseq_new(LSEQ_RANGE, NULL, NULL);
+  s->start = a->cell[0]->num;
+  s->end = a->cell[1]->num;
+  s->step = a->count == 3 ? a->cell[2]->num : 1;
+
+  if (s->step == 0) {
+    lseq_release(s);
+    lval_del(a);
+    return lval_err("Function 'lrange' passed step of 0");
+  }
+
+  lval_del(a);
+  return lval_seq(s);
+}
+
+lval *builtin_lstage(lenv *e, lval *a, char *func, int kind) {
+  LASSERT_COUNT(func, a, 2);
+  if (kind == LSEQ_MAP || kind == LSEQ_FILTER) {
+    LASSERT_TYPE(func, a, 0, LVAL_FUNC);
+  } else {
+    LASSERT_TYPE(func, a, 0, LVAL_NUM);
+  }
+  LASSERT_SEQ(func, a, 1);
+
+  lseq *src = lval_seq_of(a, 1);
+  lseq *s;
+
+  if (kind == LSEQ_MAP || kind == LSEQ_FILTER) {
+    s = lseq_new(kind, src, lval_pop(a, 0));
+  } else {
+    s = lseq_new(kind, src, NULL);
+    s->start = a->cell[0]->num;
+  }
+
+  lval_del(a);
+  return lval_seq(s);
+}
+
+lval *builtin_lmap(lenv *e, lval *a) {
+  return builtin_lstage(e, a, "lmap", LSEQ_MAP);
+}
+
+lval *builtin_lfilter(lenv *e, lval *a) {
+  return builtin_lstage(e, a, "lfilter", LSEQ_FILTER);
+}
+
+lval *builtin_take(lenv *e, lval *a) {
+  return builtin_lstage(e, a, "take", LSEQ_TAKE);
+}
+
+lval *builtin_drop(lenv *e, lval *a) {
+  return builtin_lstage(e, a, "drop", LSEQ_DROP);
+}
+
+lval *builtin_collect(lenv *e, lval *a) {
+  LASSERT_COUNT("collect", a, 1);
+  LASSERT_SEQ("collect", a, 0);
+
+  if (a->cell[0]->type == LVAL_QEXPR)
+    return lval_take(a, 0);
+
+  lseq_iter it;
+  lseq_iter_init(&it, a->cell[0]->seq);
+
+  lval *v = lval_qexpr();
+  int cap = 0;
+  lval *x;
+
+  while ((x = lseq_next(e, &it))) {
+    if (x->type == LVAL_ERR) {
+      lval_del(v);
+      v = x;
+      break;
+    }
+
+    if (v->count == cap) {
+      cap = cap ? cap * 2 : 8;
+      v->cell = realloc(v->cell, sizeof(lval *) * cap);
+    }
+    v->cell[v->count++] = x;
+  }
+
+  lseq_iter_free(&it);
+  lval_del(a);
+  return v;
+}
+
+// Fold elements of sequence from left as they are produced
+lval *lval_fold_seq(lenv *e, lval *a) {
+  lseq_iter it;
+  lseq_iter_init(&it, a->cell[2]->seq);
+
+  lval *f = a->cell[0];
+  lval *acc = lval_pop(a, 1);
+  lval *x;
+
+  while (acc->type != LVAL_ERR && (x = lseq_next(e, &it))) {
+    if (x->type == LVAL_ERR) {
+      lval_del(acc);
+      acc = x;
+      break;
+    }
+
+    acc = lval_apply(e, f, lval_args(acc, x));
+  }
+
+  lseq_iter_free(&it);
+  lval_del(a);
+  return acc;
+}
+
+/**
+ * ---------------------------------------------------------
+ * Higher order functions. These walk the cell array of the
+ * given q-expr directly and move each element into the call
+ * instead of slicing the list with head/tail on every step.
+ * ---------------------------------------------------------
+ */
+
+// Call the function with given arguments without consuming the
+// function itself, so the same lval can be applied many times
+lval *lval_apply(lenv *e, lval *f, lval *a) {
+  // Builtin goes straight to its C implementation
+  if (f->builtin) {
+    return f->builtin(e, a);
+  }
+
+  if (f->memo) {
+    return lval_memo_call(e, f, a);
+  }
+
+  lopt_check(e, f);
+
+  lval *r = lspec_call(e, f, a);
+  if (r) {
+    return r;
+  }
+
+  // Variadic or partially applied call use the generic path
+  // which need its own copy since it pop the formals, and so does
+  // an empty body for the error it reports
+  int variadic = 0;
+  for (int i = 0; i < f->formals->count; i++) {
+    if (strcmp(f->formals->cell[i]->sym, "&") == 0)
+      variadic = 1;
+  }
+
+  if (variadic || a->count != f->formals->count || !f->body->count) {
+    lval *c = lval_copy(f);
+    r = lval_call(e, c, a);
+    lval_del(c);
+    return r;
+  }
+
+  // Same guard as lval_call
+  if (!f->env->count && a->count == f->formals->count && f->body->count &&
+      leff_frame(e, f)) {
+    return lval_frame_call(e, f, a);
+  }
+
+  // Bind the arguments into a fresh frame, the frame start
+  // from the bindings of partially applied function if any
+  lenv *frame = f->env->count ? lenv_copy(f->env) : lenv_new();
+  frame->par = e;
+
+  for (int i = 0; i < a->count; i++) {
+    lenv_put(frame, f->formals->cell[i], a->cell[i]);
+  }
+  lval_del(a);
+
+  r = lval_body(frame, f);
+  lenv_del(frame);
+  return r;
+}
+
+// Construct argument list from one or two values
+lval *lval_args(lval *x, lval *y) {
+  lval *a = lval_sexpr();
+  a->count = y ? 2 : 1;
+  a->cell = malloc(sizeof(lval *) * a->count);
+  a->cell[0] = x;
+  if (y)
+    a->cell[1] = y;
+  return a;
+}
+
+// Delete the remaining elements of list starting from index i
+void lval_del_from(lval *v, int i) {
+  for (; i < v->count; i++) {
+    lval_del(v->cell[i]);
+  }
+
+  free(v->cell);
+  v->cell = NULL;
+  v->count = 0;
+}
+
+lval *builtin_map(lenv *e, lval *a) {
+  LASSERT_COUNT("map", a, 2);
+  LASSERT_TYPE("map", a, 0, LVAL_FUNC);
+  LASSERT_TYPE("map", a, 1, LVAL_QEXPR);
+
+  lval *f = a->cell[0];
+  lval *l = a->cell[1];
+
+  // Result is written back into the same cell array
+  for (int i = 0; i < l->count; i++) {
+    lval *r = lval_apply(e, f, lval_args(l->cell[i], NULL));
+
+    if (r->type == LVAL_ERR) {
+      l->cell[i] = lval_num(0);
+      lval_del(a);
+      return r;
+    }
+
+    l->cell[i] = r;
+  }
+
+  return lval_take(a, 1);
+}
+
+lval *builtin_filter(lenv *e, lval *a) {
+  LASSERT_COUNT("filter", a, 2);
+  LASSERT_TYPE("filter", a, 0, LVAL_FUNC);
+  LASSERT_TYPE("filter", a, 1, LVAL_QEXPR);
+
+  lval *f = a->cell[0];
+  lval *l = a->cell[1];
+
+  // Keep the matching elements in place and compact as we go
+  int n = 0;
+  for (int i = 0; i < l->count; i++) {
+    lval *r = lval_apply(e, f, lval_args(lval_copy(l->cell[i]), NULL));
+
+    if (r->type == LVAL_ERR) {
+      l->count = n;
+      lval_del_from(l, i);
+      lval_del(a);
+      return r;
+    }
+
+    if (r->type == LVAL_NUM && r->num) {
+      l->cell[n++] = l->cell[i];
+    } else {
+      lval_del(l->cell[i]);
+    }
+
+    lval_del(r);
+  }
+
+  l->count = n;
+  return lval_take(a, 1);
+}
+
+// Fold the list with the function, from left or from right
+lval *builtin_fold(lenv *e, lval *a, char *func) {
+  LASSERT_COUNT(func, a, 3);
+  LASSERT_TYPE(func, a, 0, LVAL_FUNC);
+
+  int left = strcmp(func, "foldl") == 0;
+  if (left && a->cell[2]->type == LVAL_SEQ)
+    return lval_fold_seq(e, a);
+
+  LASSERT_TYPE(func, a, 2, LVAL_QEXPR);
+
+  lval *f = a->cell[0];
+  lval *l = a->cell[2];
+  lval *acc = a->cell[1];
+
+  for (int i = 0; i < l->count; i++) {
+    int j = left ? i : l->count - 1 - i;
+    lval *x = l->cell[j];
+    l->cell[j] = NULL;
+
+    acc = lval_apply(e, f, left ? lval_args(acc, x) : lval_args(x, acc));
+
+    if (acc->type == LVAL_ERR) {
+      break;
+    }
+  }
+
+  // Elements and initial value are now owned by the calls
+  for (int i = 0; i < l->count; i++) {
+    if (l->cell[i])
+      lval_del(l->cell[i]);
+  }
+  l->count = 0;
+
+  a->cell[1] = lval_num(0);
+  lval_del(a);
+  return acc;
+}
+
+lval *builtin_foldl(lenv *e, lval *a) { return builtin_fold(e, a, "foldl"); }
+
+lval *builtin_foldr(lenv *e, lval *a) { return builtin_fold(e, a, "foldr"); }
+
+// Map running on the threads of the pool when f is isolated, otherwise
+// the same as map
+lval *builtin_pmap(lenv *e, lval *a) {
+  LASSERT_COUNT("pmap", a, 2);
+  LASSERT_TYPE("pmap", a, 0, LVAL_FUNC);
+  LASSERT_TYPE("pmap", a, 1, LVAL_QEXPR);
+
+  lval *err = NULL;
+  if (!lpar_map(e, a->cell[0], a->cell[1], &err))
+    return builtin_map(e, a);
+
+  if (err) {
+    lval_del(a);
+    return err;
+  }
+  return lval_take(a, 1);
+}
+
+// List of the values of body for each element bound to the symbol,
+// computed in parallel when the body is isolated
+lval *builtin_pfor(lenv *e, lval *a) {
+  LASSERT_COUNT("pfor", a, 3);
+  LASSERT_TYPE("pfor", a, 0, LVAL_QEXPR);
+  LASSERT_TYPE("pfor", a, 1, LVAL_QEXPR);
+  LASSERT_TYPE("pfor", a, 2, LVAL_QEXPR);
+
+  lval *err = lval_loop_var(a, "pfor");
+  if (err)
+    return err;
+
+  lval *formals = lval_pop(a, 0);
+  lval *f = lval_lambda(formals, lval_pop(a, 1));
+  lopt_lambda(e, f);
+  return builtin_pmap(e, lval_push(lval_args(f, NULL), lval_take(a, 0)));
+}
+
+// Reduce with a fixed tree of chunks, then combine init with the total
+lval *builtin_preduce(lenv *e, lval *a) {
+  LASSERT_COUNT("preduce", a, 3);
+  LASSERT_TYPE("preduce", a, 0, LVAL_FUNC);
+  LASSERT_TYPE("preduce", a, 2, LVAL_QEXPR);
+
+  lval *f = a->cell[0];
+  lval *r = lpar_reduce(e, f, a->cell[2]);
+  if (!r)
+    return lval_take(a, 1);
+  if (r->type == LVAL_ERR) {
+    lval_del(a);
+    return r;
+  }
+
+  r = lval_apply(e, f, lval_args(a->cell[1], r));
+  a->cell[1] = lval_num(0);
+  lval_del(a);
+  return r;
+}
+
+// Future evaluating the q-expr, on the pool when it is isolated
+lval *builtin_future(lenv *e, lval *a) {
+  LASSERT_COUNT("future", a, 1);
+  LASSERT_TYPE("future", a, 0, LVAL_QEXPR);
+
+  return lpar_future(e, lval_take(a, 0));
+}
+
+// Value of a future once done, any other value as it is
+lval *builtin_touch(lenv *e, lval *a) {
+  LASSERT_COUNT("touch", a, 1);
+
+  if (a->cell[0]->type != LVAL_FUTURE)
+    return lval_take(a, 0);
+
+  lval *r = lpar_touch(a->cell[0]->fut);
+  lval_del(a);
+  return r;
+}
+
+/**
+ * ---------------------------------------------------------
+ * Channels. A message sharing nothing is moved into the ring
+ * as it is, anything else goes as a copy sharing nothing but
+ * the channels it holds.
+ * ---------------------------------------------------------
+ */
+
+// (chan n) or (chan n "drop") where a full channel drops messages
+lval *builtin_chan(lenv *e, lval *a) {
+  LASSERT(a, a->count == 1 || a->count == 2,
+          "Function 'chan' passed %i arguments. Expected 1 or 2", a->count);
+  LASSERT_TYPE("chan", a, 0, LVAL_NUM);
+  LASSERT(a, a->cell[0]->num > 0 && a->cell[0]->num <= 1 << 24,
+          "Function 'chan' passed capacity %li. Expected 1 to %i",
+          a->cell[0]->num, 1 << 24);
+
+  int policy = LCHAN_BLOCK;
+  if (a->count == 2) {
+    LASSERT_TYPE("chan", a, 1, LVAL_STR);
+    lval *p = a->cell[1];
+    if (p->slen == 4 && memcmp(lval_str_ptr(p), "drop", 4) == 0)
+      policy = LCHAN_DROP;
+    else
+      LASSERT(a, p->slen == 5 && memcmp(lval_str_ptr(p), "block", 5) == 0,
+              "Function 'chan' passed unknown policy. Expected \"block\" "
+              "or \"drop\"");
+  }
+
+  lval *v = malloc(sizeof(lval));
+  v->type = LVAL_CHAN;
+  v->chan = lchan_new(a->cell[0]->num, policy);
+  lval_del(a);
+  return v;
+}
+
+// 1 once queued, 0 when a full channel dropped it
+lval *builtin_send(lenv *e, lval *a) {
+  LASSERT_COUNT("send", a, 2);
+  LASSERT_TYPE("send", a, 0, LVAL_CHAN);
+
+  char *type = ltype_name(a->cell[1]->type);
+  lval *m = lpar_move(lval_pop(a, 1));
+  LASSERT(a, m, "Function 'send' cannot send a value holding a %s", type);
+
+  int r = lchan_send(a->cell[0]->chan, m);
+  if (r < 0)
+    lval_del(m);
+  lval_del(a);
+  if (r < 0)
+    return lval_err("Function 'send' would wait forever. No other thread "
+                    "can receive from the full channel");
+  return lval_num(r);
+}
+
+lval *builtin_recv(lenv *e, lval *a) {
+  LASSERT_COUNT("recv", a, 1);
+  LASSERT_TYPE("recv", a, 0, LVAL_CHAN);
+
+  lval *r = lchan_recv(a->cell[0]->chan);
+  lval_del(a);
+  if (!r)
+    return lval_err("Function 'recv' would wait forever. No other thread "
+                    "can send to the empty channel");
+  return r;
+}
+
+// List of the message, empty when there was none
+lval *builtin_try_recv(lenv *e, lval *a) {
+  LASSERT_COUNT("try-recv", a, 1);
+  LASSERT_TYPE("try-recv", a, 0, LVAL_CHAN);
+
+  lval *r = lval_qexpr();
+  lval *m = lchan_take(a->cell[0]->chan);
+  if (m)
+    lval_push(r, m);
+  lval_del(a);
+  return r;
+}
+
+lval *builtin_range(lenv *e, lval *a) {
+  LASSERT(a, a->count == 2 || a->count == 3,
+          "Function 'range' passed %i arguments. Expected 2 or 3", a->count);
+
+  for (int i = 0; i < a->count; i++) {
+    LASSERT_TYPE("range", a, i, LVAL_NUM);
+  }
+
+  long start = a->cell[0]->num;
+  long end = a->cell[1]->num;
+  long step = a->count == 3 ? a->cell[2]->num : 1;
+
+  LASSERT(a, step != 0, "Function 'range' passed step of 0");
+  lval_del(a);
+
+  // Count the elements first so the list is allocated once. The
+  // distance and the step are taken unsigned so no bound overflows.
+  unsigned long n = 0;
+  if (step > 0 && end > start)
+    n = ((unsigned long)end - start - 1) / step + 1;
+  if (step < 0 && end < start)
+    n = ((unsigned long)start - end - 1) / (0UL - step) + 1;
+
+  if (n > INT_MAX)
+    return lval_err("Function 'range' passed range of %lu elements. "
+                    "Expected at most %i",
+                    n, INT_MAX);
+
+  lval *v = lval_qexpr();
+  v->cell = malloc(sizeof(lval *) * (n ? n : 1));
+  if (!v->cell) {
+    lval_del(v);
+    return lval_err("Function 'range' could not allocate %lu elements", n);
+  }
+  v->count = n;
+
+  for (unsigned long i = 0; i < n; i++) {
+    v->cell[i] = lval_num((long)((unsigned long)start + i * step));
+  }
+
+  return v;
+}
+
+lval *builtin_reverse(lenv *e, lval *a) {
+  LASSERT_COUNT("reverse", a, 1);
+  LASSERT_TYPE("reverse", a, 0, LVAL_QEXPR);
+
+  lval *v = lval_take(a, 0);
+  for (int i = 0, j = v->count - 1; i < j; i++, j--) {
+    lval *t = v->cell[i];
+    v->cell[i] = v->cell[j];
+    v->cell[j] = t;
+  }
+
+  return v;
+}
+
+// Pair up the elements of two lists, stop at the shortest one
+lval *builtin_zip(lenv *e, lval *a) {
+  LASSERT_COUNT("zip", a, 2);
+  LASSERT_TYPE("zip", a, 0, LVAL_QEXPR);
+  LASSERT_TYPE("zip", a, 1, LVAL_QEXPR);
+
+  lval *x = a->cell[0];
+  lval *y = a->cell[1];
+  int n = x->count < y->count ? x->count : y->count;
+
+  lval *v = lval_qexpr();
+  v->cell = malloc(sizeof(lval *) * n);
+  v->count = n;
+
+  for (int i = 0; i < n; i++) {
+    v->cell[i] = lval_args(x->cell[i], y->cell[i]);
+    v->cell[i]->type = LVAL_QEXPR;
+  }
+
+  // Paired elements are moved, only delete the leftover
+  memmove(x->cell, x->cell + n, sizeof(lval *) * (x->count - n));
+  memmove(y->cell, y->cell + n, sizeof(lval *) * (y->count - n));
+  x->count -= n;
+  y->count -= n;
+
+  lval_del(a);
+  return v;
+}
+
+/**
+ * ----------------------------------------------------------
+ * Sorting functions. Lists of numbers only go through an LSD
+ * radix sort, the rest use introsort or merge sort when the
+ * order of equal elements has to be kept.
+ * ----------------------------------------------------------
+ */
+
+// Rank of type in the default ordering, numbers of every type are
+// one class ranked as integers
+int lval_cmp_rank(int type) {
+  return type == LVAL_DBL || type == LVAL_BIG ? LVAL_NUM : type;
+}
+
+// Default ordering of values, numbers before symbols before lists
+int lval_cmp(lval *x, lval *y) {
+  int rx = lval_cmp_rank(x->type);
+  int ry = lval_cmp_rank(y->type);
+  if (rx != ry) {
+    return rx < ry ? -1 : 1;
+  }
+
+  // Numbers of any type compare by their value, NaN has none so it
+  // goes after every other number
+  if (rx == LVAL_NUM) {
+    int nx = x->type == LVAL_DBL && isnan(x->dbl);
+    int ny = y->type == LVAL_DBL && isnan(y->dbl);
+    if (nx || ny)
+      return nx - ny;
+    return lval_num_cmp(x, y);
+  }
+
+  switch (x->type) {
+  case LVAL_SYM:
+    return strcmp(x->sym, y->sym);
+
+  case LVAL_ERR:
+    return strcmp(x->err, y->err);
+
+  case LVAL_STR: {
+    size_t n = x->slen < y->slen ? x->slen : y->slen;
+    int r = memcmp(lval_str_ptr(x), lval_str_ptr(y), n);
+    return r ? r : (x->slen > y->slen) - (x->slen < y->slen);
+  }
+
+  case LVAL_SEXPR:
+  case LVAL_QEXPR:
+    for (int i = 0; i < x->count && i < y->count; i++) {
+      int r = lval_cmp(x->cell[i], y->cell[i]);
+      if (r)
+        return r;
+    }
+    return (x->count > y->count) - (x->count < y->count);
+  }
+
+  return 0;
+}
+
+// State shared by comparisons of a single sort call
+typedef struct {
+  lenv *env;
+  lval *func;
+  lval *err;
+  int desc;
+} lsort;
+
+// Return non zero when x should be placed before y
+int lsort_less(lsort *s, lval *x, lval *y) {
+  // Stop calling the comparator after the first error
+  if (s->err)
+    return 0;
+
+  if (!s->func) {
+    int r = lval_cmp(x, y);
+    return s->desc ? r > 0 : r < 0;
+  }
+
+  lval *r = lval_apply(s->env, s->func, lval_args(lval_copy(x), lval_copy(y)));
+  if (r->type == LVAL_ERR) {
+    s->err = r;
+    return 0;
+  }
+
+  int less = r->type == LVAL_NUM && r->num;
+  lval_del(r);
+  return less;
+}
+
+void lsort_insertion(lsort *s, lval **v, int lo, int hi) {
+  for (int i = lo + 1; i <= hi; i++) {
+    lval *x = v[i];
+    int j = i - 1;
+    while (j >= lo && lsort_less(s, x, v[j])) {
+      v[j + 1] = v[j];
+      j--;
+    }
+    v[j + 1] = x;
+  }
+}
+
+void lsort_sift(lsort *s, lval **v, int lo, int i, int n) {
+  while (1) {
+    int c = 2 * i + 1;
+    if (c >= n)
+      break;
+    if (c + 1 < n && lsort_less(s, v[lo + c], v[lo + c + 1]))
+      c++;
+    if (!lsort_less(s, v[lo + i], v[lo + c]))
+      break;
+
+    lval *t = v[lo + i];
+    v[lo + i] = v[lo + c];
+    v[lo + c] = t;
+    i = c;
+  }
+}
+
+void lsort_heap(lsort *s, lval **v, int lo, int hi) {
+  int n = hi - lo + 1;
+  for (int i = n / 2 - 1; i >= 0; i--) {
+    lsort_sift(s, v, lo, i, n);
+  }
+
+  for (int i = n - 1; i > 0; i--) {
+    lval *t = v[lo];
+    v[lo] = v[lo + i];
+    v[lo + i] = t;
+    lsort_sift(s, v, lo, 0, i);
+  }
+}
+
+// Quicksort which fall back to heapsort when recursion goes too deep
+void lsort_intro(lsort *s, lval **v, int lo, int hi, int depth) {
+  while (hi - lo > 16) {
+    if (depth-- == 0) {
+      lsort_heap(s, v, lo, hi);
+      return;
+    }
+
+    // Median of three as pivot, placed at the end
+    int mid = lo + (hi - lo) / 2;
+    if (lsort_less(s, v[mid], v[lo])) {
+      lval *t = v[mid]; v[mid] = v[lo]; v[lo] = t;
+    }
+    if (lsort_less(s, v[hi], v[lo])) {
+      lval *t = v[hi]; v[hi] = v[lo]; v[lo] = t;
+    }
+    if (lsort_less(s, v[mid], v[hi])) {
+      lval *t = v[mid]; v[mid] = v[hi]; v[hi] = t;
+    }
+
+    lval *p = v[hi];
+    int i = lo;
+    for (int j = lo; j < hi; j++) {
+      if (lsort_less(s, v[j], p)) {
+        lval *t = v[i]; v[i] = v[j]; v[j] = t;
+        i++;
+      }
+    }
+    v[hi] = v[i];
+    v[i] = p;
+
+    // Recurse into the smaller half and loop on the bigger one
+    if (i - lo < hi - i) {
+      lsort_intro(s, v, lo, i - 1, depth);
+      lo = i + 1;
+    } else {
+      lsort_intro(s, v, i + 1, hi, depth);
+      hi = i - 1;
+    }
+  }
+
+  lsort_insertion(s, v, lo, hi);
+}
+
+// Stable merge sort, keys are moved along with values when given
+void lsort_merge(lsort *s, lval **v, lval **k, lval **tv, lval **tk, int n) {
+  for (int w = 1; w < n; w *= 2) {
+    for (int lo = 0; lo < n; lo += 2 * w) {
+      int mid = lo + w < n ? lo + w : n;
+      int hi = lo + 2 * w < n ? lo + 2 * w : n;
+      int i = lo, j = mid, o = lo;
+
+      while (i < mid && j < hi) {
+        // Take from the right only when strictly smaller
+        int right = k ? lsort_less(s, k[j], k[i]) : lsort_less(s, v[j], v[i]);
+        int from = right ? j++ : i++;
+        tv[o] = v[from];
+        if (k)
+          tk[o] = k[from];
+        o++;
+      }
+
+      for (; i < mid; i++, o++) {
+        tv[o] = v[i];
+        if (k)
+          tk[o] = k[i];
+      }
+      for (; j < hi; j++, o++) {
+        tv[o] = v[j];
+        if (k)
+          tk[o] = k[j];
+      }
+    }
+
+    memcpy(v, tv, sizeof(lval *) * n);
+    if (k)
+      memcpy(k, tk, sizeof(lval *) * n);
+  }
+}
+
+// LSD radix sort on numbers, order of values follows the keys
+void lsort_radix(lval **v, lval **k, int n, int desc) {
+  unsigned long *key = malloc(sizeof(unsigned long) * n * 2);
+  unsigned long *tkey = key + n;
+  lval **tv = malloc(sizeof(lval *) * n);
+
+  // Flip the sign bit so negative numbers order before positive
+  for (int i = 0; i < n; i++) {
+    key[i] = (unsigned long)k[i]->num ^ (1UL << (sizeof(long) * 8 - 1));
+    if (desc)
+      key[i] = ~key[i];
+  }
+
+  for (int shift = 0; shift < (int)sizeof(long) * 8; shift += 8) {
+    int count[257] = {0};
+    for (int i = 0; i < n; i++) {
+      count[((key[i] >> shift) & 0xff) + 1]++;
+    }
+
+    // Skip the pass when every key has the same digit
+    if (count[((key[0] >> shift) & 0xff) + 1] == n)
+      continue;
+
+    for (int d = 0; d < 256; d++) {
+      count[d + 1] += count[d];
+    }
+
+    for (int i = 0; i < n; i++) {
+      int d = (key[i] >> shift) & 0xff;
+      tkey[count[d]] = key[i];
+      tv[count[d]++] = v[i];
+    }
+
+    memcpy(key, tkey, sizeof(unsigned long) * n);
+    memcpy(v, tv, sizeof(lval *) * n);
+  }
+
+  free(tv);
+  free(key);
+}
+
+int lval_all_num(lval **v, int n) {
+  for (int i = 0; i < n; i++) {
+    if (v[i]->type != LVAL_NUM)
+      return 0;
+  }
+  return 1;
+}
+
+int lsort_depth(int n) {
+  int d = 0;
+  while (n >>= 1)
+    d++;
+  return 2 * d;
+}
+
+// Sort list by the default ordering
+lval *builtin_order(lenv *e, lval *a, char *func) {
+  LASSERT_COUNT(func, a, 1);
+  LASSERT_TYPE(func, a, 0, LVAL_QEXPR);
+
+  lval *l = lval_take(a, 0);
+  int desc = strcmp(func, "desc") == 0;
+
+  if (lval_all_num(l->cell, l->count)) {
+    if (l->count > 1)
+      lsort_radix(l->cell, l->cell, l->count, desc);
+    return l;
+  }
+
+  lsort s = {e, NULL, NULL, desc};
+  lsort_intro(&s, l->cell, 0, l->count - 1, lsort_depth(l->count));
+  return l;
+}
+
+lval *builtin_asc(lenv *e, lval *a) { return builtin_order(e, a, "asc"); }
 
-lval *builtin_dif(lenv *e, lval *a) { return builtin_op(e, a, "%"); }
+lval *builtin_desc(lenv *e, lval *a) { return builtin_order(e, a, "desc"); }
 
-lval *builtin_ord(lenv *e, lval *a, char *op) {
-  LASSERT_COUNT(op, a, 2);
-  LASSERT_TYPE(op, a, 0, LVAL_NUM);
-  LASSERT_TYPE(op, a, 1, LVAL_NUM);
+// Sort list with comparator which return true when first
+// argument should be placed before the second one
+lval *builtin_sort_with(lenv *e, lval *a, char *func) {
+  LASSERT_COUNT(func, a, 2);
+  LASSERT_TYPE(func, a, 0, LVAL_FUNC);
+  LASSERT_TYPE(func, a, 1, LVAL_QEXPR);
 
-  int r;
+  lval *l = a->cell[1];
+  lsort s = {e, a->cell[0], NULL, 0};
 
-  if (strcmp(op, ">") == 0) {
-    r = (a->cell[0]->num > a->cell[1]->num);
+  if (strcmp(func, "sort") == 0) {
+    lsort_intro(&s, l->cell, 0, l->count - 1, lsort_depth(l->count));
+  } else if (l->count > 1) {
+    lval **tmp = malloc(sizeof(lval *) * l->count);
+    lsort_merge(&s, l->cell, NULL, tmp, NULL, l->count);
+    free(tmp);
   }
 
-  if (strcmp(op, ">=") == 0) {
-    r = (a->cell[0]->num >= a->cell[1]->num);
+  if (s.err) {
+    lval_del(a);
+    return s.err;
   }
 
-  if (strcmp(op, "<") == 0) {
-    r = (a->cell[0]->num < a->cell[1]->num);
+  return lval_take(a, 1);
+}
+
+lval *builtin_sort(lenv *e, lval *a) {
+  return builtin_sort_with(e, a, "sort");
+}
+
+lval *builtin_sort_stable(lenv *e, lval *a) {
+  return builtin_sort_with(e, a, "sort-stable");
+}
+
+// Stable sort by the key computed once per element
+lval *builtin_sort_by(lenv *e, lval *a) {
+  LASSERT_COUNT("sort-by", a, 2);
+  LASSERT_TYPE("sort-by", a, 0, LVAL_FUNC);
+  LASSERT_TYPE("sort-by", a, 1, LVAL_QEXPR);
+
+  lval *l = a->cell[1];
+  int n = l->count;
+  if (n < 2) {
+    return lval_take(a, 1);
   }
 
-  if (strcmp(op, "<=") == 0) {
-    r = (a->cell[0]->num <= a->cell[1]->num);
+  lval **keys = malloc(sizeof(lval *) * n);
+  for (int i = 0; i < n; i++) {
+    keys[i] = lval_apply(e, a->cell[0], lval_args(lval_copy(l->cell[i]), NULL));
+
+    if (keys[i]->type == LVAL_ERR) {
+      lval *err = keys[i];
+      for (int j = 0; j < i; j++) {
+        lval_del(keys[j]);
+      }
+      free(keys);
+      lval_del(a);
+      return err;
+    }
   }
 
-  lval_del(a);
-  return lval_num(r);
+  if (lval_all_num(keys, n)) {
+    lsort_radix(l->cell, keys, n, 0);
+  } else {
+    lsort s = {e, NULL, NULL, 0};
+    lval **tmp = malloc(sizeof(lval *) * n * 2);
+    lsort_merge(&s, l->cell, keys, tmp, tmp + n, n);
+    free(tmp);
+  }
+
+  for (int i = 0; i < n; i++) {
+    lval_del(keys[i]);
+  }
+  free(keys);
+
+  return lval_take(a, 1);
 }
 
-lval *builtin_gt(lenv *e, lval *a) { return builtin_ord(e, a, ">"); }
+/**
+ * ---------------------------------------------------------
+ * Memo functions. A memo function wraps another function
+ * and caches its results keyed by the argument list. Calls
+ * are passed through uncached unless the function is pure.
+ * ---------------------------------------------------------
+ */
 
-lval *builtin_ge(lenv *e, lval *a) { return builtin_ord(e, a, ">="); }
+lval *lval_memo_call(lenv *e, lval *f, lval *a) {
+  lmemo *m = f->memo;
+  a->type = LVAL_SEXPR;
 
-lval *builtin_lt(lenv *e, lval *a) { return builtin_ord(e, a, "<"); }
+  // Results of impure function can not be reused
+  if (!leff_pure(e, m->func))
+    return lval_apply(e, m->func, a);
+  uint64_t h = lval_hash(a);
 
-lval *builtin_le(lenv *e, lval *a) { return builtin_ord(e, a, "<="); }
+  lval *v = lmemo_get(m, a, h);
+  if (v) {
+    m->hits++;
+    lval_del(a);
+    return lval_copy(v);
+  }
 
-lval *builtin_cmp(lenv *e, lval *a, char *op) {
-  LASSERT_COUNT(op, a, 2);
+  m->misses++;
 
-  int r;
+  // Hold the cache, the call may redefine what refer to it
+  m->ref++;
+  lval *k = lval_copy(a);
+  lval *r = lval_apply(e, m->func, a);
 
-  if (strcmp(op, "==") == 0) {
-    r = lval_eq(a->cell[0], a->cell[1]);
+  if (r->type == LVAL_ERR) {
+    lval_del(k);
+  } else {
+    lmemo_put(m, k, h, lval_copy(r));
   }
 
-  if (strcmp(op, "!=") == 0) {
-    r = !lval_eq(a->cell[0], a->cell[1]);
+  lmemo_release(m);
+  return r;
+}
+
+// Wrap function into memo function with optional capacity and
+// eviction policy, either "lru" (default) or "clock"
+lval *builtin_memo(lenv *e, lval *a) {
+  LASSERT(a, a->count >= 1 && a->count <= 3,
+          "Function 'memo' passed %i arguments. Expected 1 to 3", a->count);
+  LASSERT_TYPE("memo", a, 0, LVAL_FUNC);
+
+  int cap = 1024;
+  if (a->count > 1) {
+    LASSERT_TYPE("memo", a, 1, LVAL_NUM);
+    LASSERT(a, a->cell[1]->num > 0 && a->cell[1]->num <= INT_MAX / 2,
+            "Function 'memo' passed invalid capacity %li", a->cell[1]->num);
+    cap = a->cell[1]->num;
+  }
+
+  int policy = LMEMO_LRU;
+  if (a->count > 2) {
+    LASSERT_TYPE("memo", a, 2, LVAL_STR);
+    lval *p = a->cell[2];
+    if (p->slen == 5 && memcmp(lval_str_ptr(p), "clock", 5) == 0) {
+      policy = LMEMO_CLOCK;
+    } else {
+      LASSERT(a, p->slen == 3 && memcmp(lval_str_ptr(p), "lru", 3) == 0,
+              "Function 'memo' passed unknown policy. Expected \"lru\" or "
+              "\"clock\"");
+    }
   }
 
+  lval *v = malloc(sizeof(lval));
+  v->type = LVAL_FUNC;
+  v->builtin = NULL;
+  v->memo = lmemo_new(lval_pop(a, 0), cap, policy);
+
+  lval_del(a);
+  return v;
+}
+
+lval *builtin_pure(lenv *e, lval *a) {
+  LASSERT_COUNT("pure?", a, 1);
+  LASSERT_TYPE("pure?", a, 0, LVAL_FUNC);
+
+  int r = leff_pure(e, a->cell[0]);
   lval_del(a);
   return lval_num(r);
 }
 
-lval *builtin_eq(lenv *e, lval *a) { return builtin_cmp(e, a, "=="); }
+lval *lval_stat(lval *d, char *k, long n) {
+  d->dict = ldict_put(d->dict, lval_str(k, strlen(k)), lval_num(n));
+  return d;
+}
 
-lval *builtin_ne(lenv *e, lval *a) { return builtin_cmp(e, a, "!="); }
+// Hits, misses, size and capacity of memo function as dictionary
+lval *builtin_memo_stats(lenv *e, lval *a) {
+  LASSERT_COUNT("memo-stats", a, 1);
+  LASSERT(a, a->cell[0]->type == LVAL_FUNC && a->cell[0]->memo,
+          "Function 'memo-stats' passed %s. Expected memo function",
+          ltype_name(a->cell[0]->type));
 
-lval *builtin_lgc(lenv *e, lval *a) {
+  lmemo *m = a->cell[0]->memo;
+  lval *d = lval_dict();
+  lval_stat(d, "hits", m->hits);
+  lval_stat(d, "misses", m->misses);
+  lval_stat(d, "size", m->count);
+  lval_stat(d, "capacity", m->cap);
 
+  lval_del(a);
+  return d;
 }
 
-lval *builtin_if(lenv *e, lval *a) {
-  LASSERT_COUNT("if", a, 3);
-  LASSERT_TYPE("if", a, 0, LVAL_NUM);
-  LASSERT_TYPE("if", a, 1, LVAL_QEXPR);
-  LASSERT_TYPE("if", a, 2, LVAL_QEXPR);
+/**
+ * ---------------------------------------------------------
+ * Reactive cells. Cells are bound globally like def, reading
+ * the symbol gives the current value and inside a formula
+ * also records the cell as one of its inputs.
+ * ---------------------------------------------------------
+ */
 
-  // Change both QEXPR expression
-  // to SEXPR so it evaluable
-  a->cell[1]->type = LVAL_SEXPR;
-  a->cell[2]->type = LVAL_SEXPR;
+lval *lval_rcell(lcell *c) {
+  lval *v = malloc(sizeof(lval));
+  v->type = LVAL_CELL;
+  v->rcell = c;
+  return v;
+}
 
-  lval *x;
+// Define symbol as input cell or as formula over the expression
+lval *builtin_rcell(lenv *e, lval *a, char *func) {
+  LASSERT_COUNT(func, a, 2);
+  LASSERT_TYPE(func, a, 0, LVAL_QEXPR);
+  LASSERT(a, a->cell[0]->count == 1 && a->cell[0]->cell[0]->type == LVAL_SYM,
+          "Function '%s' cannot define non-symbol", func);
 
-  // If condition is set as true
-  // then evaluate first expression
-  // otherwise evaluate the second
-  if (a->cell[0]->num) {
-    x = lval_eval(e, lval_pop(a, 1));
+  lenv *g = e;
+  while (g->par) {
+    g = g->par;
+  }
+
+  lcell *c;
+  if (strcmp(func, "formula") == 0) {
+    LASSERT_TYPE(func, a, 1, LVAL_QEXPR);
+    lval *x = lval_pop(a, 1);
+    x->type = LVAL_SEXPR;
+    c = lcell_new(NULL, x, g);
   } else {
-    x = lval_eval(e, lval_pop(a, 2));
+    c = lcell_new(lval_pop(a, 1), NULL, NULL);
   }
 
+  lval *v = lval_rcell(c);
+  lenv_put(g, a->cell[0]->cell[0], v);
+  lval_del(v);
+
   lval_del(a);
-  return x;
+  return lval_sexpr();
 }
 
-lval *builtin_lambda(lenv *e, lval *a) {
-  LASSERT_COUNT("\\", a, 2);
-  LASSERT_TYPE("\\", a, 0, LVAL_QEXPR);
-  LASSERT_TYPE("\\", a, 1, LVAL_QEXPR);
+lval *builtin_cell(lenv *e, lval *a) { return builtin_rcell(e, a, "cell"); }
 
-  for (int i = 0; i < a->cell[0]->count; i++) {
-    LASSERT(a, a->cell[0]->cell[i]->type == LVAL_SYM,
-            "Cannot define non-symbol. Got %s, Expected %s",
-            ltype_name(a->cell[0]->cell[i]->type), ltype_name(LVAL_SYM));
+lval *builtin_formula(lenv *e, lval *a) {
+  return builtin_rcell(e, a, "formula");
+}
+
+lval *builtin_set(lenv *e, lval *a) {
+  LASSERT_COUNT("set", a, 2);
+  LASSERT_TYPE("set", a, 0, LVAL_QEXPR);
+  LASSERT(a, a->cell[0]->count == 1 && a->cell[0]->cell[0]->type == LVAL_SYM,
+          "Function 'set' cannot set non-symbol");
+
+  lval *k = a->cell[0]->cell[0];
+  lval *c = lenv_find(e, k);
+  LASSERT(a, c && c->type == LVAL_CELL && !c->rcell->expr,
+          "Function 'set' passed '%s' which is not an input cell", k->sym);
+
+  lcell_set(c->rcell, lval_pop(a, 1));
+  lval_del(a);
+  return lval_sexpr();
+}
+
+/**
+ * ---------------------------------------------------------
+ * Dictionary functions. Dictionaries are values like every
+ * other lval, a modification returns the changed dictionary
+ * and copies the table first when it is still shared.
+ * ---------------------------------------------------------
+ */
+
+lval *lval_dict(void) {
+  lval *v = malloc(sizeof(lval));
+  v->type = LVAL_DICT;
+  v->dict = ldict_new();
+  return v;
+}
+
+// Copy of keys, values or both alternating of dictionary as q-expr.
+// Entries are copied so recursing into them can not move the table.
+lval *lval_dict_items(lval *d, int keys, int vals) {
+  ltable *t = ldict_table(d->dict);
+
+  lval *v = lval_qexpr();
+  v->cell = malloc(sizeof(lval *) * (t->count * (keys + vals) + 1));
+
+  for (int i = 0; i < t->cap; i++) {
+    if (!t->slots[i].key)
+      continue;
+
+    if (keys)
+      v->cell[v->count++] = lval_copy(t->slots[i].key);
+    if (vals)
+      v->cell[v->count++] = lval_copy(t->slots[i].val);
   }
 
-  lval *formals = lval_pop(a, 0);
-  lval *body = lval_pop(a, 0);
+  return v;
+}
+
+// Construct dictionary from q-expr of alternating keys and values
+lval *builtin_dict(lenv *e, lval *a) {
+  LASSERT(a, a->count <= 1,
+          "Function 'dict' passed %i arguments. Expected 0 or 1", a->count);
+
+  lval *d = lval_dict();
+  if (a->count == 0) {
+    lval_del(a);
+    return d;
+  }
+
+  LASSERT_TYPE("dict", a, 0, LVAL_QEXPR);
+  lval *l = a->cell[0];
+  if (l->count % 2) {
+    lval_del(d);
+    lval_del(a);
+    return lval_err("Function 'dict' passed odd number of elements");
+  }
+
+  for (int i = 0; i < l->count; i += 2) {
+    d->dict = ldict_put(d->dict, l->cell[i], l->cell[i + 1]);
+  }
+
+  // Pairs are now owned by the table
+  l->count = 0;
   lval_del(a);
+  return d;
+}
+
+lval *builtin_get(lenv *e, lval *a) {
+  LASSERT(a, a->count == 2 || a->count == 3,
+          "Function 'get' passed %i arguments. Expected 2 or 3", a->count);
+  LASSERT_TYPE("get", a, 0, LVAL_DICT);
+
+  lval *v = ldict_get(a->cell[0]->dict, a->cell[1]);
+  if (v) {
+    v = lval_copy(v);
+    lval_del(a);
+    return v;
+  }
 
-  return lval_lambda(formals, body);
+  // Fall back to the default when it is given
+  if (a->count == 3)
+    return lval_take(a, 2);
+
+  lval_del(a);
+  return lval_err("Function 'get' key not found");
 }
 
-lval *builtin_func(lenv *e, lval *a) {
-  LASSERT_COUNT("func", a, 2);
-  LASSERT_TYPE("func", a, 0, LVAL_QEXPR);
-  LASSERT_TYPE("func", a, 1, LVAL_QEXPR);
+lval *builtin_has(lenv *e, lval *a) {
+  LASSERT_COUNT("has", a, 2);
+  LASSERT_TYPE("has", a, 0, LVAL_DICT);
 
-  lval *func_args = lval_pop(a, 0);
-  lval *func_body = lval_pop(a, 0);
+  int r = ldict_get(a->cell[0]->dict, a->cell[1]) != NULL;
+  lval_del(a);
+  return lval_num(r);
+}
 
-  lval *ff_args = lval_pop(func_args, 0);
-  lval *ff_body = lval_copy(func_args);
+lval *builtin_put_key(lenv *e, lval *a) {
+  LASSERT_COUNT("put", a, 3);
+  LASSERT_TYPE("put", a, 0, LVAL_DICT);
+
+  lval *d = lval_pop(a, 0);
+  lval *k = lval_pop(a, 0);
+  lval *v = lval_pop(a, 0);
+  lval_del(a);
 
-  lenv_def(e, ff_args, lval_lambda(ff_body, func_body));
+  d->dict = ldict_put(d->dict, k, v);
+  return d;
+}
 
-  lval_del(func_args);
-  lval_del(func_body);
-  lval_del(ff_args);
-  lval_del(ff_body);
+lval *builtin_del_key(lenv *e, lval *a) {
+  LASSERT_COUNT("del", a, 2);
+  LASSERT_TYPE("del", a, 0, LVAL_DICT);
+
+  lval *d = lval_pop(a, 0);
+  lval *k = lval_pop(a, 0);
   lval_del(a);
 
-  return lval_sexpr();
+  d->dict = ldict_put(d->dict, k, NULL);
+  return d;
+}
+
+// Collect either keys or values of dictionary into q-expr
+lval *builtin_entries(lenv *e, lval *a, char *func) {
+  LASSERT_COUNT(func, a, 1);
+  LASSERT_TYPE(func, a, 0, LVAL_DICT);
+
+  int keys = strcmp(func, "keys") == 0;
+  lval *v = lval_dict_items(a->cell[0], keys, !keys);
+
+  lval_del(a);
+  return v;
+}
+
+lval *builtin_keys(lenv *e, lval *a) { return builtin_entries(e, a, "keys"); }
+
+lval *builtin_vals(lenv *e, lval *a) { return builtin_entries(e, a, "vals"); }
+
+/**
+ * ------------------------------------------------------------
+ * String functions. Length of string is always known so none
+ * of them scan for the terminator, slices of long strings are
+ * views into the same buffer instead of copies.
+ * ------------------------------------------------------------
+ */
+
+// Slice of string, shares the buffer unless the slice fits inline
+lval *lval_str_slice(lval *s, size_t off, size_t n) {
+  if (!s->buf || n < LSTR_SSO)
+    return lval_str(lval_str_ptr(s) + off, n);
+
+  lval *v = lval_copy(s);
+  v->soff += off;
+  v->slen = n;
+  return v;
+}
+
+// Position of needle in haystack, memchr find the candidates
+long lstr_find(const char *h, size_t hn, const char *n, size_t nn) {
+  if (nn == 0)
+    return 0;
+
+  const char *p = h;
+  const char *end = h + hn;
+
+  while ((size_t)(end - p) >= nn) {
+    p = memchr(p, n[0], end - p - nn + 1);
+    if (!p)
+      return -1;
+    if (memcmp(p, n, nn) == 0)
+      return p - h;
+    p++;
+  }
+
+  return -1;
+}
+
+lval *builtin_concat(lenv *e, lval *a) {
+  size_t n = 0;
+  for (int i = 0; i < a->count; i++) {
+    LASSERT_TYPE("concat", a, i, LVAL_STR);
+    n += a->cell[i]->slen;
+  }
+
+  // Total length is known up front so it is written once
+  char *s = malloc(n + 1);
+  size_t off = 0;
+  for (int i = 0; i < a->count; i++) {
+    memcpy(s + off, lval_str_ptr(a->cell[i]), a->cell[i]->slen);
+    off += a->cell[i]->slen;
+  }
+
+  lval *v = lval_str(s, n);
+  free(s);
+  lval_del(a);
+  return v;
+}
+
+lval *builtin_substr(lenv *e, lval *a) {
+  LASSERT(a, a->count == 2 || a->count == 3,
+          "Function 'substr' passed %i arguments. Expected 2 or 3",
+          a->count);
+  LASSERT_TYPE("substr", a, 0, LVAL_STR);
+  LASSERT_TYPE("substr", a, 1, LVAL_NUM);
+  if (a->count == 3) {
+    LASSERT_TYPE("substr", a, 2, LVAL_NUM);
+  }
+
+  lval *s = a->cell[0];
+  long off = a->cell[1]->num;
+  long n = a->count == 3 ? a->cell[2]->num : (long)s->slen - off;
+
+  LASSERT(a, off >= 0 && n >= 0 && (size_t)(off + n) <= s->slen,
+          "Function 'substr' range %li+%li out of bounds of %li", off, n,
+          (long)s->slen);
+
+  lval *v = lval_str_slice(s, off, n);
+  lval_del(a);
+  return v;
+}
+
+lval *builtin_find(lenv *e, lval *a) {
+  LASSERT_COUNT("find", a, 2);
+  LASSERT_TYPE("find", a, 0, LVAL_STR);
+  LASSERT_TYPE("find", a, 1, LVAL_STR);
+
+  long r = lstr_find(lval_str_ptr(a->cell[0]), a->cell[0]->slen,
+                     lval_str_ptr(a->cell[1]), a->cell[1]->slen);
+  lval_del(a);
+  return lval_num(r);
+}
+
+lval *builtin_split(lenv *e, lval *a) {
+  LASSERT_COUNT("split", a, 2);
+  LASSERT_TYPE("split", a, 0, LVAL_STR);
+  LASSERT_TYPE("split", a, 1, LVAL_STR);
+  LASSERT(a, a->cell[1]->slen > 0, "Function 'split' passed empty separator");
+
+  lval *s = a->cell[0];
+  char *p = lval_str_ptr(s);
+  char *sep = lval_str_ptr(a->cell[1]);
+  size_t sn = a->cell[1]->slen;
+
+  lval *v = lval_qexpr();
+  size_t off = 0;
+
+  while (1) {
+    long i = lstr_find(p + off, s->slen - off, sep, sn);
+    size_t n = i < 0 ? s->slen - off : (size_t)i;
+
+    lval_push(v, lval_str_slice(s, off, n));
+    if (i < 0)
+      break;
+    off += n + sn;
+  }
+
+  lval_del(a);
+  return v;
 }
 
 /**
@@ -917,18 +3612,30 @@ lenv *lenv_new(void) {
   e->syms = NULL;
   e->vals = NULL;
   e->par = NULL;
+  e->global = 0;
+  e->stack = 0;
+  e->loop = 0;
+  e->retired = NULL;
+  e->nformulas = 0;
+  e->formulas = NULL;
   return e;
 }
 
 lenv *lenv_copy(lenv *e) {
   lenv *n = malloc(sizeof(lenv));
   n->par = e->par;
+  n->global = 0;
+  n->stack = 0;
+  n->loop = 0;
+  n->retired = NULL;
+  n->nformulas = 0;
+  n->formulas = NULL;
   n->count = e->count;
   n->syms = malloc(sizeof(char *) * n->count);
   n->vals = malloc(sizeof(lval *) * n->count);
 
   for (int i = 0; i < e->count; i++) {
-    n->syms[i] = malloc(strlen(e->syms[i]) * 1);
+    n->syms[i] = malloc(strlen(e->syms[i]) + 1);
     strcpy(n->syms[i], e->syms[i]);
     n->vals[i] = lval_copy(e->vals[i]);
   }
@@ -936,11 +3643,18 @@ lenv *lenv_copy(lenv *e) {
   return n;
 }
 
-// Get a copy of value of lenv
+// Get a copy of value of lenv, or current value of reactive cell
 lval *lenv_get(lenv *e, lval *k) {
+  if (!e->par && lcell_reading)
+    lcell_watch(lcell_reading, k->sym);
+
   for (int i = 0; i < e->count; i++) {
-    if (strcmp(e->syms[i], k->sym) == 0)
-      return lval_copy(e->vals[i]);
+    if (strcmp(e->syms[i], k->sym) != 0)
+      continue;
+
+    if (e->vals[i]->type == LVAL_CELL)
+      return lcell_get(e->vals[i]->rcell);
+    return lval_copy(e->vals[i]);
   }
 
   if (e->par)
@@ -949,6 +3663,88 @@ lval *lenv_get(lenv *e, lval *k) {
   return lval_err("Unbound symbol '%s'", k->sym);
 }
 
+// Value bound to symbol without copying it, NULL when unbound
+lval *lenv_find(lenv *e, lval *k) {
+  for (; e; e = e->par) {
+    for (int i = 0; i < e->count; i++) {
+      if (strcmp(e->syms[i], k->sym) == 0)
+        return e->vals[i];
+    }
+  }
+
+  return NULL;
+}
+
+// Move frame on the stack to the heap so it can grow
+void lenv_unstack(lenv *e) {
+  char **syms = malloc(sizeof(char *) * e->count);
+  lval **vals = malloc(sizeof(lval *) * e->count);
+
+  for (int i = 0; i < e->count; i++) {
+    syms[i] = malloc(strlen(e->syms[i]) + 1);
+    strcpy(syms[i], e->syms[i]);
+    vals[i] = e->vals[i];
+  }
+
+  e->syms = syms;
+  e->vals = vals;
+  e->stack = 0;
+}
+
+// Arrays of a global environment and the value a binding replaced
+typedef struct
+{
+    char **syms;
+    lval **vals;
+    lval *val;
+} lenv_old;
+
+void lenv_free_old(void *p) {
+  lenv_old *o = p;
+  free(o->syms);
+  free(o->vals);
+  if (o->val)
+    lval_del(o->val);
+  free(o);
+}
+
+// Bind v to slot i of global environment, or to a new slot when i is
+// the count. Tasks read the arrays without locking, so they are never
+// changed once published: new ones are published, arrays first and
+// count last, and the old ones retired until no task reads them.
+void lenv_publish(lenv *e, int i, char *sym, lval *v) {
+  int n = i < e->count ? e->count : e->count + 1;
+  lenv_old *o = malloc(sizeof(lenv_old));
+  o->syms = NULL;
+  o->vals = e->vals;
+  o->val = i < e->count ? e->vals[i] : NULL;
+
+  char **syms = e->syms;
+  lval **vals = malloc(sizeof(lval *) * n);
+  memcpy(vals, e->vals, sizeof(lval *) * e->count);
+  vals[i] = v;
+
+  if (n > e->count) {
+    o->syms = e->syms;
+    syms = malloc(sizeof(char *) * n);
+    memcpy(syms, e->syms, sizeof(char *) * e->count);
+    syms[i] = malloc(strlen(sym) + 1);
+    strcpy(syms[i], sym);
+  }
+
+  __atomic_store_n(&e->syms, syms, __ATOMIC_SEQ_CST);
+  __atomic_store_n(&e->vals, vals, __ATOMIC_SEQ_CST);
+  __atomic_store_n(&e->count, n, __ATOMIC_SEQ_CST);
+  lrcu_retire(e, &e->retired, lenv_free_old, o);
+}
+
+int lenv_read(lenv *e, char ***syms, lval ***vals) {
+  int n = __atomic_load_n(&e->count, __ATOMIC_SEQ_CST);
+  *syms = __atomic_load_n(&e->syms, __ATOMIC_SEQ_CST);
+  *vals = __atomic_load_n(&e->vals, __ATOMIC_SEQ_CST);
+  return n;
+}
+
 // Set or update a value of lenv
 // Define variable at innermost of environment
 void lenv_put(lenv *e, lval *k, lval *v) {
@@ -957,12 +3753,30 @@ void lenv_put(lenv *e, lval *k, lval *v) {
   // of the key with the one that user provide
   for (int i = 0; i < e->count; i++) {
     if (strcmp(e->syms[i], k->sym) == 0) {
+      if (e->global) {
+        lopt_global(k->sym, e->vals[i], v);
+        lenv_publish(e, i, k->sym, lval_copy(v));
+        lcell_rebind(e, k->sym);
+        return;
+      }
+
+      lopt_local(k->sym);
       lval_del(e->vals[i]);
       e->vals[i] = lval_copy(v);
       return;
     }
   }
 
+  if (e->global) {
+    lopt_global(k->sym, NULL, v);
+    lenv_publish(e, e->count, k->sym, lval_copy(v));
+    return;
+  }
+
+  lopt_local(k->sym);
+  if (e->stack)
+    lenv_unstack(e);
+
   // Otherwise allocate space for new entries
   e->count++;
   e->syms = realloc(e->syms, sizeof(char *) * e->count);
@@ -983,64 +3797,178 @@ void lenv_def(lenv *e, lval *k, lval *v) {
   lenv_put(e, k, v);
 }
 
+// Frame that = binds k into, the first one that is not a loop or
+// is the loop of k
+lenv *lenv_local(lenv *e, lval *k) {
+  while (e->loop && e->par) {
+    for (int i = 0; i < e->count; i++) {
+      if (strcmp(e->syms[i], k->sym) == 0)
+        return e;
+    }
+    e = e->par;
+  }
+  return e;
+}
+
 // Delete lenv and its children
 void lenv_del(lenv *e) {
+  if (e->global)
+    lrcu_barrier(e, &e->retired);
+
   for (int i = 0; i < e->count; i++) {
     free(e->syms[i]);
     lval_del(e->vals[i]);
   }
 
+  // Formulas still held elsewhere can no longer compute
+  for (int i = 0; i < e->nformulas; i++)
+    e->formulas[i]->env = NULL;
+
   free(e->syms);
   free(e->vals);
+  free(e->formulas);
   free(e);
 }
 
-void lenv_add_builtin(lenv *e, char *name, lbuiltin func) {
+// Delete the bindings of frame without the frame itself, only the
+// values when it is still on the stack
+void lenv_clear(lenv *e) {
+  for (int i = 0; i < e->count; i++) {
+    if (!e->stack)
+      free(e->syms[i]);
+    lval_del(e->vals[i]);
+  }
+
+  if (!e->stack) {
+    free(e->syms);
+    free(e->vals);
+  }
+}
+
+void lenv_add_builtin(lenv *e, char *name, lbuiltin func, int effect) {
   lval *k = lval_sym(name);
-  lval *v = lval_func(name, func);
+  lval *v = lval_func(name, func, effect);
   lenv_put(e, k, v);
-  free(k);
-  free(v);
+  lval_del(k);
+  lval_del(v);
 }
 
 // Register all builtin functions
 void lenv_add_builtins(lenv *e) {
+  e->global = 1;
+
   // Declarative functions
-  lenv_add_builtin(e, "=", builtin_put);
-  lenv_add_builtin(e, "def", builtin_def);
-  lenv_add_builtin(e, "\\", builtin_lambda);
+  lenv_add_builtin(e, "=", builtin_put, LEFF_LOCAL);
+  lenv_add_builtin(e, "def", builtin_def, LEFF_GLOBAL);
+  lenv_add_builtin(e, "\\", builtin_lambda, LEFF_CODE);
 
   // Builtin functions
-  lenv_add_builtin(e, "len", builtin_len);
-  lenv_add_builtin(e, "func", builtin_func);
-  lenv_add_builtin(e, "list", builtin_list);
-  lenv_add_builtin(e, "init", builtin_init);
-  lenv_add_builtin(e, "head", builtin_head);
-  lenv_add_builtin(e, "tail", builtin_tail);
-  lenv_add_builtin(e, "join", builtin_join);
-  lenv_add_builtin(e, "cons", builtin_cons);
-  lenv_add_builtin(e, "eval", builtin_eval);
-  lenv_add_builtin(e, "show", builtin_show);
-  lenv_add_builtin(e, "exit", builtin_exit);
+  lenv_add_builtin(e, "len", builtin_len, LEFF_PURE);
+  lenv_add_builtin(e, "func", builtin_func, LEFF_GLOBAL);
+  lenv_add_builtin(e, "list", builtin_list, LEFF_PURE);
+  lenv_add_builtin(e, "init", builtin_init, LEFF_PURE);
+  lenv_add_builtin(e, "head", builtin_head, LEFF_PURE);
+  lenv_add_builtin(e, "tail", builtin_tail, LEFF_PURE);
+  lenv_add_builtin(e, "join", builtin_join, LEFF_PURE);
+  lenv_add_builtin(e, "cons", builtin_cons, LEFF_PURE);
+  lenv_add_builtin(e, "eval", builtin_eval, LEFF_EVAL);
+  lenv_add_builtin(e, "show", builtin_show, LEFF_IO);
+  lenv_add_builtin(e, "exit", builtin_exit, LEFF_IO);
+
+  // Higher order functions
+  lenv_add_builtin(e, "map", builtin_map, LEFF_APPLY);
+  lenv_add_builtin(e, "filter", builtin_filter, LEFF_APPLY);
+  lenv_add_builtin(e, "foldl", builtin_foldl, LEFF_APPLY);
+  lenv_add_builtin(e, "foldr", builtin_foldr, LEFF_APPLY);
+  lenv_add_builtin(e, "pmap", builtin_pmap, LEFF_APPLY);
+  lenv_add_builtin(e, "preduce", builtin_preduce, LEFF_APPLY);
+  lenv_add_builtin(e, "future", builtin_future, LEFF_CODE);
+  lenv_add_builtin(e, "touch", builtin_touch, LEFF_PURE);
+  lenv_add_builtin(e, "range", builtin_range, LEFF_PURE);
+  lenv_add_builtin(e, "reverse", builtin_reverse, LEFF_PURE);
+  lenv_add_builtin(e, "zip", builtin_zip, LEFF_PURE);
+
+  // Channel functions
+  lenv_add_builtin(e, "chan", builtin_chan, LEFF_CHAN);
+  lenv_add_builtin(e, "send", builtin_send, LEFF_CHAN);
+  lenv_add_builtin(e, "recv", builtin_recv, LEFF_CHAN);
+  lenv_add_builtin(e, "try-recv", builtin_try_recv, LEFF_CHAN);
+
+  // Lazy sequence functions
+  lenv_add_builtin(e, "lrange", builtin_lrange, LEFF_PURE);
+  lenv_add_builtin(e, "lmap", builtin_lmap, LEFF_APPLY);
+  lenv_add_builtin(e, "lfilter", builtin_lfilter, LEFF_APPLY);
+  lenv_add_builtin(e, "take", builtin_take, LEFF_PURE);
+  lenv_add_builtin(e, "drop", builtin_drop, LEFF_PURE);
+  lenv_add_builtin(e, "collect", builtin_collect, LEFF_PURE);
 
   // Ordering functions
-  // lenv_add_builtin(e, "asc", NULL);
-  // lenv_add_builtin(e, "desc", NULL);
+  lenv_add_builtin(e, "asc", builtin_asc, LEFF_PURE);
+  lenv_add_builtin(e, "desc", builtin_desc, LEFF_PURE);
+  lenv_add_builtin(e, "sort", builtin_sort, LEFF_APPLY);
+  lenv_add_builtin(e, "sort-by", builtin_sort_by, LEFF_APPLY);
+  lenv_add_builtin(e, "sort-stable", builtin_sort_stable, LEFF_APPLY);
 
   // Comparison functions
-  lenv_add_builtin(e, "if", builtin_if);
-  lenv_add_builtin(e, "<", builtin_lt);
-  lenv_add_builtin(e, ">", builtin_gt);
-  lenv_add_builtin(e, "<=", builtin_le);
-  lenv_add_builtin(e, ">=", builtin_ge);
-  lenv_add_builtin(e, "==", builtin_eq);
-  lenv_add_builtin(e, "!=", builtin_ne);
+  lenv_add_builtin(e, "if", builtin_if, LEFF_CODE);
+  lenv_add_builtin(e, "and", builtin_and, LEFF_CODE);
+  lenv_add_builtin(e, "or", builtin_or, LEFF_CODE);
+  lenv_add_builtin(e, "not", builtin_not, LEFF_CODE);
+  lenv_add_builtin(e, "let", builtin_let, LEFF_CODE);
+  lenv_add_builtin(e, "cond", builtin_cond, LEFF_CODE);
+  lenv_add_builtin(e, "do", builtin_do, LEFF_PURE);
+
+  // Loop functions
+  lenv_add_builtin(e, "while", builtin_while, LEFF_CODE);
+  lenv_add_builtin(e, "dotimes", builtin_dotimes, LEFF_CODE);
+  lenv_add_builtin(e, "for-each", builtin_for_each, LEFF_CODE);
+  lenv_add_builtin(e, "pfor", builtin_pfor, LEFF_CODE);
+
+  lenv_add_builtin(e, "<", builtin_lt, LEFF_PURE);
+  lenv_add_builtin(e, ">", builtin_gt, LEFF_PURE);
+  lenv_add_builtin(e, "<=", builtin_le, LEFF_PURE);
+  lenv_add_builtin(e, ">=", builtin_ge, LEFF_PURE);
+  lenv_add_builtin(e, "==", builtin_eq, LEFF_PURE);
+  lenv_add_builtin(e, "!=", builtin_ne, LEFF_PURE);
+
+  // Vector functions
+  lenv_add_builtin(e, "vec", builtin_vec, LEFF_PURE);
+  lenv_add_builtin(e, "unvec", builtin_unvec, LEFF_PURE);
+  lenv_add_builtin(e, "sum", builtin_sum, LEFF_PURE);
+  lenv_add_builtin(e, "min", builtin_min, LEFF_PURE);
+  lenv_add_builtin(e, "max", builtin_max, LEFF_PURE);
+  lenv_add_builtin(e, "dot", builtin_dot, LEFF_PURE);
+
+  // Memo functions
+  lenv_add_builtin(e, "memo", builtin_memo, LEFF_PURE);
+  lenv_add_builtin(e, "memo-stats", builtin_memo_stats, LEFF_GLOBAL);
+  lenv_add_builtin(e, "pure?", builtin_pure, LEFF_GLOBAL);
+
+  // Reactive cells
+  lenv_add_builtin(e, "cell", builtin_cell, LEFF_GLOBAL);
+  lenv_add_builtin(e, "formula", builtin_formula, LEFF_GLOBAL);
+  lenv_add_builtin(e, "set", builtin_set, LEFF_GLOBAL);
+
+  // Dictionary functions
+  lenv_add_builtin(e, "dict", builtin_dict, LEFF_PURE);
+  lenv_add_builtin(e, "get", builtin_get, LEFF_PURE);
+  lenv_add_builtin(e, "put", builtin_put_key, LEFF_PURE);
+  lenv_add_builtin(e, "del", builtin_del_key, LEFF_PURE);
+  lenv_add_builtin(e, "has", builtin_has, LEFF_PURE);
+  lenv_add_builtin(e, "keys", builtin_keys, LEFF_PURE);
+  lenv_add_builtin(e, "vals", builtin_vals, LEFF_PURE);
+
+  // String functions
+  lenv_add_builtin(e, "concat", builtin_concat, LEFF_PURE);
+  lenv_add_builtin(e, "substr", builtin_substr, LEFF_PURE);
+  lenv_add_builtin(e, "split", builtin_split, LEFF_PURE);
+  lenv_add_builtin(e, "find", builtin_find, LEFF_PURE);
 
   // Math functions
-  lenv_add_builtin(e, "+", builtin_add);
-  lenv_add_builtin(e, "-", builtin_sub);
-  lenv_add_builtin(e, "*", builtin_mul);
-  lenv_add_builtin(e, "/", builtin_div);
-  lenv_add_builtin(e, "^", builtin_pow);
-  lenv_add_builtin(e, "%", builtin_dif);
+  lenv_add_builtin(e, "+", builtin_add, LEFF_PURE);
+  lenv_add_builtin(e, "-", builtin_sub, LEFF_PURE);
+  lenv_add_builtin(e, "*", builtin_mul, LEFF_PURE);
+  lenv_add_builtin(e, "/", builtin_div, LEFF_PURE);
+  lenv_add_builtin(e, "^", builtin_pow, LEFF_PURE);
+  lenv_add_builtin(e, "%", builtin_dif, LEFF_PURE);
 }
@@ -1,3 +1,7 @@
+#include <stdint.h>
+#include <stdio.h>
+
+#include "lbig.h"
 #include "mpc.h"
 
 #ifndef lval_h
@@ -5,8 +9,20 @@
 
 struct lval;
 struct lenv;
+struct ldict;
+struct lmemo;
+struct lseq;
+struct lcell;
 typedef struct lval lval;
 typedef struct lenv lenv;
+typedef struct ldict ldict;
+typedef struct lmemo lmemo;
+typedef struct lseq lseq;
+typedef struct lcell lcell;
+typedef struct lspec lspec;
+typedef struct lclo lclo;
+typedef struct lfuture lfuture;
+typedef struct lchan lchan;
 
 enum
 {
@@ -17,28 +33,131 @@ enum
     LVAL_SEXPR,
     LVAL_QEXPR,
     LVAL_NONE,
+    LVAL_VEC,
+    LVAL_DBL,
+    LVAL_BIG,
+    LVAL_DICT,
+    LVAL_STR,
+    LVAL_SEQ,
+    LVAL_CELL,
+    LVAL_FUTURE,
+    LVAL_CHAN,
 };
 
+// Effect class of builtin, given when it is registered
+enum
+{
+    LEFF_PURE,   // Result only depends on the arguments
+    LEFF_CODE,   // Evaluates quoted operands as code in place
+    LEFF_APPLY,  // Calls the function given as first argument
+    LEFF_LOCAL,  // Binds into the frame it is called from
+    LEFF_CHAN,   // Sends or receives on a channel
+    LEFF_GLOBAL, // Reads or changes global state
+    LEFF_IO,     // Input or output
+    LEFF_EVAL,   // Evaluates data as code
+};
+
+// Strings shorter than this are stored inline
+#define LSTR_SSO 16
+
 typedef lval *(*lbuiltin)(lenv *, lval *);
 
+// Buffer of long strings, shared between copies and slices
+typedef struct lbuf
+{
+    int ref;
+    char data[];
+} lbuf;
+
 struct lval
 {
     int type;
 
-    // Basic
-    long num;
-    char *err;
-    char *sym;
+    // Payload of the type, only the member of type is valid
+    union
+    {
+        // Basic
+        long num;
+        double dbl;
+        lbig *big;
+        char *err;
 
-    // Function
-    lenv *env;
-    lval *body;
-    lval *formals;
-    lbuiltin builtin;
+        // Function, builtin or memo when set, symbol otherwise too
+        struct
+        {
+            lbuiltin builtin;
 
-    // Expression
-    int count;
-    struct lval **cell;
+            // Cache of memo function, shared between copies
+            lmemo *memo;
+
+            union
+            {
+                // Builtin, and the name of symbol
+                struct
+                {
+                    char *sym;
+                    int effect;
+                };
+
+                // Lambda
+                struct
+                {
+                    lenv *env;
+                    lval *body;
+                    lval *formals;
+
+                    // Source of optimised body and the epoch it was
+                    // optimised at
+                    lval *src;
+                    long epoch;
+
+                    // Purity of lambda, valid while pure_epoch is the
+                    // current epoch
+                    int pure;
+                    long pure_epoch;
+
+                    // Argument types seen by lambda and its integer code
+                    lspec *spec;
+                };
+            };
+        };
+
+        // Expression, or vector holding count elements
+        struct
+        {
+            int count;
+            union
+            {
+                struct lval **cell;
+                int64_t *vec;
+            };
+        };
+
+        // Dictionary, shared between copies until modified
+        ldict *dict;
+
+        // String, bytes are at sso when buf is NULL otherwise at soff of buf
+        struct
+        {
+            lbuf *buf;
+            size_t soff;
+            size_t slen;
+            char sso[LSTR_SSO];
+        };
+
+        // Lazy sequence, stages are shared between copies
+        lseq *seq;
+
+        // Reactive cell, only ever bound in environment where reading
+        // the symbol gives its current value
+        lcell *rcell;
+
+        // Future, its result shared between copies
+        lfuture *fut;
+
+        // Channel, shared between copies and threads
+        lchan *chan;
+    };
 };
 
 struct lenv
@@ -47,30 +166,85 @@ struct lenv
     char **syms;
     lval **vals;
     lenv *par;
+    int global;
+
+    // Frame on the stack of a call, its arrays and names belong to the
+    // call until something binds into it
+    int stack;
+
+    // Frame of a loop, holding only the loop symbol. Binding anything
+    // else goes to the frame the loop runs in
+    int loop;
+
+    // Arrays and values a global environment replaced, which tasks on
+    // other threads may still read
+    struct lrcu_item *retired;
+
+    // Formulas computed in a global environment, told when a name they
+    // read is bound again
+    int nformulas;
+    lcell **formulas;
 };
 
 lenv *lenv_new(void);
 lval *lenv_get(lenv *e, lval *k);
+lval *lenv_find(lenv *e, lval *k);
 lenv *lenv_copy(lenv *e);
 void lenv_put(lenv *e, lval *k, lval *v);
 void lenv_def(lenv *e, lval *k, lval *v);
+lenv *lenv_local(lenv *e, lval *k);
 void lenv_del(lenv *e);
+void lenv_clear(lenv *e);
+
+// Bindings of global environment e as last published, count of them
+// returned, for reading on another thread between lrcu_enter and
+// lrcu_leave with e as owner
+int lenv_read(lenv *e, char ***syms, lval ***vals);
 void lenv_add_builtins(lenv *e);
 
 lval *lval_num(long n);
+lval *lval_dbl(double d);
 lval *lval_sym(char *s);
 lval *lval_err(char *fmt, ...);
 lval *lval_sexpr();
 lval *lval_qexpr();
+lval *lval_func(char *name, lbuiltin func, int effect);
+lval *lval_lambda(lval *formals, lval *body);
+lval *lval_vec(int n);
+lval *lval_dict(void);
+lval *lval_str(const char *s, size_t n);
+char *lval_str_ptr(lval *v);
+lval *lval_dict_items(lval *d, int keys, int vals);
 
 lval *lval_eval(lenv *e, lval *v);
+lval *lval_eval_expr(lenv *e, lval *v);
+lval *lval_eval_call(lenv *e, lval *v);
+int lfunc_lazy(lval *f);
+lval *lval_memo_call(lenv *e, lval *f, lval *a);
+lval *lval_body(lenv *e, lval *f);
+lval *lval_frame_call(lenv *e, lval *f, lval *a);
+lval *lval_apply(lenv *e, lval *f, lval *a);
+lval *lval_args(lval *x, lval *y);
 lval *lval_read(mpc_ast_t *t);
 
+lval *lval_push(lval *x, lval *y);
+lval *lval_pop(lval *v, int i);
+lval *lval_take(lval *v, int i);
+lval *lval_copy(lval *v);
 void lval_del(lval *v);
+int lval_eq(lval *x, lval *y);
+uint64_t lval_hash(lval *v);
+// Where printing goes, stdout unless a context captures it, and the
+// flag exit sets instead of ending the process when not NULL
+extern __thread FILE *lval_out;
+extern __thread int *lval_exit;
+FILE *lval_stream(void);
+
 void lval_print(lval *v);
 void lval_println(lval *v);
 
 lval *builtin_eval(lenv *e, lval *a);
 lval *builtin_list(lenv *e, lval *a);
+lval *builtin_let(lenv *e, lval *a);
 
 #endif
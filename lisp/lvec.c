@@ -0,0 +1,408 @@
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "lvec.h"
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <immintrin.h>
+#define LVEC_X86
+#endif
+
+/**
+ * ------------------------------------------------------------
+ * Element-wise kernels of packed vectors. Every kernel set has
+ * the same signature, the one matching the CPU is picked once
+ * at the first call.
+ * ------------------------------------------------------------
+ */
+
+// Run the expression over every element, x and y hold broadcast value
+#define LVEC_LOOP(expr)                                                        \
+  for (long i = 0; i < n; i++) {                                               \
+    int64_t a = bcast == LVEC_LEFT ? x[0] : x[i];                              \
+    int64_t b = bcast == LVEC_RIGHT ? y[0] : y[i];                             \
+    r[i] = (expr);                                                             \
+  }
+
+// Same with a checked builtin writing r[i], noting any overflow. The
+// scalar arithmetic goes on in bignum, vectors have no room for it.
+#define LVEC_CHECKED(fn)                                                       \
+  for (long i = 0; i < n; i++) {                                               \
+    int64_t a = bcast == LVEC_LEFT ? x[0] : x[i];                              \
+    int64_t b = bcast == LVEC_RIGHT ? y[0] : y[i];                             \
+    over |= fn(a, b, &r[i]);                                                   \
+  }
+
+// Division as a checked builtin, only the minimum over -1 overflows
+int lvec_div_overflow(int64_t a, int64_t b, int64_t *r) {
+  if (b == -1)
+    return __builtin_sub_overflow(0, a, r);
+  *r = a / b;
+  return 0;
+}
+
+int lvec_op_generic(int op, int64_t *r, const int64_t *x, const int64_t *y,
+                    long n, int bcast) {
+  // Check divisors up front so nothing is written on error
+  if (op == LVEC_DIV || op == LVEC_MOD) {
+    for (long i = 0; i < (bcast == LVEC_RIGHT ? 1 : n); i++) {
+      if (y[i] == 0)
+        return LVEC_ZERO;
+    }
+  }
+
+  int over = 0;
+  switch (op) {
+  case LVEC_ADD:
+    LVEC_CHECKED(__builtin_add_overflow);
+    break;
+  case LVEC_SUB:
+    LVEC_CHECKED(__builtin_sub_overflow);
+    break;
+  case LVEC_MUL:
+    LVEC_CHECKED(__builtin_mul_overflow);
+    break;
+  case LVEC_DIV:
+    LVEC_CHECKED(lvec_div_overflow);
+    break;
+  case LVEC_MOD:
+    LVEC_LOOP(b == -1 ? 0 : a % b);
+    break;
+  case LVEC_LT:
+    LVEC_LOOP(a < b);
+    break;
+  case LVEC_GT:
+    LVEC_LOOP(a > b);
+    break;
+  case LVEC_LE:
+    LVEC_LOOP(a <= b);
+    break;
+  case LVEC_GE:
+    LVEC_LOOP(a >= b);
+    break;
+  case LVEC_EQ:
+    LVEC_LOOP(a == b);
+    break;
+  case LVEC_NE:
+    LVEC_LOOP(a != b);
+    break;
+  }
+
+  return over ? LVEC_OVERFLOW : LVEC_OK;
+}
+
+int lvec_sum_generic(const int64_t *x, long n, int64_t *r) {
+  int64_t s = 0;
+  for (long i = 0; i < n; i++) {
+    if (__builtin_add_overflow(s, x[i], &s))
+      return 0;
+  }
+  *r = s;
+  return 1;
+}
+
+int64_t lvec_min_generic(const int64_t *x, long n) {
+  int64_t m = x[0];
+  for (long i = 1; i < n; i++) {
+    if (x[i] < m)
+      m = x[i];
+  }
+  return m;
+}
+
+int64_t lvec_max_generic(const int64_t *x, long n) {
+  int64_t m = x[0];
+  for (long i = 1; i < n; i++) {
+    if (x[i] > m)
+      m = x[i];
+  }
+  return m;
+}
+
+int lvec_dot_generic(const int64_t *x, const int64_t *y, long n,
+                     int64_t *r) {
+  int64_t s = 0, p;
+  for (long i = 0; i < n; i++) {
+    if (__builtin_mul_overflow(x[i], y[i], &p) ||
+        __builtin_add_overflow(s, p, &s))
+      return 0;
+  }
+  *r = s;
+  return 1;
+}
+
+#ifdef LVEC_X86
+
+/**
+ * -------------------------------------------------------------
+ * SSE4.2 and AVX2 kernels. Only addition, subtraction and the
+ * comparisons have 64 bit lanes before AVX-512, the rest of the
+ * operations are left to the generic kernel.
+ * -------------------------------------------------------------
+ */
+
+// Turn all ones compare mask into 1 and the inverse of it into 0
+#define LVEC_BOOL128(m) _mm_sub_epi64(_mm_setzero_si128(), (m))
+#define LVEC_BOOL256(m) _mm256_sub_epi64(_mm256_setzero_si256(), (m))
+
+// Sign bit set in the lanes where sum v of a and b, or difference v
+// of a less b, overflowed
+#define LVEC_ADD_OVER128(a, b, v)                                              \
+  _mm_and_si128(_mm_xor_si128(a, v), _mm_xor_si128(b, v))
+#define LVEC_SUB_OVER128(a, b, v)                                              \
+  _mm_and_si128(_mm_xor_si128(a, b), _mm_xor_si128(a, v))
+#define LVEC_ADD_OVER256(a, b, v)                                              \
+  _mm256_and_si256(_mm256_xor_si256(a, v), _mm256_xor_si256(b, v))
+#define LVEC_SUB_OVER256(a, b, v)                                              \
+  _mm256_and_si256(_mm256_xor_si256(a, b), _mm256_xor_si256(a, v))
+
+__attribute__((target("sse4.2"))) int
+lvec_op_sse(int op, int64_t *r, const int64_t *x, const int64_t *y, long n,
+            int bcast) {
+  if (op > LVEC_SUB && op < LVEC_LT)
+    return lvec_op_generic(op, r, x, y, n, bcast);
+
+  __m128i one = _mm_set1_epi64x(1);
+  __m128i sx = _mm_set1_epi64x(x[0]);
+  __m128i sy = _mm_set1_epi64x(y[0]);
+  __m128i over = _mm_setzero_si128();
+
+  long i = 0;
+  for (; i + 2 <= n; i += 2) {
+    __m128i a = bcast == LVEC_LEFT ? sx : _mm_loadu_si128((__m128i *)(x + i));
+    __m128i b = bcast == LVEC_RIGHT ? sy : _mm_loadu_si128((__m128i *)(y + i));
+    __m128i v;
+
+    switch (op) {
+    case LVEC_ADD:
+      v = _mm_add_epi64(a, b);
+      over = _mm_or_si128(over, LVEC_ADD_OVER128(a, b, v));
+      break;
+    case LVEC_SUB:
+      v = _mm_sub_epi64(a, b);
+      over = _mm_or_si128(over, LVEC_SUB_OVER128(a, b, v));
+      break;
+    case LVEC_LT:
+      v = LVEC_BOOL128(_mm_cmpgt_epi64(b, a));
+      break;
+    case LVEC_GT:
+      v = LVEC_BOOL128(_mm_cmpgt_epi64(a, b));
+      break;
+    case LVEC_LE:
+      v = _mm_sub_epi64(one, LVEC_BOOL128(_mm_cmpgt_epi64(a, b)));
+      break;
+    case LVEC_GE:
+      v = _mm_sub_epi64(one, LVEC_BOOL128(_mm_cmpgt_epi64(b, a)));
+      break;
+    case LVEC_EQ:
+      v = LVEC_BOOL128(_mm_cmpeq_epi64(a, b));
+      break;
+    default:
+      v = _mm_sub_epi64(one, LVEC_BOOL128(_mm_cmpeq_epi64(a, b)));
+      break;
+    }
+
+    _mm_storeu_si128((__m128i *)(r + i), v);
+  }
+
+  // Leftover element goes through the generic kernel
+  int res = LVEC_OK;
+  if (i < n) {
+    res = lvec_op_generic(op, r + i, bcast == LVEC_LEFT ? x : x + i,
+                          bcast == LVEC_RIGHT ? y : y + i, n - i, bcast);
+  }
+
+  if (_mm_movemask_pd(_mm_castsi128_pd(over)))
+    return LVEC_OVERFLOW;
+  return res;
+}
+
+__attribute__((target("avx2"))) int
+lvec_op_avx2(int op, int64_t *r, const int64_t *x, const int64_t *y, long n,
+             int bcast) {
+  if (op > LVEC_SUB && op < LVEC_LT)
+    return lvec_op_generic(op, r, x, y, n, bcast);
+
+  __m256i one = _mm256_set1_epi64x(1);
+  __m256i sx = _mm256_set1_epi64x(x[0]);
+  __m256i sy = _mm256_set1_epi64x(y[0]);
+  __m256i over = _mm256_setzero_si256();
+
+  long i = 0;
+  for (; i + 4 <= n; i += 4) {
+    __m256i a =
+        bcast == LVEC_LEFT ? sx : _mm256_loadu_si256((__m256i *)(x + i));
+    __m256i b =
+        bcast == LVEC_RIGHT ? sy : _mm256_loadu_si256((__m256i *)(y + i));
+    __m256i v;
+
+    switch (op) {
+    case LVEC_ADD:
+      v = _mm256_add_epi64(a, b);
+      over = _mm256_or_si256(over, LVEC_ADD_OVER256(a, b, v));
+      break;
+    case LVEC_SUB:
+      v = _mm256_sub_epi64(a, b);
+      over = _mm256_or_si256(over, LVEC_SUB_OVER256(a, b, v));
+      break;
+    case LVEC_LT:
+      v = LVEC_BOOL256(_mm256_cmpgt_epi64(b, a));
+      break;
+    case LVEC_GT:
+      v = LVEC_BOOL256(_mm256_cmpgt_epi64(a, b));
+      break;
+    case LVEC_LE:
+      v = _mm256_sub_epi64(one, LVEC_BOOL256(_mm256_cmpgt_epi64(a, b)));
+      break;
+    case LVEC_GE:
+      v = _mm256_sub_epi64(one, LVEC_BOOL256(_mm256_cmpgt_epi64(b, a)));
+      break;
+    case LVEC_EQ:
+      v = LVEC_BOOL256(_mm256_cmpeq_epi64(a, b));
+      break;
+    default:
+      v = _mm256_sub_epi64(one, LVEC_BOOL256(_mm256_cmpeq_epi64(a, b)));
+      break;
+    }
+
+    _mm256_storeu_si256((__m256i *)(r + i), v);
+  }
+
+  int res = LVEC_OK;
+  if (i < n) {
+    res = lvec_op_generic(op, r + i, bcast == LVEC_LEFT ? x : x + i,
+                          bcast == LVEC_RIGHT ? y : y + i, n - i, bcast);
+  }
+
+  if (_mm256_movemask_pd(_mm256_castsi256_pd(over)))
+    return LVEC_OVERFLOW;
+  return res;
+}
+
+// Each lane sums its own elements. An overflow in any of them counts
+// even if the total would fit, the caller then sums exactly.
+__attribute__((target("avx2"))) int lvec_sum_avx2(const int64_t *x, long n,
+                                                  int64_t *r) {
+  __m256i s = _mm256_setzero_si256();
+  __m256i over = _mm256_setzero_si256();
+
+  long i = 0;
+  for (; i + 4 <= n; i += 4) {
+    __m256i v = _mm256_loadu_si256((__m256i *)(x + i));
+    __m256i t = _mm256_add_epi64(s, v);
+    over = _mm256_or_si256(over, LVEC_ADD_OVER256(s, v, t));
+    s = t;
+  }
+
+  int64_t lane[5];
+  _mm256_storeu_si256((__m256i *)lane, s);
+  if (_mm256_movemask_pd(_mm256_castsi256_pd(over)) ||
+      !lvec_sum_generic(x + i, n - i, &lane[4]))
+    return 0;
+
+  return lvec_sum_generic(lane, 5, r);
+}
+
+// Minimum or maximum of all lanes, picked by comparing then blending
+__attribute__((target("avx2"))) int64_t lvec_minmax_avx2(const int64_t *x,
+                                                         long n, int max) {
+  if (n < 4)
+    return max ? lvec_max_generic(x, n) : lvec_min_generic(x, n);
+
+  __m256i m = _mm256_loadu_si256((__m256i *)x);
+
+  long i = 4;
+  for (; i + 4 <= n; i += 4) {
+    __m256i v = _mm256_loadu_si256((__m256i *)(x + i));
+    __m256i gt = max ? _mm256_cmpgt_epi64(v, m) : _mm256_cmpgt_epi64(m, v);
+    m = _mm256_blendv_epi8(m, v, gt);
+  }
+
+  int64_t lane[5];
+  _mm256_storeu_si256((__m256i *)lane, m);
+  lane[4] = lane[0];
+  if (i < n)
+    lane[4] = max ? lvec_max_generic(x + i, n - i)
+                  : lvec_min_generic(x + i, n - i);
+
+  return max ? lvec_max_generic(lane, 5) : lvec_min_generic(lane, 5);
+}
+
+__attribute__((target("avx2"))) int64_t lvec_min_avx2(const int64_t *x,
+                                                      long n) {
+  return lvec_minmax_avx2(x, n, 0);
+}
+
+__attribute__((target("avx2"))) int64_t lvec_max_avx2(const int64_t *x,
+                                                      long n) {
+  return lvec_minmax_avx2(x, n, 1);
+}
+
+#endif
+
+/**
+ * ---------------------------------------------
+ * Runtime dispatch to the best kernel available
+ * ---------------------------------------------
+ */
+
+typedef struct {
+  const char *isa;
+  int (*op)(int, int64_t *, const int64_t *, const int64_t *, long, int);
+  int (*sum)(const int64_t *, long, int64_t *);
+  int64_t (*min)(const int64_t *, long);
+  int64_t (*max)(const int64_t *, long);
+  int (*dot)(const int64_t *, const int64_t *, long, int64_t *);
+} lvec_kernels;
+
+lvec_kernels lvec_generic = {"generic",        lvec_op_generic,
+                             lvec_sum_generic, lvec_min_generic,
+                             lvec_max_generic, lvec_dot_generic};
+
+#ifdef LVEC_X86
+lvec_kernels lvec_sse = {"sse4.2",         lvec_op_sse,
+                         lvec_sum_generic, lvec_min_generic,
+                         lvec_max_generic, lvec_dot_generic};
+
+lvec_kernels lvec_avx2 = {"avx2",        lvec_op_avx2,  lvec_sum_avx2,
+                          lvec_min_avx2, lvec_max_avx2, lvec_dot_generic};
+#endif
+
+// Chosen once, threads of the pool may ask for them at the same time
+lvec_kernels *lvec_chosen = &lvec_generic;
+pthread_once_t lvec_once = PTHREAD_ONCE_INIT;
+
+void lvec_choose(void) {
+#ifdef LVEC_X86
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2"))
+    lvec_chosen = &lvec_avx2;
+  else if (__builtin_cpu_supports("sse4.2"))
+    lvec_chosen = &lvec_sse;
+#endif
+}
+
+lvec_kernels *lvec_select(void) {
+  pthread_once(&lvec_once, lvec_choose);
+  return lvec_chosen;
+}
+
+int lvec_op(int op, int64_t *r, const int64_t *x, const int64_t *y, long n,
+            int bcast) {
+  return lvec_select()->op(op, r, x, y, n, bcast);
+}
+
+int lvec_sum(const int64_t *x, long n, int64_t *r) {
+  return lvec_select()->sum(x, n, r);
+}
+
+int64_t lvec_min(const int64_t *x, long n) { return lvec_select()->min(x, n); }
+
+int64_t lvec_max(const int64_t *x, long n) { return lvec_select()->max(x, n); }
+
+int lvec_dot(const int64_t *x, const int64_t *y, long n, int64_t *r) {
+  return lvec_select()->dot(x, y, n, r);
+}
+
+const char *lvec_isa(void) { return lvec_select()->isa; }
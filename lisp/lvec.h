@@ -0,0 +1,54 @@
+#include <stdint.h>
+
+#ifndef lvec_h
+#define lvec_h
+
+// Element-wise operations of vector kernels
+enum
+{
+    LVEC_ADD,
+    LVEC_SUB,
+    LVEC_MUL,
+    LVEC_DIV,
+    LVEC_MOD,
+    LVEC_LT,
+    LVEC_GT,
+    LVEC_LE,
+    LVEC_GE,
+    LVEC_EQ,
+    LVEC_NE,
+};
+
+// Which side of operation is a single value broadcast to every element
+enum
+{
+    LVEC_NONE,
+    LVEC_LEFT,
+    LVEC_RIGHT,
+};
+
+// Outcome of element-wise operation
+enum
+{
+    LVEC_OK,
+    LVEC_ZERO,
+    LVEC_OVERFLOW,
+};
+
+// Apply op element-wise and write it into r, which may alias x or y.
+// Return LVEC_ZERO on a zero divisor, with nothing written, and
+// LVEC_OVERFLOW when a result does not fit into 64 bits.
+int lvec_op(int op, int64_t *r, const int64_t *x, const int64_t *y, long n,
+            int bcast);
+
+// Sum and dot product write the result into r, and return 0 when it
+// overflowed on the way
+int lvec_sum(const int64_t *x, long n, int64_t *r);
+int64_t lvec_min(const int64_t *x, long n);
+int64_t lvec_max(const int64_t *x, long n);
+int lvec_dot(const int64_t *x, const int64_t *y, long n, int64_t *r);
+
+// Name of kernel set chosen for this CPU
+const char *lvec_isa(void);
+
+#endif
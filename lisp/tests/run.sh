@@ -0,0 +1,22 @@
+#!/bin/sh
+# Run every script of this directory through the prompt of the lispy
+# given, default ./lispy, and compare what it prints after the banner
+# with the .out file of the same name. Extra arguments go to lispy.
+#
+#   sh tests/run.sh ./lispy [--closure|--jit]
+
+dir=$(dirname "$0")
+lispy=${1:-./lispy}
+[ $# -gt 0 ] && shift
+
+failed=0
+for t in "$dir"/*.lspy; do
+    name=$(basename "$t" .lspy)
+    if "$lispy" "$@" < "$t" 2>&1 | tail -n +4 | diff - "$dir/$name.out"; then
+        echo "ok   $name"
+    else
+        echo "FAIL $name"
+        failed=1
+    fi
+done
+exit $failed